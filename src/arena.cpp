@@ -0,0 +1,66 @@
+#include "arena.h"
+
+#include <cstdlib>
+#include <stdint.h>
+
+using namespace Monty;
+
+Arena::Arena(size_t blockSize) : blocks(NULL), cur(NULL), end(NULL), blockSize(blockSize), used(0), destructors(NULL)
+{
+}
+
+Arena::~Arena()
+{
+    for (Destructor * d = destructors; d; d = d->next) {
+        d->destroy(d->object);
+    }
+
+    while (blocks) {
+        Block * next = blocks->next;
+
+        free(blocks);
+        blocks = next;
+    }
+}
+
+void * Arena::allocate(size_t size, size_t align)
+{
+    char * p = (char *)(((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1));
+
+    if (! cur || p + size > end) {
+        // blocks double in size so that a tree of any size takes a handful
+        // of mallocs; the block header keeps max_align_t alignment
+        size_t header = (sizeof(Block) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+        size_t capacity = blockSize;
+
+        while (capacity < size + align) capacity *= 2;
+
+        Block * b = static_cast<Block *>(malloc(header + capacity));
+
+        if (! b) throw std::bad_alloc();
+
+        b->next = blocks;
+        b->size = capacity;
+        blocks = b;
+
+        cur = (char *)b + header;
+        end = cur + capacity;
+        blockSize *= 2;
+
+        p = (char *)(((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1));
+    }
+
+    cur = p + size;
+    used += size;
+
+    return p;
+}
+
+void Arena::print(std::ostream & out) const
+{
+    size_t count = 0;
+
+    for (Block * b = blocks; b; b = b->next) count++;
+
+    out << "Arena(blocks=" << count << ", used=" << used << ")";
+}
@@ -0,0 +1,84 @@
+#ifndef MONTY_ARENA_H
+#define MONTY_ARENA_H
+
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cstddef>
+
+#include "object.h"
+
+namespace Monty {
+
+/* A bump allocator.  Objects are carved out of large blocks one after the
+ * other and are never freed individually; destroying the arena runs the
+ * destructors of everything made in it, newest first, and then frees the
+ * blocks.  A Rule keeps its whole tree in one, so nodes are laid out in
+ * parse order and can point at each other with plain pointers. */
+class Arena: public Object {
+    struct Block {
+        Block * next;
+        size_t size;
+    };
+
+    struct Destructor {
+        void (*destroy)(void *);
+        void * object;
+        Destructor * next;
+    };
+
+    Block * blocks;
+    char * cur;
+    char * end;
+    size_t blockSize;
+    size_t used;
+    Destructor * destructors;
+
+    Arena(const Arena &);
+    Arena & operator=(const Arena &);
+
+public:
+    Arena(size_t blockSize = 4096);
+    ~Arena();
+
+    void * allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+    template <typename T, typename... Args>
+    T * make(Args &&... args)
+    {
+        Destructor * d = NULL;
+
+        // registered before construction so that running out of memory
+        // can't leave a constructed object without its destructor
+        if (! std::is_trivially_destructible<T>::value) {
+            d = static_cast<Destructor *>(allocate(sizeof(Destructor), alignof(Destructor)));
+        }
+
+        T * t = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+
+        if (d) {
+            d->destroy = &destroy<T>;
+            d->object = t;
+            d->next = destructors;
+            destructors = d;
+        }
+
+        return t;
+    }
+
+    // bytes handed out so far
+    size_t size() const { return used; }
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    template <typename T>
+    static void destroy(void * p)
+    {
+        static_cast<T *>(p)->~T();
+    }
+};
+
+}
+
+#endif
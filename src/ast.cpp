@@ -1,5 +1,8 @@
 #include "ast.h"
 
+#include <algorithm>
+#include <chrono>
+
 using namespace Monty::AST;
 
 std::string BinaryType::names[] = {
@@ -17,7 +20,300 @@ std::string BinaryType::names[] = {
     "SGE",
 };
 
+const uint32_t Expression::unshared;
+
 std::string LogicalType::names[] = {
     "AND",
     "OR",
 };
+
+Logical::Logical(Logical::Type t, const std::vector<Expression *> & c) : type(t), clauses(c), order(0), samples(0)
+{
+    if (clauses.size() <= maxAdaptive) {
+        stats.reset(new ClauseStats[clauses.size()]);
+
+        uint64_t identity = 0;
+        for (size_t i = 0; i < clauses.size(); i++) identity |= (uint64_t)i << (i * 4);
+
+        order.store(identity);
+    }
+}
+
+std::vector<size_t> Logical::getOrder() const
+{
+    std::vector<size_t> out;
+    uint64_t o = order.load();
+
+    for (size_t i = 0; i < clauses.size(); i++) {
+        out.push_back(stats ? (size_t)(o & 15) : i);
+        o >>= 4;
+    }
+
+    return out;
+}
+
+void Memo::reset(size_t slots)
+{
+    if (stamps.size() < slots) {
+        stamps.resize(slots);
+        results.resize(slots);
+    }
+
+    if (++generation == 0) {
+        std::fill(stamps.begin(), stamps.end(), 0);
+        generation = 1;
+    }
+}
+
+bool Logical::eval(const Message & msg) const
+{
+    return run(msg, NULL);
+}
+
+bool Logical::run(const Message & msg, Memo * memo) const
+{
+    bool all = type == Logical::Type::AND;
+
+    if (! stats) {
+        for (std::vector<Expression *>::const_iterator it = clauses.begin(); it != clauses.end(); it++) {
+            if (clause(*it, msg, memo) != all) return ! all;
+        }
+
+        // AND falls through when every clause held, OR when none did
+        return all;
+    }
+
+    // xorshift rather than a counter, which could beat with a workload that
+    // repeats, and always sample the same kind of message
+    static thread_local uint32_t random = 2463534242u;
+
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+
+    if ((random & (sampleRate - 1)) == 0) return sample(msg, memo);
+
+    uint64_t o = order.load(std::memory_order_relaxed);
+
+    for (size_t i = 0; i < clauses.size(); i++, o >>= 4) {
+        if (clause(clauses[o & 15], msg, memo) != all) return ! all;
+    }
+
+    return all;
+}
+
+/* Every clause is evaluated, so that clauses ranked late are still measured,
+ * and the result combined as the short circuited evaluation would. */
+bool Logical::sample(const Message & msg, Memo * memo) const
+{
+    bool all = type == Logical::Type::AND;
+    bool result = all;
+
+    for (size_t i = 0; i < clauses.size(); i++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool decisive = clause(clauses[i], msg, memo) != all;
+        uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        if (decisive) result = ! all;
+
+        // a thread descheduled mid clause would otherwise swamp the mean
+        uint64_t n = stats[i].evaluations.load(std::memory_order_relaxed);
+        if (n >= 8) nanos = std::min(nanos, 8 * stats[i].nanos.load(std::memory_order_relaxed) / n + 1);
+
+        stats[i].evaluations.fetch_add(1, std::memory_order_relaxed);
+        stats[i].nanos.fetch_add(nanos, std::memory_order_relaxed);
+        if (decisive) stats[i].decisive.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if ((samples.fetch_add(1, std::memory_order_relaxed) + 1) % adaptEvery == 0) adapt();
+
+    return result;
+}
+
+/* With independent clauses, evaluating in ascending order of cost over
+ * probability of being decisive minimizes the expected cost.  Counts are
+ * read and halved without a lock; a sample lost to a race only blurs the
+ * estimate. */
+void Logical::adapt() const
+{
+    if (! stats) return;
+
+    std::vector<std::pair<double, size_t> > ranks;
+
+    for (size_t i = 0; i < clauses.size(); i++) {
+        uint64_t n = stats[i].evaluations.load(std::memory_order_relaxed);
+        uint64_t d = stats[i].decisive.load(std::memory_order_relaxed);
+        uint64_t t = stats[i].nanos.load(std::memory_order_relaxed);
+
+        // one pseudo-observation each keeps unseen clauses finite
+        double cost = (t + 1.0) / (n + 1.0);
+        double p = (d + 1.0) / (n + 2.0);
+
+        ranks.push_back(std::make_pair(cost / p, i));
+
+        stats[i].evaluations.store(n / 2, std::memory_order_relaxed);
+        stats[i].decisive.store(d / 2, std::memory_order_relaxed);
+        stats[i].nanos.store(t / 2, std::memory_order_relaxed);
+    }
+
+    std::stable_sort(ranks.begin(), ranks.end());
+
+    uint64_t o = 0;
+    for (size_t i = 0; i < ranks.size(); i++) o |= (uint64_t)ranks[i].second << (i * 4);
+
+    order.store(o, std::memory_order_relaxed);
+}
+
+void Monty::AST::flatten(Base * root, std::vector<Base *> & out)
+{
+    out.push_back(root);
+
+    std::vector<Base *> children;
+    root->getChildren(children);
+
+    for (std::vector<Base *>::const_iterator it = children.begin(); it != children.end(); it++) {
+        flatten(*it, out);
+    }
+}
+
+bool Monty::AST::equal(const Base * a, const Base * b)
+{
+    if (a == b) return true;
+    if (a->kind() != b->kind()) return false;
+
+    switch (a->kind()) {
+        case Base::Kind::VALUE: {
+            const Scalar & l = static_cast<const Value *>(a)->value;
+            const Scalar & r = static_cast<const Value *>(b)->value;
+
+            return l.getType() == r.getType() && l.textEquals(r);
+        }
+        case Base::Kind::LOOKUP:
+            return static_cast<const Lookup *>(a)->getKey() == static_cast<const Lookup *>(b)->getKey();
+        case Base::Kind::BINARY:
+            if (static_cast<const Binary *>(a)->getType() != static_cast<const Binary *>(b)->getType()) return false;
+            break;
+        case Base::Kind::LOGICAL:
+            if (static_cast<const Logical *>(a)->getType() != static_cast<const Logical *>(b)->getType()) return false;
+            break;
+        case Base::Kind::CONSTANT:
+            return static_cast<const Constant *>(a)->getValue() == static_cast<const Constant *>(b)->getValue();
+        case Base::Kind::PRODUCTION: {
+            const Production * l = static_cast<const Production *>(a);
+            const Production * r = static_cast<const Production *>(b);
+
+            if (l->getService() != r->getService()) return false;
+            if (l->getPath().size() != r->getPath().size()) return false;
+            if (l->getParams().size() != r->getParams().size()) return false;
+
+            for (size_t i = 0; i < l->getParams().size(); i++) {
+                if (l->getParams()[i].first != r->getParams()[i].first) return false;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    std::vector<Base *> lchildren;
+    std::vector<Base *> rchildren;
+
+    a->getChildren(lchildren);
+    b->getChildren(rchildren);
+
+    if (lchildren.size() != rchildren.size()) return false;
+
+    for (size_t i = 0; i < lchildren.size(); i++) {
+        if (! equal(lchildren[i], rchildren[i])) return false;
+    }
+
+    return true;
+}
+
+void Monty::AST::required(const Expression * e, std::vector<std::string> & keys)
+{
+    if (e->kind() == Base::Kind::BINARY) {
+        const Binary * b = static_cast<const Binary *>(e);
+        const Arg * l = b->getLeft();
+        const Arg * r = b->getRight();
+
+        if (l->kind() == Base::Kind::LOOKUP && r->kind() == Base::Kind::VALUE) {
+            if (! Binary::compare(b->getType(), Message::empty, static_cast<const Value *>(r)->value)) keys.push_back(static_cast<const Lookup *>(l)->getKey());
+        } else if (l->kind() == Base::Kind::VALUE && r->kind() == Base::Kind::LOOKUP) {
+            if (! Binary::compare(b->getType(), static_cast<const Value *>(l)->value, Message::empty)) keys.push_back(static_cast<const Lookup *>(r)->getKey());
+        }
+
+        return;
+    }
+
+    if (e->kind() != Base::Kind::LOGICAL) return;
+
+    const Logical * l = static_cast<const Logical *>(e);
+    const std::vector<Expression *> & clauses = l->getClauses();
+
+    if (l->getType() == Logical::Type::AND) {
+        for (std::vector<Expression *>::const_iterator it = clauses.begin(); it != clauses.end(); it++) {
+            required(*it, keys);
+        }
+
+        return;
+    }
+
+    // an OR needs a key only if every clause does
+    std::vector<std::string> common;
+
+    for (std::vector<Expression *>::const_iterator it = clauses.begin(); it != clauses.end(); it++) {
+        std::vector<std::string> needs;
+
+        required(*it, needs);
+
+        if (it == clauses.begin()) {
+            common.swap(needs);
+            continue;
+        }
+
+        std::vector<std::string> kept;
+
+        for (std::vector<std::string>::const_iterator k = common.begin(); k != common.end(); k++) {
+            if (std::find(needs.begin(), needs.end(), *k) != needs.end()) kept.push_back(*k);
+        }
+
+        common.swap(kept);
+    }
+
+    keys.insert(keys.end(), common.begin(), common.end());
+}
+
+/* Values are encoded into the literal text here, once, so exec only has the
+ * Lookups left to encode. */
+void Production::render()
+{
+    Segment current;
+
+    current.literal = service;
+
+    std::vector<std::pair<std::string, Arg *> > args;
+
+    for (std::vector<Arg *>::const_iterator it = path.begin(); it != path.end(); it++) {
+        args.push_back(std::make_pair(std::string("/"), *it));
+    }
+
+    for (std::vector<std::pair<std::string, Arg *> >::const_iterator it = params.begin(); it != params.end(); it++) {
+        args.push_back(std::make_pair((it == params.begin() ? "?" : "&") + it->first + "=", it->second));
+    }
+
+    for (std::vector<std::pair<std::string, Arg *> >::const_iterator it = args.begin(); it != args.end(); it++) {
+        current.literal.append(it->first);
+
+        if (it->second->kind() == Base::Kind::VALUE) {
+            Url::encode(static_cast<Value *>(it->second)->value.getText(), current.literal);
+        } else {
+            current.lookup = static_cast<Lookup *>(it->second);
+            segments.push_back(current);
+
+            current = Segment();
+        }
+    }
+
+    if (current.literal.size() || segments.empty()) segments.push_back(current);
+}
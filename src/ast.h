@@ -1,24 +1,81 @@
 #ifndef MONTY_AST_H
 #define MONTY_AST_H
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <sstream>
 #include <vector>
 #include <cstdlib>
-#include <memory>
+#include <stdint.h>
 
 #include "message.h"
 #include "object.h"
+#include "scalar.h"
+#include "schema.h"
+#include "url.h"
 
 #include <assert.h>
 
 namespace Monty {
+
+class Pool;
+
 namespace AST {
 
+/* Nodes point at their children without owning them; a whole tree lives in
+ * the Arena it was parsed into and is destroyed with it. */
 class Base: public Object {
 
 public:
+    enum Kind {
+        VALUE,
+        LOOKUP,
+        BINARY,
+        LOGICAL,
+        CONDITIONAL,
+        PRODUCTION,
+        CONSTANT,
+    };
+
     virtual ~Base() {}
+
+    virtual Base::Kind kind() const = 0;
+
+    virtual void getChildren(std::vector<Base *> & out) const {}
+};
+
+/* Appends root and every node below it to out, in pre-order. */
+void flatten(Base * root, std::vector<Base *> & out);
+
+/* True if a and b are structurally identical trees. */
+bool equal(const Base * a, const Base * b);
+
+class Expression;
+
+/* Appends to keys every key that e needs: with any one of them missing from
+ * a message, e is false whatever else the message holds.  A missing key
+ * reads as Message::empty, so a comparison needs its key when comparing the
+ * empty value to the other side is false.  An AND needs what any of its
+ * clauses needs, an OR only what all of them do.  Keys may repeat. */
+void required(const Expression * e, std::vector<std::string> & keys);
+
+/* Results of the expressions a Pool has shared between rules, for one
+ * message at a time.  Each shared expression owns a slot; a slot is valid
+ * while its stamp matches the generation, so starting the next message only
+ * bumps the generation. */
+class Memo {
+    friend class Expression;
+
+    std::vector<uint32_t> stamps;
+    std::vector<uint8_t> results;
+    uint32_t generation;
+
+public:
+    Memo() : generation(0) { }
+
+    // forgets every result, making room for slots of them
+    void reset(size_t slots);
 };
 
 class Statement: public Base {
@@ -26,15 +83,64 @@ class Statement: public Base {
 public:
     virtual ~Statement() {}
 
-    virtual std::string exec(const Message & msg) = 0;
+    /* Appends the production for msg to out, so one buffer can be reused
+     * across messages. */
+    virtual void exec(const Message & msg, std::string & out) const = 0;
+
+    // as above, evaluating shared expressions through memo
+    virtual void exec(const Message & msg, std::string & out, Memo & memo) const
+    {
+        exec(msg, out);
+    }
+
+    std::string exec(const Message & msg) const
+    {
+        std::string out;
+
+        exec(msg, out);
+
+        return out;
+    }
 };
 
 class Expression: public Base {
+    friend class Monty::Pool;
+
+    // the Memo slot of an expression shared between rules
+    uint32_t shared;
 
 public:
+    static const uint32_t unshared = UINT32_MAX;
+
+    Expression() : shared(unshared) { }
     virtual ~Expression() {}
 
-    virtual bool eval(const Message & msg) = 0;
+    virtual bool eval(const Message & msg) const = 0;
+
+    uint32_t getShared() const { return shared; }
+
+    /* As eval, but a shared expression is evaluated at most once per
+     * message, its result kept in memo for every other rule that uses it. */
+    bool eval(const Message & msg, Memo & memo) const
+    {
+        if (shared == unshared) return evalWith(msg, memo);
+
+        if (memo.stamps[shared] == memo.generation) return memo.results[shared];
+
+        bool result = evalWith(msg, memo);
+
+        memo.stamps[shared] = memo.generation;
+        memo.results[shared] = result;
+
+        return result;
+    }
+
+protected:
+    // evaluates this node for eval with a memo, passing it on to children
+    virtual bool evalWith(const Message & msg, Memo & memo) const
+    {
+        return eval(msg);
+    }
 };
 
 class Arg: public Base {
@@ -42,16 +148,19 @@ class Arg: public Base {
 public:
     virtual ~Arg() {}
 
-    virtual std::string getValue(const Message & msg) = 0;
+    virtual const Scalar & getValue(const Message & msg) const = 0;
 };
 
 class Value: public Arg {
 
 public:
-    std::string value;
+    Scalar value;
     Value(const std::string & s) : value(s) {}
+    Value(const Scalar & s) : value(s) {}
+
+    virtual Base::Kind kind() const { return Base::Kind::VALUE; }
 
-    virtual std::string getValue(const Message & msg)
+    virtual const Scalar & getValue(const Message & msg) const
     {
         return value;
     }
@@ -64,13 +173,31 @@ public:
 
 class Lookup: public Arg {
     std::string key;
+    const Schema * schema;
+    int slot;
 
 public:
-    Lookup(const std::string & s) : key(s) { }
+    Lookup(const std::string & s) : key(s), schema(NULL), slot(-1) { }
+
+    virtual Base::Kind kind() const { return Base::Kind::LOOKUP; }
+
+    const std::string & getKey() const { return key; }
 
-    virtual std::string getValue(const Message & msg)
+    /* Resolves key to its slot in schema up front.  Messages parsed against
+     * the same schema are then read by index rather than by key. */
+    void bind(const Schema & s)
     {
-        return msg.get(key);
+        schema = &s;
+        slot = s.slot(key);
+    }
+
+    virtual const Scalar & getValue(const Message & msg) const
+    {
+        if (schema && msg.getSchema() == schema) {
+            return msg.lookup(slot);
+        }
+
+        return msg.lookup(key);
     }
 
     virtual void print(std::ostream & out) const
@@ -104,44 +231,56 @@ public:
 
 private:
     Binary::Type type;
-    std::shared_ptr<Arg> left;
-    std::shared_ptr<Arg> right;
+    Arg * left;
+    Arg * right;
 
 public:
-    Binary(Binary::Type t, std::shared_ptr<Arg> left, std::shared_ptr<Arg> right) : type(t), left(left), right(right) { }
-    
-    virtual bool eval(const Message & msg)
+    Binary(Binary::Type t, Arg * left, Arg * right) : type(t), left(left), right(right) { }
+
+    virtual Base::Kind kind() const { return Base::Kind::BINARY; }
+
+    Binary::Type getType() const { return type; }
+    Arg * getLeft() const { return left; }
+    Arg * getRight() const { return right; }
+
+    virtual void getChildren(std::vector<Base *> & out) const
+    {
+        out.push_back(left);
+        out.push_back(right);
+    }
+
+    virtual bool eval(const Message & msg) const
+    {
+        return compare(type, left->getValue(msg), right->getValue(msg));
+    }
+
+    /* EQ through GE compare numerically, exactly when both sides are integral
+     * and as doubles otherwise.  The S variants compare text. */
+    static bool compare(Binary::Type type, const Scalar & l, const Scalar & r)
     {
-        std::string lstring = left->getValue(msg);
-        std::string rstring = right->getValue(msg);
-        const char * lchar = lstring.c_str();
-        const char * rchar = rstring.c_str();
+        if (type < SEQ) {
+            if (l.isIntegral() && r.isIntegral()) {
+                return compareNumbers(type, l.getInteger(), r.getInteger());
+            }
+
+            return compareNumbers(type, l.getDouble(), r.getDouble());
+        }
+
+        // equality needn't look at the bytes when the strings are interned
+        if (type == SEQ) return l.textEquals(r);
+        if (type == SNE) return ! l.textEquals(r);
+
+        int c = l.getText().compare(r.getText());
 
         switch (type) {
-            case EQ:
-                return std::atoi(lchar) == std::atoi(rchar);
-            case NE:
-                return std::atoi(lchar) != std::atoi(rchar);
-            case LT:
-                return std::atoi(lchar) < std::atoi(rchar);
-            case LE:
-                return std::atoi(lchar) <= std::atoi(rchar);
-            case GT:
-                return std::atoi(lchar) > std::atoi(rchar);
-            case GE:
-                return std::atoi(lchar) >= std::atoi(rchar);
-            case SEQ:
-                return lstring.compare(rstring) == 0;
-            case SNE:
-                return lstring.compare(rstring) != 0;
             case SLT:
-                return lstring.compare(rstring) < 0;
+                return c < 0;
             case SLE:
-                return lstring.compare(rstring) <= 0;
+                return c <= 0;
             case SGT:
-                return lstring.compare(rstring) > 0;
+                return c > 0;
             case SGE:
-                return lstring.compare(rstring) >= 0;
+                return c >= 0;
             default:
                 return false;
         }
@@ -149,6 +288,27 @@ public:
         return false;
     }
 
+    template <typename T>
+    static bool compareNumbers(Binary::Type type, T l, T r)
+    {
+        switch (type) {
+            case EQ:
+                return l == r;
+            case NE:
+                return l != r;
+            case LT:
+                return l < r;
+            case LE:
+                return l <= r;
+            case GT:
+                return l > r;
+            case GE:
+                return l >= r;
+            default:
+                return false;
+        }
+    }
+
     virtual void print(std::ostream & out) const
     {
         out << "Binary<" << BinaryType::names[type] << ">(" << *left << ", " << *right << ")";
@@ -156,25 +316,49 @@ public:
 };
 
 class Conditional : public Statement {
-    std::shared_ptr<Expression> condition;
-    std::shared_ptr<Statement> ifTrue;
-    std::shared_ptr<Statement> ifFalse;
+    Expression * condition;
+    Statement * ifTrue;
+    Statement * ifFalse;
 
 public:
-    Conditional(std::shared_ptr<Expression> e, std::shared_ptr<Statement> ifTrue, std::shared_ptr<Statement> ifFalse) : condition(e), ifTrue(ifTrue), ifFalse(ifFalse) { }
+    Conditional(Expression * e, Statement * ifTrue, Statement * ifFalse) : condition(e), ifTrue(ifTrue), ifFalse(ifFalse) { }
+
+    virtual Base::Kind kind() const { return Base::Kind::CONDITIONAL; }
 
-    virtual std::string exec(const Message & msg)
+    Expression * getCondition() const { return condition; }
+    Statement * getIfTrue() const { return ifTrue; }
+    Statement * getIfFalse() const { return ifFalse; }
+
+    virtual void getChildren(std::vector<Base *> & out) const
+    {
+        out.push_back(condition);
+        out.push_back(ifTrue);
+        out.push_back(ifFalse);
+    }
+
+    using Statement::exec;
+
+    virtual void exec(const Message & msg, std::string & out) const
     {
         if (condition->eval(msg)) {
-            return ifTrue->exec(msg);
+            ifTrue->exec(msg, out);
         } else {
-            return ifFalse->exec(msg);
+            ifFalse->exec(msg, out);
+        }
+    }
+
+    virtual void exec(const Message & msg, std::string & out, Memo & memo) const
+    {
+        if (condition->eval(msg, memo)) {
+            ifTrue->exec(msg, out, memo);
+        } else {
+            ifFalse->exec(msg, out, memo);
         }
     }
 
     virtual void print(std::ostream & out) const
     {
-        out << "Conditional(" << condition << ", " << *ifTrue << ", " << *ifFalse << ")";
+        out << "Conditional(" << *condition << ", " << *ifTrue << ", " << *ifFalse << ")";
     }
 };
 
@@ -182,6 +366,18 @@ namespace LogicalType {
     extern std::string names[];
 }
 
+/* A conjunction or disjunction, short circuited.  Clauses are pure, so they
+ * may be evaluated in any order; each Logical learns the order that settles
+ * it soonest for the messages it actually sees.
+ *
+ * About one evaluation in sampleRate, chosen at random, evaluates and
+ * times every clause and records how often each was decisive: false for
+ * AND, true for OR.  Every adaptEvery samples the clauses are re-ranked by
+ * expected cost per decision, cheapest and most decisive first, and the
+ * counts halved so that older messages count for less.  The order is
+ * packed, four bits per clause, into one atomic word that every evaluation
+ * loads once, so a reorder never disturbs evaluations running on other
+ * threads. */
 class Logical: public Expression {
 public:
     enum Type {
@@ -190,33 +386,66 @@ public:
         NUM_ITEMS,
     };
 
+    // beyond this many clauses are always evaluated as written
+    static const size_t maxAdaptive = 16;
+
+    // powers of two
+    static const uint32_t sampleRate = 64;
+    static const uint32_t adaptEvery = 128;
+
 private:
+    struct ClauseStats {
+        std::atomic<uint64_t> evaluations;
+        std::atomic<uint64_t> decisive;
+        std::atomic<uint64_t> nanos;
+
+        ClauseStats() : evaluations(0), decisive(0), nanos(0) { }
+    };
+
     Logical::Type type;
-    std::vector<std::shared_ptr<Expression> > clauses;
+    std::vector<Expression *> clauses;
+    std::unique_ptr<ClauseStats[]> stats;
+    mutable std::atomic<uint64_t> order;
+    mutable std::atomic<uint32_t> samples;
 
 public:
-    Logical(Logical::Type t, std::vector<std::shared_ptr<Expression> > & c) : type(t), clauses(c) { }
+    Logical(Logical::Type t, const std::vector<Expression *> & c);
 
-    virtual bool eval(const Message & msg)
-    {
-        for (std::vector<std::shared_ptr<Expression> >::iterator it = clauses.begin(); it != clauses.end(); it++) {
-            bool clauseValue = (**it).eval(msg);
+    virtual Base::Kind kind() const { return Base::Kind::LOGICAL; }
 
-            if (type == Logical::Type::AND) {
-                if (! clauseValue) return false;
-            } else {
-                if (clauseValue) return true;
-            }
+    Logical::Type getType() const { return type; }
+
+    // in the order written
+    const std::vector<Expression *> & getClauses() const { return clauses; }
+
+    // indexes into getClauses(), in the order they are evaluated now
+    std::vector<size_t> getOrder() const;
+
+    virtual void getChildren(std::vector<Base *> & out) const
+    {
+        for (std::vector<Expression *>::const_iterator it = clauses.begin(); it != clauses.end(); it++) {
+            out.push_back(*it);
         }
+    }
+
+    virtual bool eval(const Message & msg) const;
 
-        return true;
+    // re-ranks the clauses from the samples so far; eval calls it as needed
+    void adapt() const;
+
+protected:
+    virtual bool evalWith(const Message & msg, Memo & memo) const
+    {
+        return run(msg, &memo);
     }
 
+public:
+
     virtual void print(std::ostream & out) const
     {
         out << "Logical<" << LogicalType::names[type] << ">(";
 
-        for (std::vector<std::shared_ptr<Expression> >::const_iterator it = clauses.begin(); it != clauses.end(); it++) {
+        for (std::vector<Expression *>::const_iterator it = clauses.begin(); it != clauses.end(); it++) {
             out << (**it);
 
             if (it + 1 != clauses.end()) {
@@ -226,49 +455,104 @@ public:
 
         out << ")";
     }
+
+private:
+    // clauses are evaluated through memo, if there is one
+    bool run(const Message & msg, Memo * memo) const;
+    bool sample(const Message & msg, Memo * memo) const;
+
+    static bool clause(const Expression * e, const Message & msg, Memo * memo)
+    {
+        return memo ? e->eval(msg, *memo) : e->eval(msg);
+    }
+};
+
+/* An expression whose outcome is known without looking at the message.
+ * The parser never produces these; the optimizer folds expressions to them. */
+class Constant: public Expression {
+    bool value;
+
+public:
+    Constant(bool value) : value(value) { }
+
+    virtual Base::Kind kind() const { return Base::Kind::CONSTANT; }
+
+    bool getValue() const { return value; }
+
+    virtual bool eval(const Message & msg) const
+    {
+        return value;
+    }
+
+    virtual void print(std::ostream & out) const
+    {
+        out << "Constant(" << (value ? "true" : "false") << ")";
+    }
 };
 
 class Production: public Statement {
+public:
+    /* Literal text followed by a Lookup to be encoded after it, or by
+     * nothing at the end of the production. */
+    struct Segment {
+        std::string literal;
+        const Lookup * lookup;
+
+        Segment() : lookup(NULL) { }
+    };
+
+private:
     std::string service;
-    std::vector<std::shared_ptr<Arg> > path;
-    std::vector<std::pair<std::string, std::shared_ptr<Arg> > > params;
+    std::vector<Arg *> path;
+    std::vector<std::pair<std::string, Arg *> > params;
+    std::vector<Segment> segments;
 
 public:
-    Production(const std::string & service, const std::vector<std::shared_ptr<Arg> > & path, const std::vector<std::pair<std::string, std::shared_ptr<Arg> > > & params) : service(service), path(path), params(params) { }
-
-    virtual std::string exec(const Message & msg)
+    Production(const std::string & service, const std::vector<Arg *> & path, const std::vector<std::pair<std::string, Arg *> > & params) : service(service), path(path), params(params)
     {
-        std::ostringstream out;
+        render();
+    }
 
-        out << service;
+    virtual Base::Kind kind() const { return Base::Kind::PRODUCTION; }
 
-        if (path.size()) {
-            for (std::vector<std::shared_ptr<Arg> >::iterator it = path.begin(); it != path.end(); it++) {
-                out << "/" << (**it).getValue(msg);
-            }
+    const std::string & getService() const { return service; }
+    const std::vector<Arg *> & getPath() const { return path; }
+    const std::vector<std::pair<std::string, Arg *> > & getParams() const { return params; }
+
+    // the production pre-rendered as far as it can be without a message
+    const std::vector<Segment> & getSegments() const { return segments; }
+
+    virtual void getChildren(std::vector<Base *> & out) const
+    {
+        for (std::vector<Arg *>::const_iterator it = path.begin(); it != path.end(); it++) {
+            out.push_back(*it);
         }
 
-        if (params.size()) {
-            out << "?";
+        for (std::vector<std::pair<std::string, Arg *> >::const_iterator it = params.begin(); it != params.end(); it++) {
+            out.push_back(it->second);
+        }
+    }
 
-            for (std::vector<std::pair<std::string, std::shared_ptr<Arg> > >::iterator it = params.begin(); it != params.end(); it++) {
-                // TODO: add url encoding
-                
-                out << it->first << "=" << it->second->getValue(msg);
-                if (it + 1 != params.end()) {
-                    out << "&";
-                }
+    using Statement::exec;
+
+    /* Path segments and param values are percent-encoded; the service and
+     * param names are emitted as written. */
+    virtual void exec(const Message & msg, std::string & out) const
+    {
+        for (std::vector<Segment>::const_iterator it = segments.begin(); it != segments.end(); it++) {
+            out.append(it->literal);
+
+            if (it->lookup) {
+                Url::encode(it->lookup->getValue(msg).getText(), out);
             }
         }
-
-        return out.str();
     }
 
     virtual void print(std::ostream & out) const
     {
         out << "Production(" << service << ", PATH(";
 
-        for (std::vector<std::shared_ptr<Arg> >::const_iterator it = path.begin(); it != path.end(); it++) {
+        for (std::vector<Arg *>::const_iterator it = path.begin(); it != path.end(); it++) {
             out << **it;
 
             if (it + 1 != path.end()) {
@@ -278,7 +562,7 @@ public:
 
         out << "), PARAMS(";
 
-        for (std::vector<std::pair<std::string, std::shared_ptr<Arg> > >::const_iterator it = params.begin(); it != params.end(); it++) {
+        for (std::vector<std::pair<std::string, Arg *> >::const_iterator it = params.begin(); it != params.end(); it++) {
             out << it->first << "=" << *(it->second);
 
             if (it + 1 != params.end()) {
@@ -288,6 +572,9 @@ public:
 
         out << ")";
     }
+
+private:
+    void render();
 };
 
 }
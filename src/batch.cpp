@@ -0,0 +1,365 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MONTY_HAVE_AVX2_KERNELS 1
+#endif
+
+using namespace Monty;
+
+typedef AST::Binary::Type BinaryType;
+
+/* Scalar kernels */
+
+template <typename T>
+static void compareScalar(BinaryType type, const T * l, const T * r, size_t words, uint64_t * out)
+{
+    for (size_t w = 0; w < words; w++) {
+        uint64_t bits = 0;
+
+        for (size_t j = 0; j < 64; j++) {
+            size_t i = w * 64 + j;
+
+            bits |= (uint64_t)AST::Binary::compareNumbers(type, l[i], r[i]) << j;
+        }
+
+        out[w] = bits;
+    }
+}
+
+/* AVX2 kernels, four lanes per compare and sixteen compares per mask word */
+
+#ifdef MONTY_HAVE_AVX2_KERNELS
+
+template <BinaryType T>
+__attribute__((target("avx2")))
+static void compareIntegersAvx2(const int64_t * l, const int64_t * r, size_t words, uint64_t * out)
+{
+    for (size_t w = 0; w < words; w++) {
+        uint64_t bits = 0;
+
+        for (size_t j = 0; j < 16; j++) {
+            size_t i = w * 64 + j * 4;
+            __m256i a = _mm256_loadu_si256((const __m256i *)(l + i));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(r + i));
+            __m256i m;
+
+            // only == and > exist; the rest are swaps and negations
+            switch (T) {
+                case BinaryType::EQ:
+                case BinaryType::NE:
+                    m = _mm256_cmpeq_epi64(a, b);
+                    break;
+                case BinaryType::GT:
+                case BinaryType::LE:
+                    m = _mm256_cmpgt_epi64(a, b);
+                    break;
+                default:
+                    m = _mm256_cmpgt_epi64(b, a);
+                    break;
+            }
+
+            uint64_t lanes = _mm256_movemask_pd(_mm256_castsi256_pd(m));
+
+            if (T == BinaryType::NE || T == BinaryType::LE || T == BinaryType::GE) lanes ^= 0xf;
+
+            bits |= lanes << (j * 4);
+        }
+
+        out[w] = bits;
+    }
+}
+
+template <int P>
+__attribute__((target("avx2")))
+static void compareRealsAvx2(const double * l, const double * r, size_t words, uint64_t * out)
+{
+    for (size_t w = 0; w < words; w++) {
+        uint64_t bits = 0;
+
+        for (size_t j = 0; j < 16; j++) {
+            size_t i = w * 64 + j * 4;
+            __m256d m = _mm256_cmp_pd(_mm256_loadu_pd(l + i), _mm256_loadu_pd(r + i), P);
+
+            bits |= (uint64_t)_mm256_movemask_pd(m) << (j * 4);
+        }
+
+        out[w] = bits;
+    }
+}
+
+static bool avx2()
+{
+    static bool supported = __builtin_cpu_supports("avx2");
+
+    return supported;
+}
+
+#endif
+
+static void compareIntegers(BinaryType type, const int64_t * l, const int64_t * r, size_t words, uint64_t * out)
+{
+#ifdef MONTY_HAVE_AVX2_KERNELS
+    if (avx2()) {
+        switch (type) {
+            case BinaryType::EQ: return compareIntegersAvx2<BinaryType::EQ>(l, r, words, out);
+            case BinaryType::NE: return compareIntegersAvx2<BinaryType::NE>(l, r, words, out);
+            case BinaryType::LT: return compareIntegersAvx2<BinaryType::LT>(l, r, words, out);
+            case BinaryType::LE: return compareIntegersAvx2<BinaryType::LE>(l, r, words, out);
+            case BinaryType::GT: return compareIntegersAvx2<BinaryType::GT>(l, r, words, out);
+            case BinaryType::GE: return compareIntegersAvx2<BinaryType::GE>(l, r, words, out);
+            default: break;
+        }
+    }
+#endif
+
+    compareScalar(type, l, r, words, out);
+}
+
+static void compareReals(BinaryType type, const double * l, const double * r, size_t words, uint64_t * out)
+{
+#ifdef MONTY_HAVE_AVX2_KERNELS
+    if (avx2()) {
+        // ordered predicates are false on NaN, NEQ_UQ is true, as in C++
+        switch (type) {
+            case BinaryType::EQ: return compareRealsAvx2<_CMP_EQ_OQ>(l, r, words, out);
+            case BinaryType::NE: return compareRealsAvx2<_CMP_NEQ_UQ>(l, r, words, out);
+            case BinaryType::LT: return compareRealsAvx2<_CMP_LT_OQ>(l, r, words, out);
+            case BinaryType::LE: return compareRealsAvx2<_CMP_LE_OQ>(l, r, words, out);
+            case BinaryType::GT: return compareRealsAvx2<_CMP_GT_OQ>(l, r, words, out);
+            case BinaryType::GE: return compareRealsAvx2<_CMP_GE_OQ>(l, r, words, out);
+            default: break;
+        }
+    }
+#endif
+
+    compareScalar(type, l, r, words, out);
+}
+
+static void compareText(BinaryType type, const Column & l, const Column & r, size_t rows, uint64_t * out)
+{
+    for (size_t i = 0; i < rows; i++) {
+        size_t llen = l.length(i);
+        size_t rlen = r.length(i);
+        bool result;
+
+        if ((type == BinaryType::SEQ || type == BinaryType::SNE) && llen != rlen) {
+            result = type == BinaryType::SNE;
+        } else {
+            int c = memcmp(l.text(i), r.text(i), std::min(llen, rlen));
+
+            if (c == 0) c = llen < rlen ? -1 : (llen > rlen ? 1 : 0);
+
+            switch (type) {
+                case BinaryType::SEQ: result = c == 0; break;
+                case BinaryType::SNE: result = c != 0; break;
+                case BinaryType::SLT: result = c < 0; break;
+                case BinaryType::SLE: result = c <= 0; break;
+                case BinaryType::SGT: result = c > 0; break;
+                case BinaryType::SGE: result = c >= 0; break;
+                default: result = false; break;
+            }
+        }
+
+        if (result) out[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+bool Batch::vectorized()
+{
+#ifdef MONTY_HAVE_AVX2_KERNELS
+    return avx2();
+#else
+    return false;
+#endif
+}
+
+Batch::Batch(const std::vector<const Message *> & messages) : messages(messages), rows(messages.size()), words((messages.size() + 63) / 64)
+{
+}
+
+void Batch::exec(const AST::Statement * statement, std::vector<std::string> & out)
+{
+    Mask active(words, ~0ULL);
+
+    if (rows % 64) active[words - 1] = (1ULL << (rows % 64)) - 1;
+
+    out.resize(rows);
+    exec(statement, active, out);
+}
+
+void Batch::exec(const AST::Statement * statement, const Mask & active, std::vector<std::string> & out)
+{
+    switch (statement->kind()) {
+        case AST::Base::Kind::CONDITIONAL: {
+            const AST::Conditional * c = static_cast<const AST::Conditional *>(statement);
+            Mask condition(words);
+            Mask ifTrue(words);
+            Mask ifFalse(words);
+            bool anyTrue = false;
+            bool anyFalse = false;
+
+            eval(c->getCondition(), condition);
+
+            for (size_t w = 0; w < words; w++) {
+                ifTrue[w] = active[w] & condition[w];
+                ifFalse[w] = active[w] & ~condition[w];
+                anyTrue |= ifTrue[w] != 0;
+                anyFalse |= ifFalse[w] != 0;
+            }
+
+            if (anyTrue) exec(c->getIfTrue(), ifTrue, out);
+            if (anyFalse) exec(c->getIfFalse(), ifFalse, out);
+            break;
+        }
+        case AST::Base::Kind::PRODUCTION: {
+            const AST::Production * p = static_cast<const AST::Production *>(statement);
+            std::vector<AST::Base *> args;
+            bool constant = true;
+
+            p->getChildren(args);
+            for (std::vector<AST::Base *>::const_iterator it = args.begin(); it != args.end(); it++) {
+                if ((*it)->kind() != AST::Base::Kind::VALUE) constant = false;
+            }
+
+            // a production without lookups renders the same for every row
+            std::string rendered;
+
+            for (size_t w = 0; w < words; w++) {
+                for (uint64_t bits = active[w]; bits; bits &= bits - 1) {
+                    size_t i = w * 64 + __builtin_ctzll(bits);
+
+                    if (! constant) {
+                        out[i].clear();
+                        p->exec(*messages[i], out[i]);
+                    } else {
+                        if (rendered.empty()) p->exec(*messages[i], rendered);
+                        out[i] = rendered;
+                    }
+                }
+            }
+            break;
+        }
+        default:
+            assert(0);
+    }
+}
+
+void Batch::eval(const AST::Expression * expression, Mask & out)
+{
+    switch (expression->kind()) {
+        case AST::Base::Kind::BINARY: {
+            const AST::Binary * b = static_cast<const AST::Binary *>(expression);
+            BinaryType type = b->getType();
+            const Column & l = column(b->getLeft(), type >= BinaryType::SEQ);
+            const Column & r = column(b->getRight(), type >= BinaryType::SEQ);
+
+            if (type >= BinaryType::SEQ) {
+                std::fill(out.begin(), out.end(), 0);
+                compareText(type, l, r, rows, out.data());
+                break;
+            }
+
+            compareIntegers(type, l.integers.data(), r.integers.data(), words, out.data());
+
+            Mask both(words);
+            bool allIntegral = true;
+
+            for (size_t w = 0; w < words; w++) {
+                both[w] = l.integral[w] & r.integral[w];
+                allIntegral &= both[w] == ~0ULL;
+            }
+
+            if (! allIntegral) {
+                Mask reals(words);
+
+                compareReals(type, l.reals.data(), r.reals.data(), words, reals.data());
+
+                for (size_t w = 0; w < words; w++) {
+                    out[w] = (out[w] & both[w]) | (reals[w] & ~both[w]);
+                }
+            }
+            break;
+        }
+        case AST::Base::Kind::LOGICAL: {
+            const AST::Logical * l = static_cast<const AST::Logical *>(expression);
+            const std::vector<AST::Expression *> & clauses = l->getClauses();
+            bool isAnd = l->getType() == AST::Logical::Type::AND;
+            Mask clause(words);
+
+            std::fill(out.begin(), out.end(), isAnd ? ~0ULL : 0);
+
+            for (std::vector<AST::Expression *>::const_iterator it = clauses.begin(); it != clauses.end(); it++) {
+                eval(*it, clause);
+
+                for (size_t w = 0; w < words; w++) {
+                    out[w] = isAnd ? out[w] & clause[w] : out[w] | clause[w];
+                }
+            }
+            break;
+        }
+        case AST::Base::Kind::CONSTANT:
+            std::fill(out.begin(), out.end(), static_cast<const AST::Constant *>(expression)->getValue() ? ~0ULL : 0);
+            break;
+        default:
+            assert(0);
+    }
+}
+
+/* Columns are padded to whole mask words so kernels never need a tail loop;
+ * padding rows compare as zero and are masked off by the active mask.  Every
+ * Lookup of the same key shares one column. */
+const Column & Batch::column(const AST::Arg * arg, bool text)
+{
+    if (arg->kind() == AST::Base::Kind::LOOKUP) {
+        const std::string & key = static_cast<const AST::Lookup *>(arg)->getKey();
+        std::map<std::string, const AST::Arg *>::const_iterator it = byKey.find(key);
+
+        if (it != byKey.end()) {
+            arg = it->second;
+        } else {
+            byKey[key] = arg;
+        }
+    }
+
+    Column & c = columns[arg];
+
+    if (text && ! c.hasText) {
+        c.offsets.assign(rows + 1, 0);
+
+        for (size_t i = 0; i < rows; i++) {
+            c.bytes.append(arg->getValue(*messages[i]).getText());
+            c.offsets[i + 1] = c.bytes.size();
+        }
+
+        c.hasText = true;
+    }
+
+    if (! text && ! c.hasNumbers) {
+        size_t padded = words * 64;
+
+        c.integers.assign(padded, 0);
+        c.reals.assign(padded, 0);
+        c.integral.assign(words, ~0ULL);
+
+        for (size_t i = 0; i < rows; i++) {
+            const Scalar & v = arg->getValue(*messages[i]);
+
+            c.integers[i] = v.getInteger();
+            c.reals[i] = v.getDouble();
+            if (! v.isIntegral()) c.integral[i / 64] &= ~(1ULL << (i % 64));
+        }
+
+        c.hasNumbers = true;
+    }
+
+    return c;
+}
+
+void Batch::print(std::ostream & out) const
+{
+    out << "Batch(rows=" << rows << ", columns=" << columns.size() << ", avx2=" << vectorized() << ")";
+}
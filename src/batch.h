@@ -0,0 +1,68 @@
+#ifndef MONTY_BATCH_H
+#define MONTY_BATCH_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "ast.h"
+#include "message.h"
+#include "object.h"
+
+namespace Monty {
+
+/* One bit per message in a batch, padded to whole 64 bit words. */
+typedef std::vector<uint64_t> Mask;
+
+/* The values of one Arg across every message of a batch.  Numbers are held
+ * as parallel int64 and double arrays, with a mask of the rows whose value is
+ * integral; text as offsets into one byte buffer.  Each part is only filled
+ * in once some comparison needs it. */
+struct Column {
+    bool hasNumbers;
+    bool hasText;
+
+    std::vector<int64_t> integers;
+    std::vector<double> reals;
+    Mask integral;
+    std::vector<uint32_t> offsets;
+    std::string bytes;
+
+    const char * text(size_t row) const { return bytes.data() + offsets[row]; }
+    size_t length(size_t row) const { return offsets[row + 1] - offsets[row]; }
+
+    Column() : hasNumbers(false), hasText(false) { }
+};
+
+/* Evaluates a statement against many messages at once.  Referenced fields are
+ * transposed into columns, every Binary becomes one comparison kernel over
+ * whole columns producing a selection mask (AVX2 when the cpu has it), and
+ * Logical and Conditional combine masks instead of branching per message. */
+class Batch: public Object {
+    const std::vector<const Message *> & messages;
+    size_t rows;
+    size_t words;
+    std::map<const AST::Arg *, Column> columns;
+    std::map<std::string, const AST::Arg *> byKey;
+
+public:
+    Batch(const std::vector<const Message *> & messages);
+
+    /* out[i] receives the production for messages[i]. */
+    void exec(const AST::Statement * statement, std::vector<std::string> & out);
+
+    virtual void print(std::ostream & out) const;
+
+    // true if the AVX2 kernels are in use
+    static bool vectorized();
+
+private:
+    void exec(const AST::Statement * statement, const Mask & active, std::vector<std::string> & out);
+    void eval(const AST::Expression * expression, Mask & out);
+    const Column & column(const AST::Arg * arg, bool text);
+};
+
+}
+
+#endif
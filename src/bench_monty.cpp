@@ -0,0 +1,357 @@
+#include <benchmark/benchmark.h>
+#include <json/json.h>
+
+#include "arena.h"
+#include "ast.h"
+#include "dispatcher.h"
+#include "generator.h"
+#include "http_transport.h"
+#include "loopback.h"
+#include "message.h"
+#include "parser.h"
+#include "rule.h"
+#include "ruleset.h"
+
+using namespace Monty;
+
+/* Every case draws its input from a Generator with a fixed seed, so runs on
+ * different builds see identical rules and messages. */
+static const uint64_t seed = 42;
+
+/* Each Conditional in a chain nests two levels of json, and json-c, which
+ * BM_ParseDom measures, refuses documents nested more than 32 deep, so the
+ * chains the two parsers are compared on stop at 12. */
+static const int maxDepth = 12;
+
+// range(0): depth of the Conditional chain, range(1): params per production
+static void BM_Parse(benchmark::State & state)
+{
+    Generator g(seed);
+    std::string json = g.rule(state.range(0), 16, state.range(1));
+
+    for (auto _ : state) {
+        Arena arena;
+        Parser p(arena);
+
+        benchmark::DoNotOptimize(p.parse(json));
+    }
+
+    state.SetBytesProcessed(state.iterations() * json.size());
+}
+BENCHMARK(BM_Parse)->Args({1, 1})->Args({maxDepth, 32})->Args({maxDepth, 1024})->Args({256, 32});
+
+/* The json-c document tree the parser used to walk, built and freed; a lower
+ * bound on what parsing cost before it read tokens directly. */
+static void BM_ParseDom(benchmark::State & state)
+{
+    Generator g(seed);
+    std::string json = g.rule(state.range(0), 16, state.range(1));
+
+    for (auto _ : state) {
+        json_object * root = json_tokener_parse(json.c_str());
+
+        benchmark::DoNotOptimize(root);
+        json_object_put(root);
+    }
+
+    state.SetBytesProcessed(state.iterations() * json.size());
+}
+BENCHMARK(BM_ParseDom)->Args({1, 1})->Args({maxDepth, 32})->Args({maxDepth, 1024});
+
+// range(0): fields in the message
+static void BM_Message(benchmark::State & state)
+{
+    Generator g(seed);
+    std::string json = g.message(state.range(0));
+
+    for (auto _ : state) {
+        Message m(json);
+
+        benchmark::DoNotOptimize(m);
+    }
+
+    state.SetBytesProcessed(state.iterations() * json.size());
+}
+BENCHMARK(BM_Message)->Arg(4)->Arg(256);
+
+// range(0): fields in the message, of which a rule wants four
+static void BM_MessageProjected(benchmark::State & state)
+{
+    Generator g(seed);
+    std::string json = g.message(state.range(0));
+    Schema schema;
+
+    for (size_t i = 0; i < 4; i++) schema.add(Generator::key(i * state.range(0) / 4));
+    schema.build();
+
+    for (auto _ : state) {
+        Message m(json, schema);
+
+        benchmark::DoNotOptimize(m);
+    }
+
+    state.SetBytesProcessed(state.iterations() * json.size());
+}
+BENCHMARK(BM_MessageProjected)->Arg(4)->Arg(256);
+
+// range(0): fields in the message, of which a rule wants four
+static void BM_MessageReset(benchmark::State & state)
+{
+    Generator g(seed);
+    std::string json = g.message(state.range(0));
+    Schema schema;
+
+    for (size_t i = 0; i < 4; i++) schema.add(Generator::key(i * state.range(0) / 4));
+    schema.build();
+
+    Message m(schema);
+
+    for (auto _ : state) {
+        m.reset(json);
+
+        benchmark::DoNotOptimize(m);
+    }
+
+    state.SetBytesProcessed(state.iterations() * json.size());
+}
+BENCHMARK(BM_MessageReset)->Arg(4)->Arg(256);
+
+// range(0): the Binary::Type
+static void BM_Binary(benchmark::State & state)
+{
+    AST::Binary::Type type = (AST::Binary::Type)state.range(0);
+    Arena arena;
+    AST::Binary b(type, arena.make<AST::Lookup>("k0"), arena.make<AST::Value>(std::string("500")));
+    Message m("{\"k0\" : 499.5}");
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(b.eval(m));
+    }
+
+    state.SetLabel(AST::BinaryType::names[type]);
+}
+BENCHMARK(BM_Binary)->DenseRange(0, AST::Binary::Type::NUM_ITEMS - 1);
+
+/* What a message pays to look a value up in the interner, against what it
+ * saves each time that value is compared as text with a constant.  Values
+ * and constants are urls of one length, so only a lookup tells them apart
+ * without reading bytes.
+ * range(0): constants each value is compared with, range(1): 1 to look values up */
+static void BM_TextCompare(benchmark::State & state)
+{
+    Generator g(seed);
+    Interner interner;
+    std::vector<Scalar> constants;
+    std::vector<std::string> values;
+    Scalar v;
+    size_t i = 0;
+
+    for (int j = 0; j < state.range(0); j++) {
+        constants.push_back(Scalar("https://example.com/catalog/" + std::to_string((long long)(100000 + j))));
+        constants.back().intern(interner);
+    }
+
+    // about one value in four matches some constant
+    for (size_t j = 0; j < 64; j++) values.push_back("https://example.com/catalog/" + std::to_string((long long)(100000 + g.below(4 * state.range(0)))));
+
+    for (auto _ : state) {
+        const std::string & text = values[i++ % values.size()];
+        size_t matches = 0;
+
+        v.setString(text.data(), text.size());
+        if (state.range(1)) v.find(interner);
+
+        for (size_t j = 0; j < constants.size(); j++) matches += v.textEquals(constants[j]);
+
+        benchmark::DoNotOptimize(matches);
+    }
+}
+BENCHMARK(BM_TextCompare)->ArgsProduct({{1, 4, 16, 64}, {0, 1}});
+
+// range(0): depth of the Conditional chain, range(1): the Rule::Engine
+static void BM_Conditional(benchmark::State & state)
+{
+    Generator g(seed);
+    Rule rule(g.rule(state.range(0), 16, 4), (Rule::Engine)state.range(1));
+    std::vector<Message> messages;
+    std::string out;
+    size_t i = 0;
+
+    for (size_t j = 0; j < 64; j++) messages.push_back(Message(g.message(16), rule.getSchema()));
+
+    for (auto _ : state) {
+        out.clear();
+        rule.exec(messages[i++ % messages.size()], out);
+        benchmark::DoNotOptimize(out);
+    }
+
+    const char * engines[] = { "tree", "bytecode", "native" };
+    state.SetLabel(engines[state.range(1)]);
+}
+BENCHMARK(BM_Conditional)->ArgsProduct({{1, 4, maxDepth}, {Rule::Engine::TREE, Rule::Engine::BYTECODE, Rule::Engine::NATIVE}});
+
+// range(0): cases in an equality ladder on k0, range(1): engine
+static void BM_Ladder(benchmark::State & state)
+{
+    Generator g(seed);
+    Rule rule(g.ladder(state.range(0), 16, 4), (Rule::Engine)state.range(1));
+    std::vector<Message> messages;
+    std::string out;
+    size_t i = 0;
+
+    // every case, and a miss, about equally often
+    for (size_t j = 0; j < 64; j++) {
+        std::string json = "{\"k0\" : \"c" + std::to_string((long long)g.below(state.range(0) + 1)) + "\"}";
+
+        messages.push_back(Message(json, rule.getSchema()));
+    }
+
+    for (auto _ : state) {
+        out.clear();
+        rule.exec(messages[i++ % messages.size()], out);
+        benchmark::DoNotOptimize(out);
+    }
+
+    const char * engines[] = { "tree", "bytecode", "native" };
+    state.SetLabel(engines[state.range(1)]);
+}
+BENCHMARK(BM_Ladder)->ArgsProduct({{4, maxDepth}, {Rule::Engine::TREE, Rule::Engine::BYTECODE, Rule::Engine::NATIVE}});
+
+// range(0): 1 to memoize shared expressions, 0 to evaluate each rule alone
+static void BM_SharedTrees(benchmark::State & state)
+{
+    Generator g(seed);
+    RuleSet set;
+    std::vector<Message> messages;
+    std::vector<std::string> out(64);
+    AST::Memo memo;
+    size_t i = 0;
+
+    // 64 ladders over the same field, so every comparison is shared
+    for (size_t j = 0; j < out.size(); j++) set.add(g.ladder(8, 16, 4));
+
+    for (size_t j = 0; j < 64; j++) {
+        std::string json = "{\"k0\" : \"c" + std::to_string((long long)g.below(9)) + "\"}";
+
+        messages.push_back(Message(json, set.getSchema()));
+    }
+
+    for (auto _ : state) {
+        const Message & m = messages[i++ % messages.size()];
+
+        if (state.range(0)) {
+            set.execTrees(m, out, memo);
+        } else {
+            for (size_t j = 0; j < out.size(); j++) {
+                out[j].clear();
+                set.getRule(j).getStatement()->exec(m, out[j]);
+            }
+        }
+
+        benchmark::DoNotOptimize(out);
+    }
+
+    state.counters["dedup"] = set.getPool().getMetrics().dedupRatio();
+    state.counters["saved_bytes"] = set.getPool().getMetrics().saved;
+}
+BENCHMARK(BM_SharedTrees)->Arg(0)->Arg(1);
+
+// range(0): 1 to skip rules missing a key they need, 0 to run every rule
+static void BM_Prefilter(benchmark::State & state)
+{
+    Generator g(seed);
+    RuleSet set;
+    std::vector<Message> messages;
+    std::vector<std::string> out;
+    size_t i = 0;
+
+    // 256 rules, each over its own key, and messages holding a few of them
+    for (size_t j = 0; j < 256; j++) {
+        set.add("[\"conditional\", {\"condition\" : " + g.binary(AST::Binary::Type::SEQ, Generator::key(j), "\"x\"") + ", "
+                "\"ifTrue\" : " + g.production("http://match", 4, 4) + ", "
+                "\"ifFalse\" : [\"production\", {\"service\" : \"\", \"path\" : [], \"params\" : []}]}]");
+    }
+
+    for (size_t j = 0; j < 64; j++) {
+        std::string json = "{";
+
+        for (size_t k = 0; k < 4; k++) json += (k ? ", \"" : "\"") + Generator::key(g.below(256)) + "\" : \"x\"";
+        json += "}";
+
+        messages.push_back(Message(json, set.getSchema()));
+    }
+
+    set.setPrefilter(state.range(0));
+
+    for (auto _ : state) {
+        set.exec(messages[i++ % messages.size()], out);
+        benchmark::DoNotOptimize(out);
+    }
+
+    state.SetItemsProcessed(state.iterations() * set.size());
+}
+BENCHMARK(BM_Prefilter)->Arg(0)->Arg(1);
+
+// range(0): params in the production
+static void BM_Production(benchmark::State & state)
+{
+    Generator g(seed);
+    Arena arena;
+    Parser p(arena);
+    const AST::Statement * production = static_cast<AST::Statement *>(p.parse(g.production("http://svc", 16, state.range(0))));
+    Message m(g.message(16));
+    std::string out;
+
+    for (auto _ : state) {
+        out.clear();
+        production->exec(m, out);
+        benchmark::DoNotOptimize(out);
+    }
+
+    state.SetBytesProcessed(state.iterations() * out.size());
+}
+BENCHMARK(BM_Production)->Arg(1)->Arg(16)->Arg(64);
+
+// range(0): production cache bytes, 0 for none
+static void BM_Cached(benchmark::State & state)
+{
+    Generator g(seed);
+    Rule rule(g.rule(maxDepth, 16, 16));
+    std::vector<Message> messages;
+    std::string out;
+    size_t i = 0;
+
+    rule.setCache(state.range(0));
+
+    for (size_t j = 0; j < 64; j++) messages.push_back(Message(g.message(16), rule.getSchema()));
+
+    for (auto _ : state) {
+        out.clear();
+        rule.exec(messages[i++ % messages.size()], out);
+        benchmark::DoNotOptimize(out);
+    }
+
+    if (rule.getCache()) state.counters["hit_rate"] = rule.getCache()->getMetrics().hitRate();
+}
+BENCHMARK(BM_Cached)->Arg(0)->Arg(1 << 20);
+
+// range(0): distinct urls among 1024 productions, sent over loopback http
+static void BM_Dispatch(benchmark::State & state)
+{
+    LoopbackServer server;
+    HttpTransport http("127.0.0.1", server.getPort());
+    Dispatcher d(http);
+    std::vector<std::string> productions;
+
+    for (size_t i = 0; i < 1024; i++) productions.push_back("svc" + std::to_string((long long)(i % 4)) + "/" + std::to_string((long long)(i % state.range(0))));
+
+    for (auto _ : state) {
+        d.submit(productions);
+        d.flush();
+    }
+
+    state.SetItemsProcessed(state.iterations() * productions.size());
+}
+BENCHMARK(BM_Dispatch)->Arg(16)->Arg(1024)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,501 @@
+#include "cache.h"
+#include "ast.h"
+#include "hash.h"
+
+#include <bitset>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Monty;
+
+namespace {
+
+const char magic[8] = {'M', 'O', 'N', 'T', 'Y', 'R', 'C', '\0'};
+
+// reads back differently on a machine of the other byte order
+const uint32_t byteOrder = 0x01020304;
+
+struct Section {
+    uint32_t offset;
+    uint32_t count;
+};
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t instructionSize;
+    uint32_t predicateSize;
+    uint32_t switchSize;
+    uint32_t caseSize;
+    uint64_t source;
+    uint64_t checksum;
+    uint64_t size;
+    uint32_t registers;
+    uint32_t reserved;
+    Section code;
+    Section predicates;
+    Section entries;
+    Section constants;
+    Section fields;
+    Section switches;
+    Section cases;
+
+    // count + 1 uint32 offsets into the bytes that follow them
+    Section strings;
+};
+
+struct ConstantRecord {
+    uint32_t type;
+    uint32_t string;
+    int64_t integer;
+    double real;
+};
+
+/* Assigns each distinct string an index, in order of first use. */
+class StringTable {
+    std::map<std::string, uint32_t> index;
+    std::vector<const std::string *> strings;
+
+public:
+    uint32_t intern(const std::string & s)
+    {
+        std::map<std::string, uint32_t>::iterator it = index.find(s);
+
+        if (it != index.end()) return it->second;
+
+        it = index.insert(std::make_pair(s, (uint32_t)strings.size())).first;
+        strings.push_back(&it->first);
+
+        return it->second;
+    }
+
+    size_t size() const { return strings.size(); }
+    const std::string & get(size_t i) const { return *strings[i]; }
+};
+
+Section append(std::string & out, const void * p, size_t size, size_t count)
+{
+    Section s;
+
+    out.resize((out.size() + 7) & ~(size_t)7, '\0');
+
+    s.offset = out.size();
+    s.count = count;
+
+    out.append((const char *)p, size * count);
+
+    return s;
+}
+
+bool contains(const Header & h, const Section & s, size_t size)
+{
+    return s.offset % 8 == 0 && s.offset <= h.size && s.count <= (h.size - s.offset) / size;
+}
+
+/* Whether every register a COMPARE reads has been loaded on every path to
+ * it from an entry; exec starts each rule with none loaded.  Assumes the
+ * jump, switch and case targets are in bounds.
+ *
+ * loaded[i] holds the registers certainly loaded before instruction i, all
+ * of them until i is first reached, and only ever shrinks, so the worklist
+ * empties. */
+bool registersLoaded(const Header & h, const Instruction * code, const uint32_t * entries, const Switch * switches, const SwitchCase * cases)
+{
+    typedef std::bitset<256> Registers;
+
+    std::vector<Registers> loaded(h.code.count, Registers().set());
+    std::vector<bool> reached(h.code.count, false);
+    std::vector<uint32_t> work;
+
+    for (uint32_t i = 0; i < h.entries.count; i++) {
+        loaded[entries[i]].reset();
+
+        if (! reached[entries[i]]) work.push_back(entries[i]);
+        reached[entries[i]] = true;
+    }
+
+    while (! work.empty()) {
+        uint32_t i = work.back();
+        const Instruction & in = code[i];
+        Registers out = loaded[i];
+        std::vector<uint32_t> next;
+
+        work.pop_back();
+
+        switch (in.op) {
+            case Instruction::LOAD_CONST:
+            case Instruction::LOAD_FIELD:
+                out.set(in.a);
+                next.push_back(i + 1);
+                break;
+            case Instruction::COMPARE:
+                if (! out.test(in.b) || ! out.test(in.c)) return false;
+                next.push_back(i + 1);
+                break;
+            case Instruction::JUMP:
+                next.push_back(in.arg);
+                break;
+            case Instruction::JUMP_IF_TRUE:
+            case Instruction::JUMP_IF_FALSE:
+                next.push_back(i + 1);
+                next.push_back(in.arg);
+                break;
+            case Instruction::SWITCH: {
+                const Switch & s = switches[in.arg];
+
+                next.push_back(s.fallthrough);
+                for (uint32_t c = s.first; c < s.first + s.count; c++) next.push_back(cases[c].target);
+                break;
+            }
+            case Instruction::HALT:
+                break;
+            default:
+                next.push_back(i + 1);
+                break;
+        }
+
+        for (std::vector<uint32_t>::const_iterator it = next.begin(); it != next.end(); it++) {
+            Registers merged = loaded[*it] & out;
+
+            if (reached[*it] && merged == loaded[*it]) continue;
+
+            loaded[*it] = merged;
+            reached[*it] = true;
+            work.push_back(*it);
+        }
+    }
+
+    return true;
+}
+
+/* The checksum rules out accidental damage; these rule out a well formed
+ * file that would still make exec read outside the program or through a
+ * register it never loaded. */
+bool valid(const Header & h, const Instruction * code, const Predicate * predicates, const uint32_t * entries, const Switch * switches, const SwitchCase * cases)
+{
+    if (h.code.count == 0) return h.entries.count == 0;
+
+    for (uint32_t i = 0; i < h.code.count; i++) {
+        const Instruction & in = code[i];
+
+        switch (in.op) {
+            case Instruction::LOAD_CONST:
+                if (in.a >= h.registers || in.arg >= h.constants.count) return false;
+                break;
+            case Instruction::LOAD_FIELD:
+                if (in.a >= h.registers || in.arg >= h.fields.count) return false;
+                break;
+            case Instruction::COMPARE:
+                if (in.a >= AST::Binary::Type::NUM_ITEMS || in.b >= h.registers || in.c >= h.registers) return false;
+                break;
+            case Instruction::JUMP:
+            case Instruction::JUMP_IF_TRUE:
+            case Instruction::JUMP_IF_FALSE:
+                if (in.arg >= h.code.count) return false;
+                break;
+            case Instruction::EMIT_CONST:
+                if (in.arg >= h.constants.count) return false;
+                break;
+            case Instruction::EMIT_FIELD:
+                if (in.arg >= h.fields.count) return false;
+                break;
+            case Instruction::PREDICATE:
+                if (in.arg >= h.predicates.count) return false;
+                break;
+            case Instruction::SWITCH:
+                if (in.arg >= h.switches.count) return false;
+                break;
+            case Instruction::HALT:
+                break;
+            default:
+                return false;
+        }
+    }
+
+    // nothing may fall off the end of the code
+    uint8_t last = code[h.code.count - 1].op;
+    if (last != Instruction::HALT && last != Instruction::JUMP) return false;
+
+    for (uint32_t i = 0; i < h.predicates.count; i++) {
+        const Predicate & p = predicates[i];
+        uint32_t operands[] = {p.left, p.right};
+
+        if (p.type >= AST::Binary::Type::NUM_ITEMS) return false;
+
+        for (size_t j = 0; j < 2; j++) {
+            uint32_t o = operands[j];
+
+            if (o & Predicate::FIELD ? (o & ~Predicate::FIELD) >= h.fields.count : o >= h.constants.count) return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < h.entries.count; i++) {
+        if (entries[i] >= h.code.count) return false;
+    }
+
+    for (uint32_t i = 0; i < h.switches.count; i++) {
+        const Switch & s = switches[i];
+
+        if (s.field >= h.fields.count || s.fallthrough >= h.code.count) return false;
+        if (s.first > h.cases.count || s.count > h.cases.count - s.first) return false;
+    }
+
+    for (uint32_t i = 0; i < h.cases.count; i++) {
+        const SwitchCase & c = cases[i];
+
+        if (c.type != AST::Binary::Type::EQ && c.type != AST::Binary::Type::SEQ) return false;
+        if (c.constant >= h.constants.count || c.target >= h.code.count) return false;
+    }
+
+    return registersLoaded(h, code, entries, switches, cases);
+}
+
+}
+
+MappedFile::~MappedFile()
+{
+    munmap((void *)data, length);
+}
+
+MappedFile * MappedFile::open(const std::string & path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    void * p = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    // the mapping stays valid once the descriptor is closed
+    close(fd);
+
+    if (p == MAP_FAILED) return NULL;
+
+    return new MappedFile((const char *)p, st.st_size);
+}
+
+uint64_t RuleCache::hash(const std::vector<std::string> & rules)
+{
+    uint64_t h = Hash::fnv1a(magic, sizeof(magic));
+
+    // length prefixed, so that moving text between rules changes the hash
+    for (std::vector<std::string>::const_iterator it = rules.begin(); it != rules.end(); it++) {
+        uint64_t len = it->size();
+
+        h = Hash::fnv1a((const char *)&len, sizeof(len), h);
+        h = Hash::fnv1a(it->data(), it->size(), h);
+    }
+
+    return h;
+}
+
+bool RuleCache::write(const std::string & path, const RuleSet & set, uint64_t source)
+{
+    const Program & program = set.getProgram();
+    StringTable strings;
+    std::vector<ConstantRecord> constants;
+    std::vector<uint32_t> fields;
+
+    for (std::vector<Scalar>::const_iterator it = program.constants.begin(); it != program.constants.end(); it++) {
+        ConstantRecord c;
+
+        c.type = it->getType();
+        c.string = strings.intern(it->getText());
+        c.integer = it->getInteger();
+        c.real = it->getDouble();
+
+        constants.push_back(c);
+    }
+
+    for (std::vector<std::string>::const_iterator it = program.fields.begin(); it != program.fields.end(); it++) {
+        fields.push_back(strings.intern(*it));
+    }
+
+    std::vector<uint32_t> offsets(1, 0);
+    std::string bytes;
+
+    for (size_t i = 0; i < strings.size(); i++) {
+        bytes.append(strings.get(i));
+        offsets.push_back(bytes.size());
+    }
+
+    Header h;
+    std::string out(sizeof(h), '\0');
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = version;
+    h.byteOrder = byteOrder;
+    h.instructionSize = sizeof(Instruction);
+    h.predicateSize = sizeof(Predicate);
+    h.switchSize = sizeof(Switch);
+    h.caseSize = sizeof(SwitchCase);
+    h.source = source;
+    h.registers = program.registers;
+
+    h.code = append(out, program.getCode(), sizeof(Instruction), program.numInstructions());
+    h.predicates = append(out, program.getPredicates(), sizeof(Predicate), program.numPredicates());
+    h.entries = append(out, program.getEntries(), sizeof(uint32_t), program.numEntries());
+    h.constants = append(out, constants.data(), sizeof(ConstantRecord), constants.size());
+    h.fields = append(out, fields.data(), sizeof(uint32_t), fields.size());
+    h.switches = append(out, program.switches.data(), sizeof(Switch), program.switches.size());
+    h.cases = append(out, program.cases.data(), sizeof(SwitchCase), program.cases.size());
+    h.strings = append(out, offsets.data(), sizeof(uint32_t), offsets.size());
+    h.strings.count = strings.size();
+    out.append(bytes);
+
+    h.size = out.size();
+    h.checksum = Hash::fnv1a(out.data() + sizeof(h), out.size() - sizeof(h));
+    memcpy(&out[0], &h, sizeof(h));
+
+    std::string tmp = path + ".tmp." + std::to_string((long long)getpid());
+
+    {
+        std::ofstream file(tmp.c_str(), std::ios::binary | std::ios::trunc);
+
+        file.write(out.data(), out.size());
+        file.close();
+
+        if (! file) {
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+RuleSet * RuleCache::load(const std::string & path, uint64_t source)
+{
+    std::unique_ptr<MappedFile> file(MappedFile::open(path));
+
+    if (! file || file->size() < sizeof(Header)) return NULL;
+
+    const char * base = file->getData();
+    const Header & h = *(const Header *)base;
+
+    if (memcmp(h.magic, magic, sizeof(magic)) != 0 || h.version != version || h.byteOrder != byteOrder) return NULL;
+    if (h.instructionSize != sizeof(Instruction) || h.predicateSize != sizeof(Predicate)) return NULL;
+    if (h.switchSize != sizeof(Switch) || h.caseSize != sizeof(SwitchCase)) return NULL;
+    if (h.size != file->size() || h.source != source || h.registers > 256) return NULL;
+
+    if (! contains(h, h.code, sizeof(Instruction)) ||
+        ! contains(h, h.predicates, sizeof(Predicate)) ||
+        ! contains(h, h.entries, sizeof(uint32_t)) ||
+        ! contains(h, h.constants, sizeof(ConstantRecord)) ||
+        ! contains(h, h.fields, sizeof(uint32_t)) ||
+        ! contains(h, h.switches, sizeof(Switch)) ||
+        ! contains(h, h.cases, sizeof(SwitchCase)) ||
+        ! contains(h, h.strings, sizeof(uint32_t)) ||
+        h.strings.count >= (h.size - h.strings.offset) / sizeof(uint32_t)) return NULL;
+
+    if (Hash::fnv1a(base + sizeof(h), h.size - sizeof(h)) != h.checksum) return NULL;
+
+    const Instruction * code = (const Instruction *)(base + h.code.offset);
+    const Predicate * predicates = (const Predicate *)(base + h.predicates.offset);
+    const uint32_t * entries = (const uint32_t *)(base + h.entries.offset);
+    const ConstantRecord * constants = (const ConstantRecord *)(base + h.constants.offset);
+    const uint32_t * fields = (const uint32_t *)(base + h.fields.offset);
+    const Switch * switches = (const Switch *)(base + h.switches.offset);
+    const SwitchCase * cases = (const SwitchCase *)(base + h.cases.offset);
+    const uint32_t * offsets = (const uint32_t *)(base + h.strings.offset);
+    const char * bytes = (const char *)(offsets + h.strings.count + 1);
+    size_t available = base + h.size - bytes;
+
+    for (uint32_t i = 0; i < h.strings.count; i++) {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > available) return NULL;
+    }
+
+    if (! valid(h, code, predicates, entries, switches, cases)) return NULL;
+
+    std::unique_ptr<RuleSet> set(new RuleSet());
+    Program & program = set->program;
+
+    for (uint32_t i = 0; i < h.constants.count; i++) {
+        const ConstantRecord & c = constants[i];
+
+        if (c.string >= h.strings.count) return NULL;
+
+        const char * s = bytes + offsets[c.string];
+        size_t len = offsets[c.string + 1] - offsets[c.string];
+        Scalar value;
+
+        switch (c.type) {
+            case Scalar::Type::STRING:
+                value.setString(s, len);
+                break;
+            case Scalar::Type::INTEGER:
+                value.setNumber(s, len);
+                break;
+            case Scalar::Type::DOUBLE:
+                value.setDouble(c.real, s, len);
+                break;
+            case Scalar::Type::BOOLEAN:
+                value.setBoolean(c.integer != 0);
+                break;
+            default:
+                return NULL;
+        }
+
+        value.intern(set->pool->getInterner());
+        program.constants.push_back(value);
+    }
+
+    for (uint32_t i = 0; i < h.fields.count; i++) {
+        if (fields[i] >= h.strings.count) return NULL;
+
+        program.fields.push_back(std::string(bytes + offsets[fields[i]], offsets[fields[i] + 1] - offsets[fields[i]]));
+        set->schema.add(program.fields.back());
+    }
+
+    // switches are copied rather than mapped, since their tables are built here
+    program.switches.assign(switches, switches + h.switches.count);
+    program.cases.assign(cases, cases + h.cases.count);
+    program.indexSwitches();
+
+    set->schema.build();
+    program.bind(set->schema);
+    program.registers = h.registers;
+    program.map(code, h.code.count, predicates, h.predicates.count, entries, h.entries.count);
+    set->markText();
+    set->mapping.reset(file.release());
+
+    return set.release();
+}
+
+RuleSet * RuleCache::open(const std::string & path, const std::vector<std::string> & rules)
+{
+    uint64_t source = hash(rules);
+    RuleSet * cached = load(path, source);
+
+    if (cached) return cached;
+
+    std::unique_ptr<RuleSet> set(new RuleSet());
+
+    for (std::vector<std::string>::const_iterator it = rules.begin(); it != rules.end(); it++) {
+        set->add(*it);
+    }
+
+    // a cache that can't be written only costs the next start its speed
+    write(path, *set, source);
+
+    return set.release();
+}
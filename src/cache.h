@@ -0,0 +1,70 @@
+#ifndef MONTY_CACHE_H
+#define MONTY_CACHE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "object.h"
+#include "ruleset.h"
+
+namespace Monty {
+
+/* A read only memory mapping of a whole file. */
+class MappedFile {
+    const char * data;
+    size_t length;
+
+public:
+    MappedFile(const char * data, size_t length) : data(data), length(length) { }
+    ~MappedFile();
+
+    // returns NULL if path can't be opened or mapped
+    static MappedFile * open(const std::string & path);
+
+    const char * getData() const { return data; }
+    size_t size() const { return length; }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile & operator=(const MappedFile &);
+};
+
+/* Stores the compiled Program of a RuleSet on disk so that a later run can
+ * map it instead of parsing and compiling every rule again.
+ *
+ * The file is a fixed header followed by sections at 8 byte aligned offsets:
+ * instructions, predicates and rule entries exactly as Program lays them out,
+ * which are executed in place from the mapping; switches and their cases;
+ * constants and field names, which refer to a table of interned strings; and
+ * the string table itself.
+ * Everything in it is an index or an offset from the start of the file, so
+ * the mapping may land at any address.
+ *
+ * The header records a format version, the byte order and word sizes it was
+ * written with, a hash of the rule json it was compiled from and a checksum
+ * of everything after the header.  A file that is missing, truncated,
+ * corrupt, from another version or built from different rules is ignored. */
+class RuleCache {
+public:
+    static const uint32_t version = 2;
+
+    // identifies a list of rule json documents, in order
+    static uint64_t hash(const std::vector<std::string> & rules);
+
+    /* Writes set to path, via a temporary file renamed into place so that a
+     * concurrent reader never maps a partial file.  Returns false on any
+     * error. */
+    static bool write(const std::string & path, const RuleSet & set, uint64_t source);
+
+    // returns NULL unless path holds a valid cache built from source
+    static RuleSet * load(const std::string & path, uint64_t source);
+
+    /* Maps path if it is current for rules; otherwise builds the set from
+     * json, which may throw ParseError, and tries to refresh the cache. */
+    static RuleSet * open(const std::string & path, const std::vector<std::string> & rules);
+};
+
+}
+
+#endif
@@ -0,0 +1,304 @@
+#include "compiler.h"
+
+using namespace Monty;
+
+Compiler::Compiler(Program & program, bool sharePredicates) : program(program), sharePredicates(sharePredicates), nextRegister(0)
+{
+    for (size_t i = 0; i < program.constants.size(); i++) {
+        constantIndex[ConstantKey(program.constants[i].getType(), program.constants[i].getText())] = i;
+    }
+
+    for (size_t i = 0; i < program.fields.size(); i++) {
+        fieldIndex[program.fields[i]] = i;
+    }
+
+    for (size_t i = 0; i < program.predicates.size(); i++) {
+        const Predicate & p = program.predicates[i];
+
+        predicateIndex[PredicateKey(p.type, p.left, p.right)] = i;
+    }
+}
+
+size_t Compiler::compile(const AST::Statement * statement)
+{
+    program.entries.push_back(program.code.size());
+
+    compileStatement(statement);
+
+    return program.entries.size() - 1;
+}
+
+void Compiler::compileStatement(const AST::Statement * statement)
+{
+    switch (statement->kind()) {
+        case AST::Base::Kind::CONDITIONAL: {
+            const AST::Conditional * c = static_cast<const AST::Conditional *>(statement);
+            std::vector<size_t> ifFalse;
+
+            if (compileSwitch(c)) break;
+
+            compileBranch(c->getCondition(), false, ifFalse);
+
+            // every statement ends in a production, which halts, so ifTrue
+            // never needs a jump over ifFalse
+            compileStatement(c->getIfTrue());
+            patch(ifFalse);
+            compileStatement(c->getIfFalse());
+            break;
+        }
+        case AST::Base::Kind::PRODUCTION:
+            compileProduction(static_cast<const AST::Production *>(statement));
+            break;
+        default:
+            assert(0);
+    }
+}
+
+namespace {
+
+/* The field tested by a Binary EQ or SEQ between a field and a constant, or
+ * NULL if expression is anything else. */
+const AST::Lookup * equality(const AST::Expression * expression, const AST::Value *& value)
+{
+    if (expression->kind() != AST::Base::Kind::BINARY) return NULL;
+
+    const AST::Binary * b = static_cast<const AST::Binary *>(expression);
+
+    if (b->getType() != AST::Binary::Type::EQ && b->getType() != AST::Binary::Type::SEQ) return NULL;
+
+    // equality is symmetric, so the constant may be on either side
+    const AST::Arg * args[] = { b->getLeft(), b->getRight() };
+
+    for (size_t i = 0; i < 2; i++) {
+        if (args[i]->kind() == AST::Base::Kind::LOOKUP && args[1 - i]->kind() == AST::Base::Kind::VALUE) {
+            value = static_cast<const AST::Value *>(args[1 - i]);
+            return static_cast<const AST::Lookup *>(args[i]);
+        }
+    }
+
+    return NULL;
+}
+
+}
+
+/* Lowers a ladder of Conditionals, each testing the same field for equality
+ * with a constant and continuing in ifFalse, to one SWITCH which jumps
+ * straight to the branch of the first test that holds, or on to whatever
+ * ends the ladder.  Returns false, having emitted nothing, if the ladder is
+ * too short to be worth a table. */
+bool Compiler::compileSwitch(const AST::Conditional * conditional)
+{
+    std::vector<const AST::Conditional *> ladder;
+    const AST::Lookup * key = NULL;
+    const AST::Statement * rest = conditional;
+
+    while (rest->kind() == AST::Base::Kind::CONDITIONAL) {
+        const AST::Conditional * c = static_cast<const AST::Conditional *>(rest);
+        const AST::Value * value;
+        const AST::Lookup * lookup = equality(c->getCondition(), value);
+
+        if (! lookup || (key && lookup->getKey() != key->getKey())) break;
+
+        key = lookup;
+        ladder.push_back(c);
+        rest = c->getIfFalse();
+    }
+
+    if (ladder.size() < minSwitchCases) return false;
+
+    uint32_t index = program.switches.size();
+    uint32_t first = program.cases.size();
+
+    program.switches.push_back(Switch(field(key->getKey()), first, ladder.size(), 0));
+
+    for (std::vector<const AST::Conditional *>::const_iterator it = ladder.begin(); it != ladder.end(); it++) {
+        const AST::Value * value;
+        const AST::Binary * b = static_cast<const AST::Binary *>((*it)->getCondition());
+
+        equality(b, value);
+        program.cases.push_back(SwitchCase(b->getType(), constant(value->value), 0));
+    }
+
+    program.indexSwitches();
+    emit(Instruction::SWITCH, 0, 0, 0, index);
+
+    // as with a single Conditional every branch halts, so none needs a jump
+    for (size_t i = 0; i < ladder.size(); i++) {
+        program.cases[first + i].target = program.code.size();
+        compileStatement(ladder[i]->getIfTrue());
+    }
+
+    program.switches[index].fallthrough = program.code.size();
+    compileStatement(rest);
+
+    return true;
+}
+
+void Compiler::compileProduction(const AST::Production * production)
+{
+    typedef std::vector<AST::Production::Segment> SegmentVector;
+
+    const SegmentVector & segments = production->getSegments();
+
+    for (SegmentVector::const_iterator it = segments.begin(); it != segments.end(); it++) {
+        if (it->literal.size()) {
+            emit(Instruction::EMIT_CONST, 0, 0, 0, constant(Scalar(it->literal)));
+        }
+
+        if (it->lookup) {
+            emit(Instruction::EMIT_FIELD, 0, 0, 0, field(it->lookup->getKey()));
+        }
+    }
+
+    emit(Instruction::HALT);
+}
+
+/* Emits code which jumps to one of fixups when expression evaluates to sense
+ * and falls through otherwise. */
+void Compiler::compileBranch(const AST::Expression * expression, bool sense, std::vector<size_t> & fixups)
+{
+    switch (expression->kind()) {
+        case AST::Base::Kind::BINARY: {
+            const AST::Binary * b = static_cast<const AST::Binary *>(expression);
+
+            if (sharePredicates) {
+                emit(Instruction::PREDICATE, 0, 0, 0, predicate(b));
+                fixups.push_back(emit(sense ? Instruction::JUMP_IF_TRUE : Instruction::JUMP_IF_FALSE));
+                break;
+            }
+
+            unsigned saved = nextRegister;
+            unsigned left = allocRegister();
+            unsigned right = allocRegister();
+
+            compileLoad(b->getLeft(), left);
+            compileLoad(b->getRight(), right);
+            emit(Instruction::COMPARE, b->getType(), left, right);
+            fixups.push_back(emit(sense ? Instruction::JUMP_IF_TRUE : Instruction::JUMP_IF_FALSE));
+
+            nextRegister = saved;
+            break;
+        }
+        case AST::Base::Kind::LOGICAL: {
+            const AST::Logical * l = static_cast<const AST::Logical *>(expression);
+            const std::vector<AST::Expression *> & clauses = l->getClauses();
+
+            // the value that short circuits evaluation of the remaining clauses
+            bool decisive = l->getType() == AST::Logical::Type::OR;
+
+            if (clauses.empty()) {
+                if (sense != decisive) fixups.push_back(emit(Instruction::JUMP));
+                break;
+            }
+
+            if (sense == decisive) {
+                for (size_t i = 0; i < clauses.size(); i++) {
+                    compileBranch(clauses[i], decisive, fixups);
+                }
+            } else {
+                std::vector<size_t> skip;
+
+                for (size_t i = 0; i + 1 < clauses.size(); i++) {
+                    compileBranch(clauses[i], decisive, skip);
+                }
+                compileBranch(clauses.back(), sense, fixups);
+                patch(skip);
+            }
+            break;
+        }
+        case AST::Base::Kind::CONSTANT:
+            if (static_cast<const AST::Constant *>(expression)->getValue() == sense) {
+                fixups.push_back(emit(Instruction::JUMP));
+            }
+            break;
+        default:
+            assert(0);
+    }
+}
+
+void Compiler::compileLoad(const AST::Arg * arg, unsigned reg)
+{
+    switch (arg->kind()) {
+        case AST::Base::Kind::VALUE:
+            emit(Instruction::LOAD_CONST, reg, 0, 0, constant(static_cast<const AST::Value *>(arg)->value));
+            break;
+        case AST::Base::Kind::LOOKUP:
+            emit(Instruction::LOAD_FIELD, reg, 0, 0, field(static_cast<const AST::Lookup *>(arg)->getKey()));
+            break;
+        default:
+            assert(0);
+    }
+}
+
+size_t Compiler::emit(Instruction::Opcode op, uint8_t a, uint8_t b, uint8_t c, uint32_t arg)
+{
+    program.code.push_back(Instruction(op, a, b, c, arg));
+
+    return program.code.size() - 1;
+}
+
+void Compiler::patch(const std::vector<size_t> & fixups)
+{
+    for (std::vector<size_t>::const_iterator it = fixups.begin(); it != fixups.end(); it++) {
+        program.code[*it].arg = program.code.size();
+    }
+}
+
+uint32_t Compiler::constant(const Scalar & s)
+{
+    ConstantKey key(s.getType(), s.getText());
+    std::map<ConstantKey, uint32_t>::const_iterator it = constantIndex.find(key);
+
+    if (it != constantIndex.end()) return it->second;
+
+    program.constants.push_back(s);
+
+    return constantIndex[key] = program.constants.size() - 1;
+}
+
+uint32_t Compiler::field(const std::string & s)
+{
+    std::map<std::string, uint32_t>::const_iterator it = fieldIndex.find(s);
+
+    if (it != fieldIndex.end()) return it->second;
+
+    program.fields.push_back(s);
+
+    return fieldIndex[s] = program.fields.size() - 1;
+}
+
+uint32_t Compiler::operand(const AST::Arg * arg)
+{
+    switch (arg->kind()) {
+        case AST::Base::Kind::VALUE:
+            return constant(static_cast<const AST::Value *>(arg)->value);
+        case AST::Base::Kind::LOOKUP:
+            return field(static_cast<const AST::Lookup *>(arg)->getKey()) | Predicate::FIELD;
+        default:
+            assert(0);
+            return 0;
+    }
+}
+
+uint32_t Compiler::predicate(const AST::Binary * binary)
+{
+    PredicateKey key(binary->getType(), operand(binary->getLeft()), operand(binary->getRight()));
+    std::map<PredicateKey, uint32_t>::const_iterator it = predicateIndex.find(key);
+
+    if (it != predicateIndex.end()) return it->second;
+
+    program.predicates.push_back(Predicate(std::get<0>(key), std::get<1>(key), std::get<2>(key)));
+
+    return predicateIndex[key] = program.predicates.size() - 1;
+}
+
+unsigned Compiler::allocRegister()
+{
+    assert(nextRegister < 256);
+
+    unsigned reg = nextRegister++;
+
+    if (nextRegister > program.registers) program.registers = nextRegister;
+
+    return reg;
+}
@@ -0,0 +1,56 @@
+#ifndef MONTY_COMPILER_H
+#define MONTY_COMPILER_H
+
+#include <map>
+#include <tuple>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "program.h"
+
+namespace Monty {
+
+/* Lowers statement trees built by Parser::parse into a Program.  Several
+ * statements may be compiled into the same program; constants and fields are
+ * shared between them, and with sharePredicates so are identical Binary
+ * comparisons. */
+class Compiler {
+    typedef std::pair<int, std::string> ConstantKey;
+    typedef std::tuple<uint8_t, uint32_t, uint32_t> PredicateKey;
+
+    Program & program;
+    bool sharePredicates;
+    std::map<ConstantKey, uint32_t> constantIndex;
+    std::map<std::string, uint32_t> fieldIndex;
+    std::map<PredicateKey, uint32_t> predicateIndex;
+    unsigned nextRegister;
+
+public:
+    // the shortest ladder of equality tests lowered to a SWITCH
+    static const size_t minSwitchCases = 4;
+
+    Compiler(Program & program, bool sharePredicates = false);
+
+    size_t compile(const AST::Statement * statement);
+
+private:
+    void compileStatement(const AST::Statement * statement);
+    bool compileSwitch(const AST::Conditional * conditional);
+    void compileProduction(const AST::Production * production);
+    void compileBranch(const AST::Expression * expression, bool sense, std::vector<size_t> & fixups);
+    void compileLoad(const AST::Arg * arg, unsigned reg);
+
+    size_t emit(Instruction::Opcode op, uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint32_t arg = 0);
+    void patch(const std::vector<size_t> & fixups);
+
+    uint32_t constant(const Scalar & s);
+    uint32_t field(const std::string & s);
+    uint32_t operand(const AST::Arg * arg);
+    uint32_t predicate(const AST::Binary * binary);
+    unsigned allocRegister();
+};
+
+}
+
+#endif
@@ -0,0 +1,261 @@
+#include "dispatcher.h"
+#include "json_scanner.h"
+
+#include <chrono>
+
+using namespace Monty;
+
+Dispatcher::Dispatcher(Transport & transport, const Limits & limits) : transport(transport), limits(limits), inFlight(0), pending(0), stopping(false), started(RuleStats::now())
+{
+    timer = std::thread(&Dispatcher::tick, this);
+}
+
+Dispatcher::~Dispatcher()
+{
+    flush();
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+
+    wake.notify_all();
+    timer.join();
+}
+
+void Dispatcher::submit(const std::string & production)
+{
+    submit(std::vector<std::string>(1, production));
+}
+
+void Dispatcher::submit(const std::vector<std::string> & productions)
+{
+    std::vector<Flight *> launched;
+    std::unique_lock<std::mutex> guard(lock);
+
+    for (std::vector<std::string>::const_iterator it = productions.begin(); it != productions.end(); it++) {
+        if (it->empty()) continue;
+
+        while (pending >= limits.pending) {
+            // everything held goes out now rather than at the end of its
+            // window, and what was launched must be sent before waiting
+            closeAll();
+            launch(launched);
+
+            guard.unlock();
+            send(launched);
+            launched.clear();
+            guard.lock();
+
+            if (pending >= limits.pending) changed.wait(guard);
+        }
+
+        add(*it, launched);
+    }
+
+    guard.unlock();
+    send(launched);
+}
+
+void Dispatcher::flush()
+{
+    std::vector<Flight *> launched;
+    std::unique_lock<std::mutex> guard(lock);
+
+    closeAll();
+    launch(launched);
+
+    guard.unlock();
+    send(launched);
+    guard.lock();
+
+    while (pending) changed.wait(guard);
+}
+
+// called with the lock held
+void Dispatcher::add(const std::string & production, std::vector<Flight *> & launched)
+{
+    std::string name(production, 0, production.find_first_of("/?"));
+    std::unique_ptr<Service> & slot = services[name];
+
+    if (! slot) slot.reset(new Service());
+
+    Service & s = *slot;
+
+    if (! s.open) {
+        s.open.reset(new Flight());
+        s.open->batch.service = name;
+        s.open->opened = RuleStats::now();
+        s.open->productions = 0;
+
+        // the timer may be sleeping past this batch's window
+        wake.notify_one();
+    }
+
+    Flight & f = *s.open;
+    std::unordered_map<std::string, size_t>::const_iterator it = s.index.find(production);
+
+    s.counts.productions++;
+    f.productions++;
+
+    if (it != s.index.end()) {
+        f.batch.counts[it->second]++;
+        s.counts.coalesced++;
+        return;
+    }
+
+    s.index.insert(std::make_pair(production, f.batch.urls.size()));
+    f.batch.urls.push_back(production);
+    f.batch.counts.push_back(1);
+    pending++;
+
+    if (f.batch.urls.size() >= limits.batchSize) {
+        close(s);
+        launch(launched);
+    }
+}
+
+void Dispatcher::close(Service & s)
+{
+    s.index.clear();
+    ready.push_back(std::move(s.open));
+}
+
+void Dispatcher::closeAll()
+{
+    for (std::map<std::string, std::unique_ptr<Service> >::const_iterator it = services.begin(); it != services.end(); it++) {
+        if (it->second->open) close(*it->second);
+    }
+}
+
+// takes closed batches off the queue while there is room in flight
+void Dispatcher::launch(std::vector<Flight *> & launched)
+{
+    while (inFlight < limits.inFlight && ! ready.empty()) {
+        launched.push_back(ready.front().release());
+        ready.pop_front();
+        inFlight++;
+    }
+}
+
+// called without the lock, since a transport may finish a batch at once
+void Dispatcher::send(const std::vector<Flight *> & launched)
+{
+    for (std::vector<Flight *>::const_iterator it = launched.begin(); it != launched.end(); it++) {
+        transport.send((*it)->batch, std::bind(&Dispatcher::finished, this, *it, std::placeholders::_1));
+    }
+}
+
+void Dispatcher::finished(Flight * flight, bool ok)
+{
+    std::vector<Flight *> launched;
+    uint64_t elapsed = RuleStats::now() - flight->opened;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Service & s = *services[flight->batch.service];
+
+        s.counts.batches++;
+        s.counts.urls += flight->batch.urls.size();
+        (ok ? s.counts.delivered : s.counts.failed) += flight->productions;
+        s.latency[Histogram::bucket(elapsed)]++;
+        s.latencySum += elapsed;
+
+        inFlight--;
+        pending -= flight->batch.urls.size();
+
+        launch(launched);
+
+        // notified under the lock: once flush sees nothing pending the
+        // dispatcher may be destroyed
+        changed.notify_all();
+    }
+
+    delete flight;
+
+    // anything launched is still pending, so the dispatcher is still alive
+    send(launched);
+}
+
+/* Runs on a thread of its own, closing batches as their windows end. */
+void Dispatcher::tick()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (! stopping) {
+        std::vector<Flight *> launched;
+        uint64_t now = RuleStats::now();
+        uint64_t next = UINT64_MAX;
+
+        for (std::map<std::string, std::unique_ptr<Service> >::const_iterator it = services.begin(); it != services.end(); it++) {
+            Service & s = *it->second;
+
+            if (! s.open) continue;
+
+            uint64_t due = s.open->opened + limits.window;
+
+            if (due <= now) {
+                close(s);
+            } else if (due < next) {
+                next = due;
+            }
+        }
+
+        launch(launched);
+
+        if (! launched.empty()) {
+            guard.unlock();
+            send(launched);
+            guard.lock();
+            continue;
+        }
+
+        if (next == UINT64_MAX) {
+            wake.wait(guard);
+        } else {
+            wake.wait_for(guard, std::chrono::nanoseconds(next - now));
+        }
+    }
+}
+
+Dispatcher::Counts Dispatcher::getCounts(const std::string & service) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::map<std::string, std::unique_ptr<Service> >::const_iterator it = services.find(service);
+
+    return it != services.end() ? it->second->counts : Counts();
+}
+
+void Dispatcher::dump(std::ostream & out) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    double seconds = (RuleStats::now() - started) / 1e9;
+
+    out << "{";
+
+    for (std::map<std::string, std::unique_ptr<Service> >::const_iterator it = services.begin(); it != services.end(); it++) {
+        const Service & s = *it->second;
+
+        out << (it == services.begin() ? "" : ",");
+        JsonScanner::quote(out, it->first);
+        out << ":{\"productions\":" << s.counts.productions
+            << ",\"coalesced\":" << s.counts.coalesced
+            << ",\"batches\":" << s.counts.batches
+            << ",\"urls\":" << s.counts.urls
+            << ",\"delivered\":" << s.counts.delivered
+            << ",\"failed\":" << s.counts.failed
+            << ",\"delivered_per_second\":" << (seconds > 0 ? s.counts.delivered / seconds : 0)
+            << ",\"latency\":";
+        Histogram::dump(out, &s.latency[0], s.latencySum);
+        out << "}";
+    }
+
+    out << "}";
+}
+
+void Dispatcher::print(std::ostream & out) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    out << "Dispatcher(services=" << services.size() << ", pending=" << pending << ", inFlight=" << inFlight << ")";
+}
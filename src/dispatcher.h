@@ -0,0 +1,143 @@
+#ifndef MONTY_DISPATCHER_H
+#define MONTY_DISPATCHER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "object.h"
+#include "stats.h"
+
+namespace Monty {
+
+/* Distinct productions for one service, in the order they were first made,
+ * with how many times each was made while the batch was open. */
+struct Delivery {
+    std::string service;
+    std::vector<std::string> urls;
+    std::vector<uint32_t> counts;
+};
+
+/* Delivers batches for a Dispatcher.  send starts a delivery and returns
+ * without waiting for it; done must then be called exactly once, from any
+ * thread and possibly before send returns, saying whether every url in the
+ * batch was delivered.  The batch stays valid until done is called. */
+class Transport: public Object {
+public:
+    typedef std::function<void(bool)> Done;
+
+    virtual void send(const Delivery & batch, const Done & done) = 0;
+};
+
+/* Sends the productions rules make to their services.  A production's
+ * service is its text up to the first '/' or '?'.
+ *
+ * Each service has an open batch that productions are added to; one already
+ * in it is only counted, so identical productions made close together are
+ * sent once.  A batch is closed when it holds batchSize distinct urls or has
+ * been open for window nanoseconds, whichever comes first, and closed
+ * batches are handed to the transport in the order they closed, at most
+ * inFlight at a time.  Once pending urls are held, waiting in batches or
+ * being sent, submit blocks until some are delivered.
+ *
+ * Per service it counts productions, how many were coalesced, batches and
+ * urls sent, and productions delivered and failed, with a histogram of the
+ * time from a batch opening to its delivery. */
+class Dispatcher: public Object {
+public:
+    struct Limits {
+        size_t batchSize;
+        uint64_t window;
+        size_t inFlight;
+        size_t pending;
+
+        Limits() : batchSize(64), window(1000000), inFlight(8), pending(65536) { }
+    };
+
+    struct Counts {
+        uint64_t productions;
+        uint64_t coalesced;
+        uint64_t batches;
+        uint64_t urls;
+        uint64_t delivered;
+        uint64_t failed;
+
+        Counts() : productions(0), coalesced(0), batches(0), urls(0), delivered(0), failed(0) { }
+    };
+
+private:
+    struct Flight {
+        Delivery batch;
+        uint64_t opened;
+        uint64_t productions;
+    };
+
+    struct Service {
+        std::unique_ptr<Flight> open;
+        std::unordered_map<std::string, size_t> index;
+        Counts counts;
+        std::vector<uint64_t> latency;
+        uint64_t latencySum;
+
+        Service() : latency(Histogram::buckets), latencySum(0) { }
+    };
+
+    Transport & transport;
+    Limits limits;
+    mutable std::mutex lock;
+    std::condition_variable changed;
+    std::condition_variable wake;
+    std::map<std::string, std::unique_ptr<Service> > services;
+    std::deque<std::unique_ptr<Flight> > ready;
+    size_t inFlight;
+    size_t pending;
+    bool stopping;
+    uint64_t started;
+    std::thread timer;
+
+public:
+    Dispatcher(Transport & transport, const Limits & limits = Limits());
+
+    // sends whatever is still held first
+    ~Dispatcher();
+
+    // empty productions, which rules make when nothing matched, are ignored
+    void submit(const std::string & production);
+    void submit(const std::vector<std::string> & productions);
+
+    // closes every open batch and waits until nothing is held
+    void flush();
+
+    Counts getCounts(const std::string & service) const;
+
+    /* Writes the statistics as a json object with a record per service:
+     * its counts, delivered productions per second since the dispatcher
+     * was made, and the latency histogram. */
+    void dump(std::ostream & out) const;
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    void add(const std::string & production, std::vector<Flight *> & launched);
+    void close(Service & s);
+    void closeAll();
+    void launch(std::vector<Flight *> & launched);
+    void send(const std::vector<Flight *> & launched);
+    void finished(Flight * flight, bool ok);
+    void tick();
+
+    Dispatcher(const Dispatcher &);
+    Dispatcher & operator=(const Dispatcher &);
+};
+
+}
+
+#endif
@@ -0,0 +1,143 @@
+#include "generator.h"
+
+#include <sstream>
+
+using namespace Monty;
+
+uint64_t Generator::next()
+{
+    // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+
+    return state * 0x2545f4914f6cdd1dULL;
+}
+
+std::string Generator::key(size_t i)
+{
+    std::ostringstream out;
+
+    out << "k" << i;
+
+    return out.str();
+}
+
+std::string Generator::value()
+{
+    std::ostringstream out;
+
+    switch (below(4)) {
+        case 0:
+            out << (int64_t)below(1000);
+            break;
+        case 1:
+            out << below(100000) << "." << below(100);
+            break;
+        case 2:
+            out << "\"s" << below(1000) << "\"";
+            break;
+        default:
+            out << (below(2) ? "true" : "false");
+            break;
+    }
+
+    return out.str();
+}
+
+std::string Generator::message(size_t fields)
+{
+    std::ostringstream out;
+
+    out << "{";
+
+    for (size_t i = 0; i < fields; i++) {
+        if (i) out << ", ";
+
+        out << "\"" << key(i) << "\" : " << value();
+    }
+
+    out << "}";
+
+    return out.str();
+}
+
+std::string Generator::binary(AST::Binary::Type type, const std::string & key, const std::string & value)
+{
+    std::ostringstream out;
+
+    out << "[\"binary\", {"
+        << "\"type\" : \"" << AST::BinaryType::names[type] << "\", "
+        << "\"left\" : [\"lookup\", {\"key\" : \"" << key << "\"}], "
+        << "\"right\" : [\"value\", {\"value\" : " << value << "}]"
+        << "}]";
+
+    return out.str();
+}
+
+std::string Generator::production(const std::string & service, size_t keys, size_t params)
+{
+    std::ostringstream out;
+
+    out << "[\"production\", {\"service\" : \"" << service << "\", "
+        << "\"path\" : [[\"value\", {\"value\" : \"v1\"}], [\"lookup\", {\"key\" : \"" << key(below(keys)) << "\"}]], "
+        << "\"params\" : [";
+
+    for (size_t i = 0; i < params; i++) {
+        if (i) out << ", ";
+
+        out << "[\"p" << i << "\", ";
+
+        if (below(2)) {
+            out << "[\"lookup\", {\"key\" : \"" << key(below(keys)) << "\"}]";
+        } else {
+            out << "[\"value\", {\"value\" : " << value() << "}]";
+        }
+
+        out << "]";
+    }
+
+    out << "]}]";
+
+    return out.str();
+}
+
+std::string Generator::rule(size_t depth, size_t keys, size_t params)
+{
+    std::string out = production("http://fallback", keys, params);
+
+    // built inside out, so the first test is the outermost
+    for (size_t i = depth; i > 0; i--) {
+        std::ostringstream s;
+        AST::Binary::Type type = (AST::Binary::Type)below(AST::Binary::Type::NUM_ITEMS);
+
+        s << "[\"conditional\", {"
+          << "\"condition\" : " << binary(type, key(below(keys)), value()) << ", "
+          << "\"ifTrue\" : " << production("http://match", keys, params) << ", "
+          << "\"ifFalse\" : " << out
+          << "}]";
+
+        out = s.str();
+    }
+
+    return out;
+}
+
+std::string Generator::ladder(size_t cases, size_t keys, size_t params)
+{
+    std::string out = production("http://fallback", keys, params);
+
+    for (size_t i = cases; i > 0; i--) {
+        std::ostringstream s;
+
+        s << "[\"conditional\", {"
+          << "\"condition\" : " << binary(AST::Binary::Type::SEQ, key(0), "\"c" + std::to_string((long long)i - 1) + "\"") << ", "
+          << "\"ifTrue\" : " << production("http://match", keys, params) << ", "
+          << "\"ifFalse\" : " << out
+          << "}]";
+
+        out = s.str();
+    }
+
+    return out;
+}
@@ -0,0 +1,49 @@
+#ifndef MONTY_GENERATOR_H
+#define MONTY_GENERATOR_H
+
+#include <string>
+#include <stdint.h>
+
+#include "ast.h"
+
+namespace Monty {
+
+/* Produces synthetic rules and messages for benchmarks.  Everything is drawn
+ * from a seeded xorshift generator, so a given seed yields byte for byte the
+ * same json on every platform.
+ *
+ * Messages have fields named k0, k1, ... holding a mix of integers, doubles,
+ * strings and booleans; rules look those keys up. */
+class Generator {
+    uint64_t state;
+
+public:
+    Generator(uint64_t seed = 1) : state(seed ? seed : 1) { }
+
+    uint64_t next();
+    uint64_t below(uint64_t n) { return next() % n; }
+
+    // the json object for a message with fields k0 .. k(fields - 1)
+    std::string message(size_t fields);
+
+    // a json value of random type, as it would appear in a message
+    std::string value();
+
+    /* A chain of depth Conditionals, each testing one of keys keys and
+     * falling through to the next on false, ending in productions with
+     * params params each. */
+    std::string rule(size_t depth, size_t keys, size_t params);
+
+    /* A chain of cases Conditionals that each test k0 SEQ "c0", "c1", ... in
+     * turn, the shape of rule that compiles to a single SWITCH. */
+    std::string ladder(size_t cases, size_t keys, size_t params);
+
+    std::string binary(AST::Binary::Type type, const std::string & key, const std::string & value);
+    std::string production(const std::string & service, size_t keys, size_t params);
+
+    static std::string key(size_t i);
+};
+
+}
+
+#endif
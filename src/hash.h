@@ -0,0 +1,29 @@
+#ifndef MONTY_HASH_H
+#define MONTY_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Monty {
+
+/* FNV-1a, shared by schema slots, interned strings and the rule cache.  A
+ * hash may be continued over more bytes by passing it back in as seed. */
+namespace Hash {
+    static const uint64_t basis = 0xcbf29ce484222325ULL;
+
+    inline uint64_t fnv1a(const char * s, size_t len, uint64_t seed = basis)
+    {
+        uint64_t h = seed;
+
+        for (size_t i = 0; i < len; i++) {
+            h ^= (unsigned char)s[i];
+            h *= 0x100000001b3ULL;
+        }
+
+        return h;
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,317 @@
+#include "http_transport.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace Monty;
+
+// bytes read per call
+static const size_t readSize = 16 * 1024;
+
+// appends what the next read brings; 0 once the server has closed, < 0 on an error
+static ssize_t receive(int fd, std::string & buffer)
+{
+    for (;;) {
+        size_t have = buffer.size();
+
+        buffer.resize(have + readSize);
+
+        ssize_t n = ::recv(fd, &buffer[have], readSize, 0);
+
+        buffer.resize(have + (n > 0 ? n : 0));
+
+        if (n < 0 && errno == EINTR) continue;
+
+        return n;
+    }
+}
+
+// larger chunks are taken to be garbage
+static const unsigned long maxChunk = 1UL << 30;
+
+/* Reads a chunked body starting at pos and sets end past its trailers;
+ * false if the connection is gone or the body is malformed. */
+static bool chunked(int fd, std::string & buffer, size_t pos, size_t & end)
+{
+    size_t line;
+
+    for (;;) {
+        while ((line = buffer.find("\r\n", pos)) == std::string::npos) {
+            if (receive(fd, buffer) <= 0) return false;
+        }
+
+        // "1a;name=value", the extensions ignored
+        const char * start = buffer.c_str() + pos;
+        char * stop;
+        unsigned long size = strtoul(start, &stop, 16);
+
+        if (stop == start || size > maxChunk) return false;
+
+        pos = line + 2;
+
+        if (size == 0) break;
+
+        while (buffer.size() < pos + size + 2) {
+            if (receive(fd, buffer) <= 0) return false;
+        }
+
+        if (buffer.compare(pos + size, 2, "\r\n") != 0) return false;
+
+        pos += size + 2;
+    }
+
+    // the trailers end with an empty line
+    for (;;) {
+        while ((line = buffer.find("\r\n", pos)) == std::string::npos) {
+            if (receive(fd, buffer) <= 0) return false;
+        }
+
+        if (line == pos) break;
+
+        pos = line + 2;
+    }
+
+    end = pos + 2;
+
+    return true;
+}
+
+HttpTransport::HttpTransport(const std::string & host, int port, size_t connections, Method method) : host(host), port(std::to_string((long long)port)), method(method), stopping(false)
+{
+    if (connections == 0) connections = 1;
+
+    for (size_t i = 0; i < connections; i++) {
+        threads.push_back(std::thread(&HttpTransport::work, this));
+    }
+}
+
+HttpTransport::~HttpTransport()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+
+    available.notify_all();
+
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); it++) {
+        it->join();
+    }
+}
+
+void HttpTransport::send(const Delivery & batch, const Done & done)
+{
+    Job job = { &batch, done };
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.push_back(job);
+    }
+
+    available.notify_one();
+}
+
+void HttpTransport::work()
+{
+    std::string buffer;
+    int fd = -1;
+
+    for (;;) {
+        Job job;
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+
+            while (jobs.empty() && ! stopping) available.wait(guard);
+
+            if (jobs.empty()) break;
+
+            job = jobs.front();
+            jobs.pop_front();
+        }
+
+        size_t answered = 0;
+        bool ok = true;
+        bool broken = false;
+
+        // every round but a retry of an idle connection answers something
+        while (answered < job.batch->urls.size()) {
+            bool fresh = fd < 0;
+            size_t before = answered;
+            bool keep = true;
+
+            if (fresh) fd = connect();
+
+            if (fd < 0) {
+                broken = true;
+                break;
+            }
+
+            buffer.clear();
+
+            bool held = exchange(fd, *job.batch, buffer, answered, ok, keep);
+
+            if (! held || ! keep) {
+                ::close(fd);
+                fd = -1;
+            }
+
+            if (! held && (fresh || answered > before)) {
+                broken = true;
+                break;
+            }
+        }
+
+        job.done(ok && ! broken);
+    }
+
+    if (fd >= 0) ::close(fd);
+}
+
+int HttpTransport::connect() const
+{
+    struct addrinfo hints;
+    struct addrinfo * addrs;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) return -1;
+
+    int fd = -1;
+
+    for (struct addrinfo * a = addrs; a; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+
+        if (fd < 0) continue;
+
+        if (::connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+
+        ::close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addrs);
+
+    if (fd < 0) return -1;
+
+    struct timeval tv = { timeout, 0 };
+    int one = 1;
+
+    // requests go out as soon as they are written
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    return fd;
+}
+
+/* Writes a request for each url from answered on, then reads responses until
+ * all of them are answered or the server says it will close, which clears
+ * keep.  answered counts the responses read and ok is cleared by one that
+ * isn't 2xx.  False if the connection broke. */
+bool HttpTransport::exchange(int fd, const Delivery & batch, std::string & buffer, size_t & answered, bool & ok, bool & keep) const
+{
+    std::string request;
+
+    for (std::vector<std::string>::const_iterator it = batch.urls.begin() + answered; it != batch.urls.end(); it++) {
+        request.append(method == HEAD ? "HEAD /" : "GET /").append(*it).append(" HTTP/1.1\r\nHost: ").append(host).append(":").append(port).append("\r\n\r\n");
+    }
+
+    const char * p = request.data();
+    size_t left = request.size();
+
+    while (left) {
+        ssize_t n = ::send(fd, p, left, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+
+        p += n;
+        left -= n;
+    }
+
+    while (answered < batch.urls.size() && keep) {
+        size_t end;
+
+        while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            if (receive(fd, buffer) <= 0) return false;
+        }
+
+        // "HTTP/1.1 200 OK"
+        if (buffer.compare(0, 5, "HTTP/") != 0) return false;
+
+        size_t space = buffer.find(' ');
+        int status = space < end ? atoi(buffer.c_str() + space + 1) : 0;
+        long length = -1;
+        bool chunks = false;
+        bool closing = false;
+
+        if (status < 100) return false;
+
+        for (size_t line = buffer.find("\r\n"); line < end; line = buffer.find("\r\n", line + 2)) {
+            const char * h = buffer.c_str() + line + 2;
+
+            if (strncasecmp(h, "content-length:", 15) == 0) length = atol(h + 15);
+            if (strncasecmp(h, "connection:", 11) == 0 && strncasecmp(h + 11 + strspn(h + 11, " "), "close", 5) == 0) closing = true;
+
+            // chunked is always the last coding applied
+            if (strncasecmp(h, "transfer-encoding:", 18) == 0) {
+                size_t eol = buffer.find("\r\n", line + 2);
+                size_t last = buffer.find_last_not_of(" \t", eol - 1);
+
+                chunks = last >= line + 2 + 18 + 6 && strncasecmp(buffer.c_str() + last - 6, "chunked", 7) == 0;
+            }
+        }
+
+        size_t total = end + 4;
+
+        if ((status >= 100 && status < 200) || status == 204 || status == 304 || method == HEAD) {
+            // these never have a body, whatever their headers say
+        } else if (chunks) {
+            if (! chunked(fd, buffer, total, total)) return false;
+        } else if (length >= 0) {
+            total += length;
+
+            while (buffer.size() < total) {
+                if (receive(fd, buffer) <= 0) return false;
+            }
+        } else {
+            // the body runs until the server closes
+            ssize_t n;
+
+            while ((n = receive(fd, buffer)) > 0) {}
+
+            if (n < 0) return false;
+
+            total = buffer.size();
+            closing = true;
+        }
+
+        buffer.erase(0, total);
+
+        // an interim response comes ahead of the real one
+        if (status < 200) continue;
+
+        answered++;
+
+        if (closing) keep = false;
+        if (status >= 300) ok = false;
+    }
+
+    return true;
+}
+
+void HttpTransport::print(std::ostream & out) const
+{
+    out << "HttpTransport(" << (method == HEAD ? "HEAD " : "") << host << ":" << port << ", connections=" << threads.size() << ")";
+}
@@ -0,0 +1,72 @@
+#ifndef MONTY_HTTP_TRANSPORT_H
+#define MONTY_HTTP_TRANSPORT_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dispatcher.h"
+
+namespace Monty {
+
+/* Sends every url of a batch as an HTTP/1.1 GET (or HEAD) of "/" followed
+ * by the url to one server, so a production's service is the first segment
+ * of the path.  Each of its threads keeps a connection alive and sends a
+ * batch's requests pipelined in one write, then reads the responses, whose
+ * bodies may be sized, chunked or run to the close.  A batch is delivered
+ * if every response is 2xx.
+ *
+ * A kept connection that breaks before anything is answered, as one the
+ * server closed while idle does, is reopened and the batch sent once more.
+ * If the server answers part of a batch and says it will close, the urls
+ * it didn't answer are sent again on a new connection. */
+class HttpTransport: public Transport {
+public:
+    enum Method {
+        GET,
+        HEAD,
+    };
+
+private:
+    struct Job {
+        const Delivery * batch;
+        Done done;
+    };
+
+    std::string host;
+    std::string port;
+    Method method;
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable available;
+    std::deque<Job> jobs;
+    bool stopping;
+
+public:
+    // seconds a connection may stall before its batch fails
+    static const int timeout = 10;
+
+    HttpTransport(const std::string & host, int port, size_t connections = 4, Method method = GET);
+
+    // finishes the batches already sent
+    ~HttpTransport();
+
+    virtual void send(const Delivery & batch, const Done & done);
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    void work();
+    int connect() const;
+    bool exchange(int fd, const Delivery & batch, std::string & buffer, size_t & answered, bool & ok, bool & keep) const;
+
+    HttpTransport(const HttpTransport &);
+    HttpTransport & operator=(const HttpTransport &);
+};
+
+}
+
+#endif
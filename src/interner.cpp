@@ -0,0 +1,83 @@
+#include "interner.h"
+
+#include <cstring>
+
+using namespace Monty;
+
+Interner::Table::Table(size_t size) : mask(size - 1), slots(new std::atomic<const Entry *>[size])
+{
+    for (size_t i = 0; i < size; i++) slots[i].store(NULL, std::memory_order_relaxed);
+}
+
+Interner::Interner()
+{
+    tables.push_back(std::unique_ptr<Table>(new Table(64)));
+    table.store(tables.back().get());
+}
+
+/* Returns the entry holding s, or NULL with slot at the empty slot that ends
+ * its probe sequence. */
+const Interner::Entry * Interner::probe(const Table & t, const char * s, size_t len, uint64_t hash, size_t & slot)
+{
+    for (slot = hash & t.mask;; slot = (slot + 1) & t.mask) {
+        const Entry * e = t.slots[slot].load(std::memory_order_acquire);
+
+        if (! e) return NULL;
+
+        if (e->hash == hash && e->text.size() == len && memcmp(e->text.data(), s, len) == 0) return e;
+    }
+}
+
+const std::string * Interner::find(const char * s, size_t len, uint64_t hash) const
+{
+    size_t slot;
+    const Entry * e = probe(*table.load(std::memory_order_acquire), s, len, hash, slot);
+
+    return e ? &e->text : NULL;
+}
+
+const std::string * Interner::intern(const char * s, size_t len, uint64_t hash)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Table * t = table.load(std::memory_order_relaxed);
+    size_t slot;
+
+    if (const Entry * e = probe(*t, s, len, hash, slot)) return &e->text;
+
+    // kept at most half full, so probes stay short and always end
+    if ((entries.size() + 1) * 2 > t->mask + 1) {
+        Table * bigger = new Table((t->mask + 1) * 2);
+
+        for (std::deque<Entry>::const_iterator it = entries.begin(); it != entries.end(); it++) {
+            size_t i;
+
+            probe(*bigger, it->text.data(), it->text.size(), it->hash, i);
+            bigger->slots[i].store(&*it, std::memory_order_relaxed);
+        }
+
+        // readers may still be probing the old table, so it is kept
+        tables.push_back(std::unique_ptr<Table>(bigger));
+        table.store(bigger, std::memory_order_release);
+        t = bigger;
+
+        probe(*t, s, len, hash, slot);
+    }
+
+    Entry e = { hash, std::string(s, len) };
+    entries.push_back(e);
+    t->slots[slot].store(&entries.back(), std::memory_order_release);
+
+    return &entries.back().text;
+}
+
+size_t Interner::size() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    return entries.size();
+}
+
+void Interner::print(std::ostream & out) const
+{
+    out << "Interner(strings=" << size() << ")";
+}
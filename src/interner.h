@@ -0,0 +1,71 @@
+#ifndef MONTY_INTERNER_H
+#define MONTY_INTERNER_H
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "hash.h"
+#include "object.h"
+
+namespace Monty {
+
+/* One canonical copy of every string interned, so that two strings interned
+ * in the same interner are equal exactly when they are the same pointer.
+ *
+ * Rule constants are interned as they are parsed, into the interner of the
+ * Pool or Rule that owns them, so the strings are freed along with the
+ * rules; a reload doesn't leave the old generation's constants behind.
+ * Message values are only looked up, so traffic can't grow the table, and a
+ * value that misses simply isn't interned.  Lookups take no lock: the table
+ * is open addressed with atomic slots that are only ever filled, and growing
+ * publishes a new array while keeping the old ones for readers still probing
+ * them.  Strings stay until the interner is destroyed. */
+class Interner: public Object {
+    struct Entry {
+        uint64_t hash;
+        std::string text;
+    };
+
+    struct Table {
+        size_t mask;
+        std::unique_ptr<std::atomic<const Entry *>[]> slots;
+
+        Table(size_t size);
+    };
+
+    mutable std::mutex lock;
+    std::atomic<Table *> table;
+    std::vector<std::unique_ptr<Table> > tables;
+    std::deque<Entry> entries;
+
+public:
+    Interner();
+
+    // as stored with every Scalar
+    static uint64_t hash(const char * s, size_t len) { return Hash::fnv1a(s, len); }
+
+    // the canonical copy of s, added if need be
+    const std::string * intern(const char * s, size_t len, uint64_t hash);
+
+    // the canonical copy of s, or NULL if it was never interned
+    const std::string * find(const char * s, size_t len, uint64_t hash) const;
+
+    size_t size() const;
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    static const Entry * probe(const Table & t, const char * s, size_t len, uint64_t hash, size_t & slot);
+
+    Interner(const Interner &);
+    Interner & operator=(const Interner &);
+};
+
+}
+
+#endif
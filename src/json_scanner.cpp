@@ -0,0 +1,299 @@
+#include "json_scanner.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace Monty;
+
+std::string JsonToken::names[] = {
+    "END",
+    "ERROR",
+    "OBJECT_BEGIN",
+    "OBJECT_END",
+    "ARRAY_BEGIN",
+    "ARRAY_END",
+    "STRING",
+    "NUMBER",
+    "TRUE",
+    "FALSE",
+    "NUL",
+};
+
+JsonScanner::Token JsonScanner::fail()
+{
+    expect = FAILED;
+
+    return ERROR;
+}
+
+JsonScanner::Token JsonScanner::next()
+{
+    // separators are checked against what the grammar allows, not returned
+    for (; cur < end; cur++) {
+        char c = *cur;
+
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t') continue;
+
+        if (c == ':') {
+            if (expect != COLON) return fail();
+            expect = VALUE;
+        } else if (c == ',') {
+            if (! (expect & (OBJECT_COMMA | ARRAY_COMMA))) return fail();
+            expect = expect == OBJECT_COMMA ? KEY : VALUE;
+        } else {
+            break;
+        }
+    }
+
+    tokenStart = cur;
+    tokenLength = 0;
+    tokenEscaped = false;
+
+    if (cur == end) {
+        // nothing at all is END too, and left to the caller
+        if (open.empty() && (expect & (VALUE | DONE))) return END;
+
+        return fail();
+    }
+
+    char c = *cur;
+
+    tokenLength = 1;
+
+    if (c == '}' || c == ']') {
+        // only an object expects a key or an object's comma, and so on
+        if (! (expect & (c == '}' ? OBJECT_COMMA | FIRST_KEY : ARRAY_COMMA | FIRST_VALUE))) return fail();
+
+        cur++;
+        open.resize(open.size() - 1);
+        after = open.empty() ? DONE : open[open.size() - 1] == '{' ? OBJECT_COMMA : ARRAY_COMMA;
+        expect = after;
+
+        return c == '}' ? OBJECT_END : ARRAY_END;
+    }
+
+    if (expect & (KEY | FIRST_KEY)) {
+        if (c != '"') return fail();
+
+        expect = COLON;
+
+        return scanString();
+    }
+
+    if (! (expect & (VALUE | FIRST_VALUE))) return fail();
+
+    // the scanners fail the scanner themselves
+    expect = after;
+
+    switch (c) {
+        case '{':
+        case '[':
+            cur++;
+            open.push_back(c);
+            expect = c == '{' ? FIRST_KEY : FIRST_VALUE;
+            after = c == '{' ? OBJECT_COMMA : ARRAY_COMMA;
+            return c == '{' ? OBJECT_BEGIN : ARRAY_BEGIN;
+        case '"':
+            return scanString();
+        case 't':
+            return scanLiteral("true", 4, TRUE);
+        case 'f':
+            return scanLiteral("false", 5, FALSE);
+        case 'n':
+            return scanLiteral("null", 4, NUL);
+        default:
+            if (c == '-' || (c >= '0' && c <= '9')) return scanNumber();
+            return fail();
+    }
+}
+
+JsonScanner::Token JsonScanner::scanString()
+{
+    const char * p = cur + 1;
+
+    tokenStart = p;
+
+    for (;;) {
+        const char * q = (const char *)memchr(p, '"', end - p);
+
+        if (! q) return fail();
+
+        // a quote preceded by an odd number of backslashes is escaped
+        const char * b = q;
+        while (b > p && b[-1] == '\\') b--;
+
+        if ((q - b) & 1) {
+            tokenEscaped = true;
+            p = q + 1;
+            continue;
+        }
+
+        if (! tokenEscaped && memchr(tokenStart, '\\', q - tokenStart)) tokenEscaped = true;
+
+        tokenLength = q - tokenStart;
+        cur = q + 1;
+
+        return STRING;
+    }
+}
+
+JsonScanner::Token JsonScanner::scanNumber()
+{
+    const char * p = cur;
+
+    while (p < end) {
+        char c = *p;
+
+        if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E') {
+            p++;
+        } else {
+            break;
+        }
+    }
+
+    tokenLength = p - cur;
+    cur = p;
+
+    return NUMBER;
+}
+
+JsonScanner::Token JsonScanner::scanLiteral(const char * literal, size_t len, Token token)
+{
+    if ((size_t)(end - cur) < len || memcmp(cur, literal, len) != 0) return fail();
+
+    tokenLength = len;
+    cur += len;
+
+    return token;
+}
+
+bool JsonScanner::skip(Token token)
+{
+    if (token != OBJECT_BEGIN && token != ARRAY_BEGIN) return token != ERROR;
+
+    size_t target = open.size() - 1;
+
+    // tokenized so that the grammar is checked, but nothing is decoded
+    while (open.size() > target) {
+        if (next() == ERROR) return false;
+    }
+
+    return true;
+}
+
+static void appendUtf8(std::string & out, unsigned long cp)
+{
+    if (cp < 0x80) {
+        out.push_back((char)cp);
+    } else if (cp < 0x800) {
+        out.push_back((char)(0xc0 | (cp >> 6)));
+        out.push_back((char)(0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        out.push_back((char)(0xe0 | (cp >> 12)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back((char)(0x80 | (cp & 0x3f)));
+    } else {
+        out.push_back((char)(0xf0 | (cp >> 18)));
+        out.push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back((char)(0x80 | (cp & 0x3f)));
+    }
+}
+
+static bool hex4(const char * s, const char * end, unsigned long & out)
+{
+    if (end - s < 4) return false;
+
+    out = 0;
+
+    for (int i = 0; i < 4; i++) {
+        char c = s[i];
+
+        out <<= 4;
+
+        if (c >= '0' && c <= '9') {
+            out |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            out |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            out |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool JsonScanner::unescape(const char * s, size_t len, std::string & out)
+{
+    const char * end = s + len;
+
+    while (s < end) {
+        const char * bs = (const char *)memchr(s, '\\', end - s);
+
+        if (! bs) {
+            out.append(s, end - s);
+            break;
+        }
+
+        out.append(s, bs - s);
+        s = bs + 1;
+
+        if (s == end) return false;
+
+        switch (*s++) {
+            case '"': out.push_back('"'); break;
+            case '\\': out.push_back('\\'); break;
+            case '/': out.push_back('/'); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                unsigned long cp;
+
+                if (! hex4(s, end, cp)) return false;
+                s += 4;
+
+                if (cp >= 0xd800 && cp < 0xdc00 && end - s >= 6 && s[0] == '\\' && s[1] == 'u') {
+                    unsigned long low;
+
+                    if (hex4(s + 2, end, low) && low >= 0xdc00 && low < 0xe000) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                        s += 6;
+                    }
+                }
+
+                appendUtf8(out, cp);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void JsonScanner::quote(std::ostream & out, const std::string & s)
+{
+    out << '"';
+
+    for (std::string::const_iterator it = s.begin(); it != s.end(); it++) {
+        unsigned char c = *it;
+
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out << buf;
+        } else {
+            out << c;
+        }
+    }
+
+    out << '"';
+}
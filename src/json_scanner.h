@@ -0,0 +1,104 @@
+#ifndef MONTY_JSONSCANNER_H
+#define MONTY_JSONSCANNER_H
+
+#include <ostream>
+#include <string>
+#include <stddef.h>
+
+namespace Monty {
+
+namespace JsonToken {
+    extern std::string names[];
+}
+
+/* A pull tokenizer over a json buffer.  Tokens are returned as spans of the
+ * input, nothing is copied or decoded unless asked for, and values that
+ * aren't wanted can be skipped without being decoded.
+ *
+ * Commas and colons are consumed between tokens.  The scanner keeps a stack
+ * of open brackets and the separator it expects next, so anything out of
+ * place, such as a missing colon or a bracket that closes the wrong one, is
+ * returned as ERROR, as is every token after it. */
+class JsonScanner {
+public:
+    enum Token {
+        END,
+        ERROR,
+        OBJECT_BEGIN,
+        OBJECT_END,
+        ARRAY_BEGIN,
+        ARRAY_END,
+        STRING,
+        NUMBER,
+        TRUE,
+        FALSE,
+        NUL,
+        NUM_ITEMS,
+    };
+
+private:
+    // what may come next, as bits so that several can be tested at once
+    enum Expect {
+        FAILED = 0,
+        VALUE = 1,
+        FIRST_VALUE = 2,
+        KEY = 4,
+        FIRST_KEY = 8,
+        COLON = 16,
+        OBJECT_COMMA = 32,
+        ARRAY_COMMA = 64,
+        DONE = 128,
+    };
+
+    const char * begin;
+    const char * cur;
+    const char * end;
+
+    const char * tokenStart;
+    size_t tokenLength;
+    bool tokenEscaped;
+    Expect expect;
+
+    // what follows a value in the innermost container
+    Expect after;
+
+    // '{' or '[' for each container open
+    std::string open;
+
+public:
+    JsonScanner(const char * s, size_t len) : begin(s), cur(s), end(s + len), tokenStart(s), tokenLength(0), tokenEscaped(false), expect(VALUE), after(DONE) { }
+
+    Token next();
+
+    /* Skips the rest of the value that token started; a no-op for scalars.
+     * Returns false on malformed input. */
+    bool skip(Token token);
+
+    // the last token: string contents without quotes, or the number's text
+    const char * start() const { return tokenStart; }
+    size_t length() const { return tokenLength; }
+    bool escaped() const { return tokenEscaped; }
+
+    // offset of the last token in the input
+    size_t offset() const { return tokenStart - begin; }
+
+    // offset just past the last token, or past the value skip() passed over
+    size_t consumed() const { return cur - begin; }
+    int getDepth() const { return open.size(); }
+
+    /* Appends the decoded form of an escaped string token to out. */
+    static bool unescape(const char * s, size_t len, std::string & out);
+
+    // writes s as a json string, escaping what must be
+    static void quote(std::ostream & out, const std::string & s);
+
+private:
+    Token fail();
+    Token scanString();
+    Token scanNumber();
+    Token scanLiteral(const char * literal, size_t len, Token token);
+};
+
+}
+
+#endif
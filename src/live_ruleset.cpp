@@ -0,0 +1,187 @@
+#include "live_ruleset.h"
+
+#include <algorithm>
+
+using namespace Monty;
+
+// distinguishes a LiveRuleSet from an earlier one at the same address
+static std::atomic<uint64_t> nextId(1);
+
+/* The slots a thread holds, given up when it exits.  Sets destroyed since
+ * are skipped. */
+struct LiveRuleSet::Leases {
+    std::vector<std::pair<std::weak_ptr<Slots>, Slot *> > held;
+
+    ~Leases()
+    {
+        for (size_t i = 0; i < held.size(); i++) {
+            std::shared_ptr<Slots> slots = held[i].first.lock();
+
+            if (! slots) continue;
+
+            std::lock_guard<std::mutex> guard(slots->lock);
+            held[i].second->owner = std::thread::id();
+        }
+    }
+};
+
+LiveRuleSet::LiveRuleSet(RuleSet * initial) : current(initial), epoch(1), slots(std::make_shared<Slots>()), blocking(0), id(nextId++)
+{
+}
+
+LiveRuleSet::~LiveRuleSet()
+{
+    for (std::vector<Retired>::iterator it = retired.begin(); it != retired.end(); it++) {
+        delete it->set;
+    }
+
+    delete current.load();
+}
+
+/* The slot is found once per thread and then cached.  Registration locks,
+ * but only happens the first time a thread reads a given LiveRuleSet, and
+ * takes over a slot some exited thread gave up if there is one. */
+LiveRuleSet::Slot * LiveRuleSet::slot() const
+{
+    static thread_local const LiveRuleSet * cachedSet = NULL;
+    static thread_local uint64_t cachedId = 0;
+    static thread_local Slot * cachedSlot = NULL;
+    static thread_local Leases leases;
+
+    if (cachedSet == this && cachedId == id) return cachedSlot;
+
+    std::lock_guard<std::mutex> guard(slots->lock);
+    std::thread::id self = std::this_thread::get_id();
+    Slot * s = NULL;
+    Slot * free = NULL;
+
+    for (std::deque<Slot>::iterator it = slots->slots.begin(); it != slots->slots.end(); it++) {
+        if (it->owner == self) s = &*it;
+        if (it->owner == std::thread::id() && ! free) free = &*it;
+    }
+
+    if (! s) {
+        if (free) {
+            s = free;
+            s->owner = self;
+        } else {
+            slots->slots.emplace_back(self);
+            s = &slots->slots.back();
+        }
+
+        std::vector<std::pair<std::weak_ptr<Slots>, Slot *> > & held = leases.held;
+
+        held.erase(std::remove_if(held.begin(), held.end(), [](const std::pair<std::weak_ptr<Slots>, Slot *> & lease) {
+            return lease.first.expired();
+        }), held.end());
+        held.push_back(std::make_pair(std::weak_ptr<Slots>(slots), s));
+    }
+
+    cachedSet = this;
+    cachedId = id;
+    cachedSlot = s;
+
+    return s;
+}
+
+/* The epoch is stored before the set is loaded, both sequentially
+ * consistent, so any set this reader loads was retired, if at all, at an
+ * epoch no earlier than the one it pinned. */
+LiveRuleSet::Reader::Reader(const LiveRuleSet & live) : live(live), slot(live.slot())
+{
+    if (slot->depth++ == 0) {
+        slot->epoch.store(live.epoch.load() + 1);
+    }
+
+    set = live.current.load();
+}
+
+/* A reader that pinned an epoch no later than some retirement may be the
+ * last one holding that set, so it tries to free it.  The slot is cleared
+ * before blocking is read and publish sets blocking before reading slots,
+ * all sequentially consistent, so one of the two always sees the other. */
+LiveRuleSet::Reader::~Reader()
+{
+    if (--slot->depth == 0) {
+        uint64_t pinned = slot->epoch.load(std::memory_order_relaxed) - 1;
+
+        slot->epoch.store(0);
+
+        if (pinned < live.blocking.load()) live.reclaim();
+    }
+}
+
+void LiveRuleSet::publish(RuleSet * next)
+{
+    std::lock_guard<std::mutex> guard(slots->lock);
+    RuleSet * old = current.exchange(next);
+
+    if (old) {
+        uint64_t e = epoch.fetch_add(1);
+
+        retired.push_back(Retired(old, e));
+        blocking.store(e + 1);
+    }
+
+    reclaimLocked();
+}
+
+void LiveRuleSet::reload(const std::vector<std::string> & rules)
+{
+    std::unique_ptr<RuleSet> next(new RuleSet());
+
+    for (std::vector<std::string>::const_iterator it = rules.begin(); it != rules.end(); it++) {
+        next->add(*it);
+    }
+
+    publish(next.release());
+}
+
+size_t LiveRuleSet::reclaim() const
+{
+    std::lock_guard<std::mutex> guard(slots->lock);
+
+    return reclaimLocked();
+}
+
+/* A set retired at epoch e is safe to free once every active reader pinned
+ * an epoch after e: those readers all loaded the set that replaced it. */
+size_t LiveRuleSet::reclaimLocked() const
+{
+    uint64_t oldest = UINT64_MAX;
+
+    for (std::deque<Slot>::const_iterator it = slots->slots.begin(); it != slots->slots.end(); it++) {
+        uint64_t e = it->epoch.load();
+
+        if (e && e - 1 < oldest) oldest = e - 1;
+    }
+
+    std::vector<Retired> kept;
+
+    for (std::vector<Retired>::iterator it = retired.begin(); it != retired.end(); it++) {
+        if (it->epoch < oldest) {
+            delete it->set;
+        } else {
+            kept.push_back(*it);
+        }
+    }
+
+    retired.swap(kept);
+
+    if (retired.empty()) blocking.store(0);
+
+    return retired.size();
+}
+
+void LiveRuleSet::print(std::ostream & out) const
+{
+    std::lock_guard<std::mutex> guard(slots->lock);
+    size_t readers = 0;
+
+    for (std::deque<Slot>::const_iterator it = slots->slots.begin(); it != slots->slots.end(); it++) {
+        if (it->owner != std::thread::id()) readers++;
+    }
+
+    out << "LiveRuleSet(epoch=" << epoch.load() << ", readers=" << readers << ", slots=" << slots->slots.size()
+        << ", retired=" << retired.size() << ")";
+}
@@ -0,0 +1,113 @@
+#ifndef MONTY_LIVE_RULESET_H
+#define MONTY_LIVE_RULESET_H
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "object.h"
+#include "ruleset.h"
+
+namespace Monty {
+
+/* The RuleSet currently in force, replaceable while other threads evaluate
+ * it.  Readers never lock: a Reader pins the current epoch in a slot owned by
+ * its thread and loads the published set.  publish() swaps in a new set
+ * atomically and retires the old one, which is freed once every thread that
+ * was reading when it was swapped out has moved on: by the last of those
+ * readers to finish, or by publish() if none remain.
+ *
+ * A thread claims its slot the first time it reads and gives it up when it
+ * exits, so slots are reused rather than piling up as threads come and go. */
+class LiveRuleSet: public Object {
+    struct Slot {
+        // 0 when idle, otherwise one more than the epoch seen on entry
+        std::atomic<uint64_t> epoch;
+        // no thread when free
+        std::thread::id owner;
+        unsigned depth;
+
+        // keeps each slot's epoch on a cache line of its own
+        char padding[64];
+
+        Slot(std::thread::id owner) : epoch(0), owner(owner), depth(0) { }
+    };
+
+    // shared with the threads holding slots, which may outlive the set
+    struct Slots {
+        std::mutex lock;
+        std::deque<Slot> slots;
+    };
+
+    struct Leases;
+
+    struct Retired {
+        RuleSet * set;
+        uint64_t epoch;
+
+        Retired(RuleSet * set, uint64_t epoch) : set(set), epoch(epoch) { }
+    };
+
+    std::atomic<RuleSet *> current;
+    std::atomic<uint64_t> epoch;
+    std::shared_ptr<Slots> slots;
+    mutable std::vector<Retired> retired;
+    // one past the latest epoch retired at, 0 once nothing is retired
+    mutable std::atomic<uint64_t> blocking;
+    uint64_t id;
+
+public:
+    /* Pins the published set for as long as it lives.  Readers on one thread
+     * may nest. */
+    class Reader {
+        const LiveRuleSet & live;
+        Slot * slot;
+        const RuleSet * set;
+
+    public:
+        Reader(const LiveRuleSet & live);
+        ~Reader();
+
+        const RuleSet & operator*() const { return *set; }
+        const RuleSet * operator->() const { return set; }
+
+    private:
+        Reader(const Reader &);
+        Reader & operator=(const Reader &);
+    };
+
+    // takes ownership of initial
+    LiveRuleSet(RuleSet * initial);
+    ~LiveRuleSet();
+
+    /* Makes next, which the LiveRuleSet takes ownership of, the set new
+     * readers see, and frees whatever retired sets no reader can still be
+     * using. */
+    void publish(RuleSet * next);
+
+    /* Builds a set from rule json and publishes it.  Parsing and compiling
+     * happen on the calling thread; if any rule fails to parse the
+     * ParseError is thrown and the current set stays. */
+    void reload(const std::vector<std::string> & rules);
+
+    // frees retired sets no reader can still see; returns how many remain
+    size_t reclaim() const;
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    Slot * slot() const;
+    size_t reclaimLocked() const;
+
+    LiveRuleSet(const LiveRuleSet &);
+    LiveRuleSet & operator=(const LiveRuleSet &);
+};
+
+}
+
+#endif
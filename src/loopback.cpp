@@ -0,0 +1,151 @@
+#include "loopback.h"
+
+#include <chrono>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace Monty;
+
+LoopbackServer::LoopbackServer() : listener(socket(AF_INET, SOCK_STREAM, 0)), port(0), status(200), stopping(false)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (listener >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(listener, 64) == 0) {
+        getsockname(listener, (struct sockaddr *)&addr, &len);
+        port = ntohs(addr.sin_port);
+    }
+
+    acceptor = std::thread(&LoopbackServer::accept, this);
+}
+
+LoopbackServer::~LoopbackServer()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+
+        // wakes the threads blocked on them
+        shutdown(listener, SHUT_RDWR);
+        for (std::vector<int>::const_iterator it = connections.begin(); it != connections.end(); it++) shutdown(*it, SHUT_RDWR);
+    }
+
+    acceptor.join();
+
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); it++) {
+        it->join();
+    }
+
+    for (std::vector<int>::const_iterator it = connections.begin(); it != connections.end(); it++) close(*it);
+    close(listener);
+}
+
+void LoopbackServer::accept()
+{
+    for (;;) {
+        int fd = ::accept(listener, NULL, NULL);
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (fd < 0 || stopping) {
+            if (fd >= 0) close(fd);
+            return;
+        }
+
+        connections.push_back(fd);
+        threads.push_back(std::thread(&LoopbackServer::serve, this, fd));
+    }
+}
+
+/* Reads requests, which are taken to have no body, and answers all of those
+ * that have arrived whole in one write. */
+void LoopbackServer::serve(int fd)
+{
+    std::string buffer;
+    std::string out;
+    char chunk[4096];
+
+    for (;;) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+
+        if (n <= 0) return;
+
+        buffer.append(chunk, n);
+        out.clear();
+
+        size_t end;
+
+        while ((end = buffer.find("\r\n\r\n")) != std::string::npos) {
+            // "GET /path HTTP/1.1"
+            size_t start = buffer.find(' ');
+            size_t stop = buffer.find(' ', start + 1);
+
+            std::string path = stop < end ? buffer.substr(start + 1, stop - start - 1) : std::string();
+            std::pair<std::string, bool> response;
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                std::map<std::string, std::pair<std::string, bool> >::const_iterator it = canned.find(path);
+
+                if (it != canned.end()) response = it->second;
+
+                requests.push_back(path);
+                arrived.notify_all();
+            }
+
+            int s = status;
+
+            if (! response.first.empty()) {
+                out.append(response.first);
+            } else {
+                out.append("HTTP/1.1 ").append(std::to_string((long long)s)).append(s < 300 ? " OK" : " Error")
+                   .append("\r\nContent-Length: 0\r\n\r\n");
+            }
+
+            buffer.erase(0, end + 4);
+
+            // the requests behind it go unanswered
+            if (response.second) {
+                send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+                shutdown(fd, SHUT_RDWR);
+                return;
+            }
+        }
+
+        if (! out.empty() && send(fd, out.data(), out.size(), MSG_NOSIGNAL) != (ssize_t)out.size()) return;
+    }
+}
+
+void LoopbackServer::setResponse(const std::string & path, const std::string & response, bool close)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    canned[path] = std::make_pair(response, close);
+}
+
+std::vector<std::string> LoopbackServer::getRequests() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    return requests;
+}
+
+size_t LoopbackServer::getConnections() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    return connections.size();
+}
+
+bool LoopbackServer::wait(size_t n, int millis) const
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    return arrived.wait_for(guard, std::chrono::milliseconds(millis), [this, n] { return requests.size() >= n; });
+}
@@ -0,0 +1,57 @@
+#ifndef MONTY_LOOPBACK_H
+#define MONTY_LOOPBACK_H
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Monty {
+
+/* A stand-in HTTP server on 127.0.0.1 for tests and benchmarks.  It listens
+ * on a port of the system's choosing, keeps connections alive, answers every
+ * request with the current status and an empty body, and remembers the path
+ * of every request in the order they arrived.  A path can be given a canned
+ * response instead, sent as is, after which the connection may be closed
+ * without answering the requests behind it. */
+class LoopbackServer {
+    int listener;
+    int port;
+    std::atomic<int> status;
+    mutable std::mutex lock;
+    mutable std::condition_variable arrived;
+    std::map<std::string, std::pair<std::string, bool> > canned;
+    std::vector<std::string> requests;
+    std::vector<int> connections;
+    std::vector<std::thread> threads;
+    std::thread acceptor;
+    bool stopping;
+
+public:
+    LoopbackServer();
+    ~LoopbackServer();
+
+    int getPort() const { return port; }
+    void setStatus(int s) { status = s; }
+    void setResponse(const std::string & path, const std::string & response, bool close = false);
+
+    std::vector<std::string> getRequests() const;
+    size_t getConnections() const;
+
+    // waits up to millis for at least n requests in all
+    bool wait(size_t n, int millis) const;
+
+private:
+    void accept();
+    void serve(int fd);
+
+    LoopbackServer(const LoopbackServer &);
+    LoopbackServer & operator=(const LoopbackServer &);
+};
+
+}
+
+#endif
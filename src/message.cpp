@@ -1,71 +1,321 @@
 #include "message.h"
-#include <json/json.h>
+#include "json_scanner.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 
 using namespace Monty;
 
-Message::Message(const std::string & json)
-{
-    json_object * jobj = json_tokener_parse(json.c_str());
-
-    if (jobj && json_object_is_type(jobj, json_type_object)) {
-        json_object_object_foreach(jobj, key, value) {
-            std::string v;
-
-            if (value) {
-                enum json_type type = json_object_get_type(value);
-                long long int i;
-                long double d;
-                const char * s;
-
-                switch(type) {
-                    case json_type_boolean:
-                        i = json_object_get_boolean(value);
-                        v = std::to_string(i);
-                        break;
-                    case json_type_double:
-                        d = json_object_get_double(value);
-                        v = std::to_string(d);
-                        break;
-                    case json_type_int:
-                        i = json_object_get_int(value);
-                        v = std::to_string(i);
-                        break;
-                    case json_type_string:
-                        s = json_object_get_string(value);
-                        v = s;
-                        break;
-                    default:
-                        v = std::string("");
-                        break;
+const Scalar Message::empty;
+
+Message::Message(const std::string & json) : schema(NULL)
+{
+    parse(json.data(), json.size());
+}
+
+Message::Message(const std::string & json, const Schema & schema) : schema(&schema), slots(schema.size()), present(schema.size()), presence((schema.size() + 63) / 64), rootSpans(schema.numRoots())
+{
+    parse(json.data(), json.size());
+}
+
+Message::Message(const char * json, size_t len, const Schema & schema) : schema(&schema), slots(schema.size()), present(schema.size()), presence((schema.size() + 63) / 64), rootSpans(schema.numRoots())
+{
+    parse(json, len);
+}
+
+Message::Message() : schema(NULL)
+{
+}
+
+Message::Message(const Schema & schema) : schema(&schema), slots(schema.size()), present(schema.size()), presence((schema.size() + 63) / 64), rootSpans(schema.numRoots())
+{
+}
+
+void Message::reset(const char * json, size_t len)
+{
+    clear();
+    parse(json, len);
+}
+
+void Message::reset(const char * json, size_t len, const Schema & to)
+{
+    schema = &to;
+    slots.resize(to.size());
+    present.resize(to.size());
+    presence.resize((to.size() + 63) / 64);
+    rootSpans.resize(to.numRoots());
+
+    reset(json, len);
+}
+
+/* Fields are read straight off the input with a JsonScanner.  Against a
+ * schema, values of keys it doesn't name are skipped without being decoded,
+ * and parsing stops as soon as every schema key has been seen.  Malformed
+ * input leaves the message empty, as long as the error is reached. */
+void Message::parse(const char * json, size_t len)
+{
+    JsonScanner scanner(json, len);
+    size_t remaining = schema ? schema->size() : 0;
+    bool roots = schema && schema->numRoots();
+    bool kept = false;
+
+    if (scanner.next() != JsonScanner::Token::OBJECT_BEGIN) return;
+
+    if (schema && remaining == 0) return;
+
+    for (;;) {
+        JsonScanner::Token token = scanner.next();
+
+        if (token == JsonScanner::Token::OBJECT_END) break;
+
+        if (token != JsonScanner::Token::STRING) {
+            clear();
+            return;
+        }
+
+        const char * k = scanner.start();
+        size_t klen = scanner.length();
+
+        if (scanner.escaped()) {
+            key.clear();
+            JsonScanner::unescape(k, klen, key);
+            k = key.data();
+            klen = key.size();
+        }
+
+        int slot = -1;
+        int root = -1;
+
+        if (schema) {
+            slot = schema->slot(k, klen);
+            if (roots) root = schema->root(k, klen);
+        }
+
+        token = scanner.next();
+
+        // the raw value starts at its opening quote, bracket or brace
+        size_t start = scanner.offset() - (token == JsonScanner::Token::STRING ? 1 : 0);
+        bool container = token == JsonScanner::Token::OBJECT_BEGIN || token == JsonScanner::Token::ARRAY_BEGIN;
+
+        if (schema && slot < 0) {
+            // not referenced by any rule
+            if (! scanner.skip(token)) {
+                clear();
+                return;
+            }
+
+            if (root >= 0) {
+                keep(rootSpans[root], json, start, scanner.consumed());
+                kept = true;
+            }
+            continue;
+        }
+
+        Scalar & v = slot >= 0 ? slots[slot] : map[std::string(k, klen)];
+
+        if (! set(v, scanner, token)) {
+            clear();
+            return;
+        }
+
+        if (slot >= 0 && schema->comparesText(slot)) v.find(*schema->getInterner());
+
+        if (root >= 0) {
+            keep(rootSpans[root], json, start, scanner.consumed());
+            kept = true;
+        } else if (! schema && container) {
+            keep(nested[std::string(k, klen)], json, start, scanner.consumed());
+        }
+
+        if (slot >= 0 && ! present[slot]) {
+            present[slot] = PRESENT;
+            presence[slot / 64] |= 1ULL << (slot % 64);
+
+            if (--remaining == 0) break;
+        }
+    }
+
+    // paths without a top level key of their own are followed when asked for
+    if (kept) {
+        for (size_t i = 0; i < present.size(); i++) {
+            int root = schema->rootOf(i);
+
+            if (present[i] == ABSENT && root >= 0 && rootSpans[root].length) {
+                present[i] = PENDING;
+                presence[i / 64] |= 1ULL << (i % 64);
+            }
+        }
+    }
+}
+
+void Message::keep(Span & span, const char * json, size_t start, size_t end)
+{
+    span.offset = raw.size();
+    span.length = end - start;
+    raw.append(json + start, end - start);
+}
+
+const Scalar * Message::resolve(size_t slot) const
+{
+    const Span & span = rootSpans[schema->rootOf(slot)];
+
+    present[slot] = descend(span, schema->segments(slot), slots[slot]) ? PRESENT : ABSENT;
+
+    if (present[slot] == PRESENT && schema->comparesText(slot)) slots[slot].find(*schema->getInterner());
+
+    return present[slot] == PRESENT ? &slots[slot] : NULL;
+}
+
+/* Follows segments down from the value in span, setting v to what they lead
+ * to.  An array is indexed by a segment of decimal digits.  Returns false if
+ * the path leads nowhere. */
+bool Message::descend(const Span & span, const std::vector<std::string> & segments, Scalar & v) const
+{
+    JsonScanner scanner(raw.data() + span.offset, span.length);
+    JsonScanner::Token token = scanner.next();
+
+    for (std::vector<std::string>::const_iterator it = segments.begin(); it != segments.end(); it++) {
+        if (token == JsonScanner::Token::OBJECT_BEGIN) {
+            for (;;) {
+                token = scanner.next();
+
+                if (token != JsonScanner::Token::STRING) return false;
+
+                bool match;
+
+                if (scanner.escaped()) {
+                    key.clear();
+                    match = JsonScanner::unescape(scanner.start(), scanner.length(), key) && key == *it;
+                } else {
+                    match = it->size() == scanner.length() && memcmp(it->data(), scanner.start(), it->size()) == 0;
                 }
-            } else {
-                v = std::string("");
+
+                token = scanner.next();
+
+                if (match) break;
+                if (! scanner.skip(token)) return false;
             }
+        } else if (token == JsonScanner::Token::ARRAY_BEGIN) {
+            if (it->empty() || it->size() > 9 || it->find_first_not_of("0123456789") != std::string::npos) return false;
+
+            size_t index = atoi(it->c_str());
 
-            map[key] = v;
+            for (size_t i = 0;; i++) {
+                token = scanner.next();
+
+                if (token == JsonScanner::Token::ARRAY_END) return false;
+                if (i == index) break;
+                if (! scanner.skip(token)) return false;
+            }
+        } else {
+            return false;
         }
     }
 
-    json_object_put(jobj);
+    return set(v, scanner, token);
+}
+
+bool Message::set(Scalar & v, JsonScanner & scanner, JsonScanner::Token token) const
+{
+    switch (token) {
+        case JsonScanner::Token::STRING:
+            if (scanner.escaped()) {
+                scratch.clear();
+                if (! JsonScanner::unescape(scanner.start(), scanner.length(), scratch)) return false;
+                v.setString(scratch.data(), scratch.size());
+            } else {
+                v.setString(scanner.start(), scanner.length());
+            }
+            return true;
+        case JsonScanner::Token::NUMBER:
+            v.setNumber(scanner.start(), scanner.length());
+            return true;
+        case JsonScanner::Token::TRUE:
+        case JsonScanner::Token::FALSE:
+            v.setBoolean(token == JsonScanner::Token::TRUE);
+            return true;
+        case JsonScanner::Token::NUL:
+            v.clear();
+            return true;
+        case JsonScanner::Token::OBJECT_BEGIN:
+        case JsonScanner::Token::ARRAY_BEGIN:
+            // only top level scalars are kept
+            v.clear();
+            return scanner.skip(token);
+        default:
+            return false;
+    }
+}
+
+void Message::clear()
+{
+    map.clear();
+    std::fill(present.begin(), present.end(), (char)ABSENT);
+    std::fill(presence.begin(), presence.end(), 0);
+    raw.clear();
+    std::fill(rootSpans.begin(), rootSpans.end(), Span());
+    nested.clear();
 }
 
 std::string Message::get(const std::string & key) const
 {
-    std::map<std::string, std::string>::const_iterator it = map.find(key);
+    return lookup(key).getText();
+}
+
+const Scalar * Message::find(const std::string & key) const
+{
+    if (schema) {
+        int s = schema->slot(key);
 
-    if (it != map.end()) {
-        std::string v(it->second);
-        return v;
-    } else {
-        return std::string("");
+        return s >= 0 ? find((size_t)s) : NULL;
     }
+
+    std::map<std::string, Scalar>::const_iterator it = map.find(key);
+
+    if (it != map.end()) return &it->second;
+
+    if (! Schema::isPath(key)) return NULL;
+
+    std::vector<std::string> segments;
+    Schema::split(key, segments);
+
+    // a single segment names a top level key
+    if (segments.size() == 1) return (it = map.find(segments[0])) != map.end() ? &it->second : NULL;
+
+    std::map<std::string, Span>::const_iterator root = nested.find(segments[0]);
+    Scalar v;
+
+    if (root == nested.end()) return NULL;
+
+    segments.erase(segments.begin());
+
+    if (! descend(root->second, segments, v)) return NULL;
+
+    // remembered, so the path is only followed once
+    return &(map[key] = v);
 }
 
 void Message::print(std::ostream & out) const
 {
     out << "Message(";
 
-    for (std::map<std::string, std::string>::const_iterator it = map.begin(); it != map.end(); it++) {
+    if (schema) {
+        bool first = true;
+
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (present[i] != PRESENT) continue;
+
+            if (! first) out << ", ";
+            out << schema->key(i) << " => " << slots[i];
+            first = false;
+        }
+
+        out << ")";
+        return;
+    }
+
+    for (std::map<std::string, Scalar>::const_iterator it = map.begin(); it != map.end(); it++) {
         out << it->first << " => " << it->second;
 
         it++;
@@ -3,19 +3,115 @@
 
 #include <map>
 #include <ostream>
+#include <vector>
+#include <stdint.h>
 
+#include "json_scanner.h"
 #include "object.h"
+#include "scalar.h"
+#include "schema.h"
 
 namespace Monty {
 
+/* Top level fields of a json message.  Built against a Schema, fields are
+ * stored in a flat array indexed by schema slot and only the keys the schema
+ * names are decoded; everything else is skipped over in the input.
+ *
+ * Keys that are paths (see Schema) reach into nested objects and arrays.  A
+ * top level key spelled exactly like the path is used if there is one;
+ * otherwise the raw json of the path's root is kept, with an offset index,
+ * and the path is only followed, and its value decoded, when it is first
+ * looked up.  Without a schema every nested value is kept this way.  Since
+ * that first lookup fills in the value, a message must not be read by two
+ * threads at once.
+ *
+ * A message can be reset to new input, reusing its storage.  Against a schema
+ * every value's text, the raw json and the scratch buffers keep their
+ * capacity, so once they have grown to fit the traffic parsing allocates
+ * nothing.  Without a schema fields live in map nodes, which are freed. */
 class Message: public Object {
-    std::map<std::string, std::string> map;
+    // a range of raw; empty if the value wasn't there
+    struct Span {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    enum State {
+        ABSENT,
+        PRESENT,
+        PENDING,
+    };
+
+    mutable std::map<std::string, Scalar> map;
+    const Schema * schema;
+    mutable std::vector<Scalar> slots;
+    mutable std::vector<char> present;
+    std::vector<uint64_t> presence;
+    mutable std::string scratch;
+    mutable std::string key;
+    std::string raw;
+    std::vector<Span> rootSpans;
+    std::map<std::string, Span> nested;
 
 public:
+    // what lookups of missing fields see
+    static const Scalar empty;
+
     Message(const std::string & json);
+    Message(const std::string & json, const Schema & schema);
+    Message(const char * json, size_t len, const Schema & schema);
+
+    // empty until reset
+    Message();
+    explicit Message(const Schema & schema);
+
+    // replaces the contents with the fields of json
+    void reset(const char * json, size_t len);
+    void reset(const std::string & json) { reset(json.data(), json.size()); }
+
+    // also rebinds the message to schema, keeping storage where it can
+    void reset(const char * json, size_t len, const Schema & schema);
 
     std::string get(const std::string & key) const;
+    const Scalar * find(const std::string & key) const;
+
+    const Scalar & lookup(const std::string & key) const
+    {
+        const Scalar * v = find(key);
+
+        return v ? *v : empty;
+    }
+
+    const Schema * getSchema() const { return schema; }
+
+    /* A bit per schema slot, 64 to a word, set if the slot may be present:
+     * its key was found, or it is a path whose root was.  A clear bit means
+     * the slot certainly looks up as empty.  Empty without a schema. */
+    const std::vector<uint64_t> & getPresence() const { return presence; }
+
+    const Scalar * find(size_t slot) const
+    {
+        if (slot >= present.size() || present[slot] == ABSENT) return NULL;
+
+        return present[slot] == PENDING ? resolve(slot) : &slots[slot];
+    }
+
+    const Scalar & lookup(int slot) const
+    {
+        const Scalar * v = slot >= 0 ? find((size_t)slot) : NULL;
+
+        return v ? *v : empty;
+    }
+
     virtual void print(std::ostream & out) const;
+
+private:
+    void parse(const char * json, size_t len);
+    bool set(Scalar & v, JsonScanner & scanner, JsonScanner::Token token) const;
+    void keep(Span & span, const char * json, size_t start, size_t end);
+    const Scalar * resolve(size_t slot) const;
+    bool descend(const Span & span, const std::vector<std::string> & segments, Scalar & v) const;
+    void clear();
 };
 
 }
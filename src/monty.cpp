@@ -1,92 +1,298 @@
-#include "ast.h"
-#include "message.h"
+#include "cache.h"
+#include "live_ruleset.h"
 #include "parse_error.h"
-#include "rule.h"
+#include "processor.h"
+#include "ruleset.h"
 
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace Monty;
 using namespace std;
 
-int main(int argc, char ** argv)
+static void usage(const char * name)
+{
+    cerr << "usage: " << name << " [-j threads] [-s socket] [-c cache] [-n] [-t] rule.json [rule.json ...]" << endl
+         << endl
+         << "Evaluates every rule against each newline delimited json message read" << endl
+         << "from stdin, or from each connection to the unix socket with -s, and" << endl
+         << "writes one production per rule per message, in input order.  SIGHUP" << endl
+         << "reloads the rule files without interrupting processing." << endl
+         << endl
+         << "  -j threads  worker threads (default: one per cpu)" << endl
+         << "  -s socket   listen on a unix domain socket instead of reading stdin" << endl
+         << "  -c cache    map compiled rules from cache when it was built from the same" << endl
+         << "              rule files, otherwise compile them and rewrite it" << endl
+         << "  -n          build the rules into native code with $CXX (default: c++)" << endl
+         << "  -t          count node evaluations and time each rule; SIGUSR1 writes the" << endl
+         << "              statistics as json to stderr.  A reload starts them afresh" << endl;
+}
+
+static bool load(vector<string> & rules, const char * path)
+{
+    ifstream in(path);
+
+    if (! in) {
+        cerr << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    ostringstream json;
+    json << in.rdbuf();
+
+    rules.push_back(json.str());
+
+    return true;
+}
+
+// compiled rule cache, if any
+static const char * cache = NULL;
+
+// build rule sets into native code
+static bool native = false;
+
+// collect RuleStats, written out on SIGUSR1
+static bool stats = false;
+
+/* Reads and compiles every rule file, then publishes the result.  A file
+ * that is missing or doesn't parse leaves the current rules in place. */
+static bool reload(LiveRuleSet & live, char ** paths, int n)
 {
-    string sfoo("foo");
-    AST::Value foo(sfoo);
-
-    cout << foo << endl;
-
-    Message msg("{\"foo\" : 10, \"bar\" : \"baz\" }");
-    Message msg2("{\"foo\" : 11, \"bar\" : \"baz\" }");
-
-    cout << msg << endl;
-
-    string srule(
-        "[\"conditional\", {"\
-            "\"condition\" : [\"binary\", {"\
-                "\"type\" : \"EQ\","\
-                "\"left\" : [\"value\", {"\
-                    "\"value\" : 10"\
-                "}],"\
-                "\"right\" : [\"lookup\", {"\
-                    "\"key\" : \"foo\""\
-                "}]"\
-            "}],"\
-            "\"ifTrue\" : [\"production\", {"\
-                "\"service\" : \"bar\","\
-                "\"path\" : ["\
-                    "[\"value\", {"\
-                        "\"value\" : \"baz\""\
-                    "}]"\
-                "],"\
-                "\"params\" : ["\
-                    "["\
-                        "\"val\","
-                        "[\"lookup\", {"\
-                            "\"key\" : \"bar\""\
-                        "}]"\
-                    "]"\
-                "]"\
-            "}],"\
-            "\"ifFalse\" : [\"production\", {"\
-                "\"service\" : \"bar\","\
-                "\"path\" : ["\
-                    "[\"value\", {"\
-                        "\"value\" : \"bop\""\
-                    "}]"\
-                "],"\
-                "\"params\" : []"\
-            "}]"\
-        "}]"\
-    );
-
-    cout << srule << endl;
-
-    Rule rule(srule);
-
-    cout << rule << endl;
-
-    cout << rule.exec(msg) << endl;
-    cout << rule.exec(msg2) << endl;
-
-    string sbrokenrule(
-        "[\"conditional\", {"\
-            "\"condition\" : [\"binary\", {"\
-                "\"type\" : \"EQ\","\
-                "\"left\" : [\"value\", {"\
-                    "\"value\" : 10"\
-                "}],"\
-                "\"right\" : [\"lookup\", {"\
-                    "\"key\" : \"foo\""\
-                "}]"\
-            "}]"\
-        "}]"\
-    );
+    vector<string> rules;
+
+    for (int i = 0; i < n; i++) {
+        if (! load(rules, paths[i])) return false;
+    }
 
     try {
-        Rule brokenrule(sbrokenrule);
-    } catch (ParseError pe) {
-        cout << pe << endl;
+        unique_ptr<RuleSet> set;
+
+        if (cache) {
+            set.reset(RuleCache::open(cache, rules));
+        } else {
+            set.reset(new RuleSet());
+
+            for (vector<string>::const_iterator it = rules.begin(); it != rules.end(); it++) {
+                set->add(*it);
+            }
+        }
+
+        if (native) set->compileNative();
+        if (stats) set->enableStats();
+
+        live.publish(set.release());
+    } catch (const ParseError & pe) {
+        cerr << pe << endl;
+        return false;
+    } catch (const CompileError & ce) {
+        cerr << ce << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/* Handles signals on a thread of its own, so that reloading never runs in a
+ * signal handler.  Every other thread has them blocked.  Returns at the
+ * first signal after stopping is set, which main sends before live goes. */
+static void signals(sigset_t set, LiveRuleSet & live, char ** paths, int n, const atomic<bool> & stopping)
+{
+    for (;;) {
+        int sig;
+
+        if (sigwait(&set, &sig) != 0) continue;
+
+        if (stopping) return;
+
+        if (sig == SIGHUP) {
+            if (reload(live, paths, n)) cerr << "reloaded " << n << " rule files" << endl;
+        } else if (sig == SIGUSR1) {
+            LiveRuleSet::Reader rules(live);
+
+            rules->dumpStats(cerr);
+            cerr << endl;
+        }
+    }
+}
+
+/* The connections being served, by descriptor.  A connection's thread moves
+ * itself to finished when its stream ends, to be joined by the accepting
+ * thread, and closes its descriptor under lock so that one still in running
+ * is always open. */
+struct Connections {
+    mutex lock;
+    condition_variable ended;
+    map<int, thread> running;
+    vector<thread> finished;
+
+    void reap()
+    {
+        vector<thread> done;
+
+        {
+            lock_guard<mutex> guard(lock);
+            done.swap(finished);
+        }
+
+        for (vector<thread>::iterator it = done.begin(); it != done.end(); it++) it->join();
+    }
+
+    // ends every connection and waits for their threads
+    void stop()
+    {
+        {
+            unique_lock<mutex> guard(lock);
+
+            for (map<int, thread>::const_iterator it = running.begin(); it != running.end(); it++) {
+                shutdown(it->first, SHUT_RDWR);
+            }
+
+            ended.wait(guard, [this] { return running.empty(); });
+        }
+
+        reap();
+    }
+};
+
+static int serve(Processor & processor, const char * path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        cerr << path << ": socket path too long" << endl;
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    unlink(path);
+
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 64) < 0) {
+        cerr << path << ": " << strerror(errno) << endl;
+        return 1;
     }
 
-    return 0;
+    Connections connections;
+
+    // each connection gets its own reader and writer; all share the workers
+    for (;;) {
+        int conn = accept(listener, NULL, NULL);
+
+        connections.reap();
+
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+
+            cerr << path << ": " << strerror(errno) << endl;
+            close(listener);
+            connections.stop();
+            return 1;
+        }
+
+        lock_guard<mutex> guard(connections.lock);
+
+        connections.running[conn] = thread([&processor, &connections, conn]() {
+            processor.run(conn, conn);
+
+            lock_guard<mutex> guard(connections.lock);
+            map<int, thread>::iterator self = connections.running.find(conn);
+
+            connections.finished.push_back(move(self->second));
+            connections.running.erase(self);
+            close(conn);
+            connections.ended.notify_all();
+        });
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    size_t threads = 0;
+    const char * socket = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:s:c:nth")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                socket = optarg;
+                break;
+            case 'c':
+                cache = optarg;
+                break;
+            case 'n':
+                native = true;
+                break;
+            case 't':
+                stats = true;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if (optind == argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    LiveRuleSet rules(new RuleSet());
+
+    if (! reload(rules, argv + optind, argc - optind)) return 1;
+
+    // a closed peer shows up as a failed write instead
+    signal(SIGPIPE, SIG_IGN);
+
+    sigset_t handled;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGHUP);
+    sigaddset(&handled, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &handled, NULL);
+
+    atomic<bool> stopping(false);
+    thread signaller(signals, handled, ref(rules), argv + optind, argc - optind, cref(stopping));
+    int status;
+
+    {
+        Processor processor(rules, threads);
+
+        if (socket) {
+            status = serve(processor, socket);
+        } else {
+            status = processor.run(STDIN_FILENO, STDOUT_FILENO) ? 0 : 1;
+        }
+    }
+
+    // the signal thread uses rules, so it is woken to exit first
+    stopping = true;
+    pthread_kill(signaller.native_handle(), SIGHUP);
+    signaller.join();
+
+    return status;
 }
@@ -0,0 +1,545 @@
+#include "native.h"
+#include "ast.h"
+#include "url.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace Monty;
+
+/* Everything the generated code and the host share.  It is compiled here and
+ * pasted as text into every generated source, so the two can't drift apart;
+ * bump abi whenever it changes. */
+#define MONTY_NATIVE_ABI(...) __VA_ARGS__ static const char * abiSource = #__VA_ARGS__;
+
+MONTY_NATIVE_ABI(
+extern "C" {
+
+struct monty_scalar {
+    const char * text;
+    size_t len;
+    int64_t integer;
+    double real;
+    int integral;
+};
+
+struct monty_host {
+    const struct monty_scalar * (* field)(void * ctx, uint32_t i);
+    void (* append)(void * out, const char * s, size_t len);
+    void (* append_encoded)(void * out, const struct monty_scalar * s);
+    uint32_t (* dispatch)(void * ctx, uint32_t i);
+};
+
+}
+)
+
+static const uint32_t abi = 2;
+
+namespace {
+
+/* Shared by every generated source: text comparison with the semantics of
+ * std::string::compare, and the numeric rule of Binary::compare. */
+const char * helpers =
+    "static inline int monty_compare(const char * a, size_t al, const char * b, size_t bl)\n"
+    "{\n"
+    "    int c = memcmp(a, b, al < bl ? al : bl);\n"
+    "    return c ? c : (al < bl ? -1 : al > bl);\n"
+    "}\n"
+    "\n"
+    "#define F(i) (f[i] ? f[i] : (f[i] = host->field(ctx, i)))\n"
+    "#define NUM(op, l, r) ((l)->integral && (r)->integral ? (l)->integer op (r)->integer : (l)->real op (r)->real)\n"
+    "#define TEXT(op, l, r) (monty_compare((l)->text, (l)->len, (r)->text, (r)->len) op 0)\n";
+
+struct Context {
+    const Program * program;
+    const Message * msg;
+    monty_scalar * views;
+};
+
+const monty_scalar * hostField(void * ctx, uint32_t i)
+{
+    Context * c = (Context *)ctx;
+    const Scalar * s = c->program->resolve(*c->msg, i);
+    monty_scalar & v = c->views[i];
+
+    v.text = s->getText().data();
+    v.len = s->getText().size();
+    v.integer = s->getInteger();
+    v.real = s->getDouble();
+    v.integral = s->isIntegral();
+
+    return &v;
+}
+
+void hostAppend(void * out, const char * s, size_t len)
+{
+    ((std::string *)out)->append(s, len);
+}
+
+void hostAppendEncoded(void * out, const monty_scalar * s)
+{
+    Url::encode(s->text, s->len, *(std::string *)out);
+}
+
+// switch tables stay in the host, which answers with the target pc
+uint32_t hostDispatch(void * ctx, uint32_t i)
+{
+    Context * c = (Context *)ctx;
+
+    return c->program->dispatch(i, *c->program->resolve(*c->msg, c->program->switches[i].field));
+}
+
+const monty_host host = { hostField, hostAppend, hostAppendEncoded, hostDispatch };
+
+const char * operators[] = { "==", "!=", "<", "<=", ">", ">=" };
+
+// a C string literal holding s exactly
+std::string quote(const std::string & s)
+{
+    std::string out("\"");
+    char buf[8];
+
+    for (std::string::const_iterator it = s.begin(); it != s.end(); it++) {
+        unsigned char c = *it;
+
+        // octal escapes are at most three digits, so they can't swallow
+        // what follows; ? is escaped to avoid trigraphs
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\' || c == '?') {
+            snprintf(buf, sizeof(buf), "\\%03o", c);
+            out.append(buf);
+        } else {
+            out.push_back(c);
+        }
+    }
+
+    out.push_back('"');
+
+    return out;
+}
+
+std::string integer(int64_t i)
+{
+    std::ostringstream out;
+
+    // INT64_MIN has no literal of its own
+    if (i == INT64_MIN) {
+        out << "(-" << INT64_MAX << "LL - 1)";
+    } else {
+        out << i << "LL";
+    }
+
+    return out.str();
+}
+
+std::string real(double d)
+{
+    if (std::isnan(d)) return "__builtin_nan(\"\")";
+    if (std::isinf(d)) return d < 0 ? "-__builtin_inf()" : "__builtin_inf()";
+
+    char buf[64];
+
+    // hex floats round trip exactly
+    snprintf(buf, sizeof(buf), "%a", d);
+
+    return buf;
+}
+
+/* One side of a comparison: a constant known while generating, or an
+ * expression yielding a monty_scalar pointer at run time. */
+struct Operand {
+    const Scalar * constant;
+    uint32_t index;
+    std::string expression;
+
+    Operand(const Scalar * c, uint32_t index) : constant(c), index(index) { }
+    Operand(const std::string & e) : constant(NULL), index(0), expression(e) { }
+};
+
+/* The C++ for Binary::compare(type, l, r), specialized for constant sides.
+ * Non-constant sides are named l and r. */
+std::string comparison(AST::Binary::Type type, const Operand & l, const Operand & r)
+{
+    std::ostringstream out;
+    const Operand * known = r.constant ? &r : l.constant ? &l : NULL;
+    const Operand * other = known == &r ? &l : &r;
+
+    if (type < AST::Binary::Type::SEQ) {
+        const char * op = operators[type];
+
+        if (! known || other->constant) {
+            out << "NUM(" << op << ", l, r)";
+        } else {
+            const Scalar & c = *known->constant;
+            std::string k = c.isIntegral() ? integer(c.getInteger()) : real(c.getDouble());
+            std::string kr = real(c.getDouble());
+
+            // keep the operands in their original order
+            std::string x = known == &r ? "l" : "r";
+            std::string li = known == &r ? x + "->integer" : k;
+            std::string ri = known == &r ? k : x + "->integer";
+            std::string lr = known == &r ? x + "->real" : kr;
+            std::string rr = known == &r ? kr : x + "->real";
+
+            if (c.isIntegral()) {
+                out << "(" << x << "->integral ? " << li << " " << op << " " << ri << " : " << lr << " " << op << " " << rr << ")";
+            } else {
+                out << "(" << lr << " " << op << " " << rr << ")";
+            }
+        }
+
+        return out.str();
+    }
+
+    const char * op = operators[type - AST::Binary::Type::SEQ];
+
+    if (known && ! other->constant && (type == AST::Binary::Type::SEQ || type == AST::Binary::Type::SNE)) {
+        const std::string & text = known->constant->getText();
+        std::string x = known == &r ? "l" : "r";
+
+        out << (type == AST::Binary::Type::SNE ? "! " : "")
+            << "(" << x << "->len == " << text.size() << "u && memcmp(" << x << "->text, " << quote(text) << ", " << text.size() << ") == 0)";
+    } else {
+        out << "TEXT(" << op << ", l, r)";
+    }
+
+    return out.str();
+}
+
+// how an operand is written once the comparison is known
+std::string bind(const Operand & o, const char * name)
+{
+    if (o.constant) return std::string("const monty_scalar * ") + name + " = &c[" + std::to_string((long long)o.index) + "];";
+
+    return std::string("const monty_scalar * ") + name + " = " + o.expression + ";";
+}
+
+Operand predicateOperand(const Program & program, uint32_t o)
+{
+    if (o & Predicate::FIELD) return Operand("F(" + std::to_string((long long)(o & ~Predicate::FIELD)) + ")");
+
+    return Operand(&program.constants[o], o);
+}
+
+}
+
+std::string Native::generate(const Program & program)
+{
+    std::ostringstream out;
+    const Instruction * code = program.getCode();
+    size_t size = program.numInstructions();
+    size_t fields = program.fields.size();
+    size_t predicates = program.numPredicates();
+
+    out << "// generated by monty from a compiled rule set\n"
+        << "#include <stddef.h>\n"
+        << "#include <stdint.h>\n"
+        << "#include <string.h>\n\n"
+        << abiSource << "\n\n"
+        << helpers << "\n";
+
+    out << "static const monty_scalar c[] = {\n";
+    for (size_t i = 0; i < program.constants.size(); i++) {
+        const Scalar & s = program.constants[i];
+
+        out << "    { " << quote(s.getText()) << ", " << s.getText().size() << "u, " << integer(s.getInteger())
+            << ", " << real(s.getDouble()) << ", " << (s.isIntegral() ? 1 : 0) << " },\n";
+    }
+    out << "    { \"\", 0u, 0LL, 0.0, 1 },\n};\n\n";
+
+    for (size_t i = 0; i < predicates; i++) {
+        const Predicate & p = program.getPredicates()[i];
+        Operand l = predicateOperand(program, p.left);
+        Operand r = predicateOperand(program, p.right);
+
+        out << "static inline int p" << i << "(const monty_host * host, void * ctx, const monty_scalar ** f)\n"
+            << "{\n"
+            << "    (void)host; (void)ctx; (void)f;\n"
+            << "    " << bind(l, "l") << "\n"
+            << "    " << bind(r, "r") << "\n"
+            << "    (void)l; (void)r;\n"
+            << "    return " << comparison((AST::Binary::Type)p.type, l, r) << ";\n"
+            << "}\n\n";
+    }
+
+    // only jump targets get labels
+    std::vector<bool> targets(size, false);
+
+    for (size_t i = 0; i < size; i++) {
+        switch (code[i].op) {
+            case Instruction::JUMP:
+            case Instruction::JUMP_IF_TRUE:
+            case Instruction::JUMP_IF_FALSE:
+                targets[code[i].arg] = true;
+                break;
+            case Instruction::SWITCH: {
+                const Switch & s = program.switches[code[i].arg];
+
+                for (uint32_t j = 0; j < s.count; j++) targets[program.cases[s.first + j].target] = true;
+                targets[s.fallthrough] = true;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // a function per rule keeps each one small enough to optimize quickly
+    for (size_t e = 0; e < program.numEntries(); e++) {
+        size_t begin = program.getEntries()[e];
+        size_t end = e + 1 < program.numEntries() ? program.getEntries()[e + 1] : size;
+
+        // registers holding a known constant, forgotten at every label
+        std::vector<int64_t> known(program.registers + 1, -1);
+
+        out << "// rule " << e << "\n"
+            << "static void r" << e << "(const monty_host * host, void * ctx, const monty_scalar ** f, signed char * p, void * o)\n"
+            << "{\n"
+            << "    const monty_scalar * reg[" << program.registers + 1 << "];\n"
+            << "    const monty_scalar * l;\n"
+            << "    const monty_scalar * r;\n"
+            << "    int flag = 0;\n\n"
+            << "    (void)host; (void)ctx; (void)f; (void)p; (void)o;\n"
+            << "    (void)reg; (void)l; (void)r; (void)flag;\n";
+
+        for (size_t pc = begin; pc < end; pc++) {
+            const Instruction & in = code[pc];
+
+            if (targets[pc]) {
+                out << "L" << pc << ":\n";
+                std::fill(known.begin(), known.end(), -1);
+            }
+
+            switch (in.op) {
+                case Instruction::LOAD_CONST:
+                    out << "    reg[" << (int)in.a << "] = &c[" << in.arg << "];\n";
+                    known[in.a] = in.arg;
+                    break;
+                case Instruction::LOAD_FIELD:
+                    out << "    reg[" << (int)in.a << "] = F(" << in.arg << ");\n";
+                    known[in.a] = -1;
+                    break;
+                case Instruction::COMPARE: {
+                    Operand lo = known[in.b] >= 0 ? Operand(&program.constants[known[in.b]], known[in.b]) : Operand("reg[" + std::to_string((long long)in.b) + "]");
+                    Operand ro = known[in.c] >= 0 ? Operand(&program.constants[known[in.c]], known[in.c]) : Operand("reg[" + std::to_string((long long)in.c) + "]");
+
+                    out << "    l = reg[" << (int)in.b << "];\n"
+                        << "    r = reg[" << (int)in.c << "];\n"
+                        << "    flag = " << comparison((AST::Binary::Type)in.a, lo, ro) << ";\n";
+                    break;
+                }
+                case Instruction::JUMP:
+                    out << "    goto L" << in.arg << ";\n";
+                    break;
+                case Instruction::JUMP_IF_TRUE:
+                    out << "    if (flag) goto L" << in.arg << ";\n";
+                    break;
+                case Instruction::JUMP_IF_FALSE:
+                    out << "    if (! flag) goto L" << in.arg << ";\n";
+                    break;
+                case Instruction::EMIT_CONST:
+                    out << "    host->append(o, c[" << in.arg << "].text, " << program.constants[in.arg].getText().size() << "u);\n";
+                    break;
+                case Instruction::EMIT_FIELD:
+                    out << "    host->append_encoded(o, F(" << in.arg << "));\n";
+                    break;
+                case Instruction::PREDICATE:
+                    out << "    flag = p[" << in.arg << "] >= 0 ? p[" << in.arg << "] : (p[" << in.arg << "] = p" << in.arg << "(host, ctx, f));\n";
+                    break;
+                case Instruction::SWITCH: {
+                    const Switch & s = program.switches[in.arg];
+                    std::set<uint32_t> seen;
+
+                    out << "    switch (host->dispatch(ctx, " << in.arg << "u)) {\n";
+                    for (uint32_t j = 0; j < s.count; j++) {
+                        uint32_t target = program.cases[s.first + j].target;
+
+                        if (seen.insert(target).second) out << "        case " << target << "u: goto L" << target << ";\n";
+                    }
+                    out << "        default: goto L" << s.fallthrough << ";\n"
+                        << "    }\n";
+                    break;
+                }
+                case Instruction::HALT:
+                    out << "    return;\n";
+                    break;
+                default:
+                    assert(0);
+                    break;
+            }
+        }
+
+        out << "}\n\n";
+    }
+
+    out << "typedef void (* monty_rule)(const monty_host *, void *, const monty_scalar **, signed char *, void *);\n\n"
+        << "static const monty_rule rules[] = {\n";
+    for (size_t e = 0; e < program.numEntries(); e++) out << "    r" << e << ",\n";
+    out << "    0\n};\n\n";
+
+    out << "extern \"C\" const uint32_t monty_abi = " << abi << ";\n"
+        << "extern \"C\" const uint32_t monty_entries = " << program.numEntries() << ";\n\n"
+        << "extern \"C\" void monty_exec(const monty_host * host, void * ctx, void * const * out)\n"
+        << "{\n"
+        << "    const monty_scalar * f[" << fields + 1 << "] = { 0 };\n"
+        << "    signed char p[" << predicates + 1 << "];\n\n"
+        << "    memset(p, -1, sizeof(p));\n\n"
+        << "    for (uint32_t i = 0; i < monty_entries; i++) rules[i](host, ctx, f, p, out[i]);\n"
+        << "}\n";
+
+    return out.str();
+}
+
+namespace {
+
+// $CXX split at whitespace, as make would; nothing else in it is interpreted
+std::vector<std::string> words(const std::string & s)
+{
+    std::istringstream in(s);
+    std::vector<std::string> out;
+    std::string word;
+
+    while (in >> word) out.push_back(word);
+
+    return out;
+}
+
+/* Runs argv without a shell, with its stderr written to errors, and returns
+ * whether it exited with status 0.  Between fork and exec the child only
+ * makes async signal safe calls, as other threads may hold locks. */
+bool run(const std::vector<std::string> & argv, const std::string & errors)
+{
+    std::vector<char *> args;
+
+    for (size_t i = 0; i < argv.size(); i++) args.push_back(const_cast<char *>(argv[i].c_str()));
+    args.push_back(NULL);
+
+    pid_t pid = fork();
+
+    if (pid < 0) return false;
+
+    if (pid == 0) {
+        int fd = ::open(errors.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+        if (fd >= 0) dup2(fd, 2);
+
+        execvp(args[0], args.data());
+        _exit(127);
+    }
+
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return false;
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+}
+
+/* The source is written, built and loaded from a private directory, which is
+ * removed again once the object is loaded; the mapping outlives the file. */
+Native::Native(const Program & program) : program(program), handle(NULL), function(NULL), entries(program.numEntries())
+{
+    const char * tmp = getenv("TMPDIR");
+    const char * cxx = getenv("CXX");
+    std::string dir = std::string(tmp && *tmp ? tmp : "/tmp") + "/monty-native-XXXXXX";
+
+    if (! mkdtemp(&dir[0])) throw CompileError("can't create " + dir);
+
+    std::string source = dir + "/rules.cpp";
+    std::string object = dir + "/rules.so";
+    std::string errors = dir + "/errors";
+
+    {
+        std::ofstream file(source.c_str());
+        file << generate(program);
+    }
+
+    std::vector<std::string> argv = words(cxx ? cxx : "");
+    const char * flags[] = { "-O2", "-fPIC", "-shared", "-o" };
+
+    if (argv.empty()) argv.push_back("c++");
+
+    argv.insert(argv.end(), flags, flags + sizeof(flags) / sizeof(flags[0]));
+    argv.push_back(object);
+    argv.push_back(source);
+
+    std::string message;
+
+    if (! run(argv, errors)) {
+        std::ifstream in(errors.c_str());
+        std::ostringstream text;
+
+        for (size_t i = 0; i < argv.size(); i++) text << (i ? " " : "") << argv[i];
+        text << ": " << in.rdbuf();
+        message = text.str();
+    } else if (! (handle = dlopen(object.c_str(), RTLD_NOW | RTLD_LOCAL))) {
+        message = dlerror();
+    } else {
+        const uint32_t * version = (const uint32_t *)dlsym(handle, "monty_abi");
+        const uint32_t * count = (const uint32_t *)dlsym(handle, "monty_entries");
+
+        function = reinterpret_cast<Function>(dlsym(handle, "monty_exec"));
+
+        if (! version || ! count || ! function || *version != abi || *count != entries) {
+            message = object + ": not built from this program";
+        }
+    }
+
+    unlink(source.c_str());
+    unlink(object.c_str());
+    unlink(errors.c_str());
+    rmdir(dir.c_str());
+
+    if (! message.empty()) {
+        if (handle) dlclose(handle);
+        throw CompileError(message);
+    }
+}
+
+Native::~Native()
+{
+    dlclose(handle);
+}
+
+void Native::exec(const Message & msg, std::vector<std::string> & out) const
+{
+    out.resize(entries);
+
+    for (size_t i = 0; i < entries; i++) out[i].clear();
+
+    exec(msg, out.data());
+}
+
+void Native::exec(const Message & msg, std::string * out) const
+{
+    static thread_local std::vector<monty_scalar> views;
+    static thread_local std::vector<void *> outputs;
+
+    if (views.size() < program.fields.size()) views.resize(program.fields.size());
+    if (outputs.size() < entries) outputs.resize(entries);
+
+    for (size_t i = 0; i < entries; i++) outputs[i] = &out[i];
+
+    Context ctx = { &program, &msg, views.data() };
+
+    function(&host, &ctx, outputs.data());
+}
+
+void Native::print(std::ostream & out) const
+{
+    out << "Native(rules=" << entries << ", fields=" << program.fields.size() << ", predicates=" << program.numPredicates() << ")";
+}
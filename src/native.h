@@ -0,0 +1,76 @@
+#ifndef MONTY_NATIVE_H
+#define MONTY_NATIVE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "message.h"
+#include "object.h"
+#include "program.h"
+
+namespace Monty {
+
+class CompileError: public Object
+{
+    std::string str;
+
+public:
+    CompileError(std::string s): str(s) {}
+
+    virtual void print(std::ostream & stream) const {
+        stream << "compileError(" << str << ")";
+    };
+};
+
+/* A Program translated to C++, built into a shared object by the system
+ * compiler and loaded with dlopen.
+ *
+ * Every rule in the program becomes straight line code in a function of its
+ * own: jumps are gotos, comparisons are inlined with their constant operands
+ * folded in, and productions append directly to the output.  Fields and
+ * shared predicates are memoized in arrays the entry point passes to every
+ * rule, so as with a Frame each is evaluated at most once per message across
+ * all the rules.
+ *
+ * The generated code includes no monty headers.  It reaches messages and
+ * output strings through a table of C callbacks, and sees scalars as plain
+ * structs, so it only depends on the layouts declared in native.cpp.
+ *
+ * The program must outlive the Native built from it.  The compiler is $CXX,
+ * split at whitespace and run without a shell, or c++ when that isn't set;
+ * the object is built in $TMPDIR. */
+class Native: public Object {
+    typedef void (* Function)(const void * host, void * ctx, void * const * out);
+
+    const Program & program;
+    void * handle;
+    Function function;
+    size_t entries;
+
+public:
+    // throws CompileError if the source fails to build or load
+    Native(const Program & program);
+    ~Native();
+
+    // the C++ source for program
+    static std::string generate(const Program & program);
+
+    size_t size() const { return entries; }
+
+    /* out is resized to one production per rule, as RuleSet::exec does. */
+    void exec(const Message & msg, std::vector<std::string> & out) const;
+
+    // appends each rule's production to out[i], which must hold size() strings
+    void exec(const Message & msg, std::string * out) const;
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    Native(const Native &);
+    Native & operator=(const Native &);
+};
+
+}
+
+#endif
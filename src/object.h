@@ -8,6 +8,8 @@ namespace Monty {
 class Object {
 
 public:
+    virtual ~Object() {}
+
     virtual void print(std::ostream & stream) const {};
 };
 
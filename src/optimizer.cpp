@@ -0,0 +1,205 @@
+#include "optimizer.h"
+
+using namespace Monty;
+
+static size_t count(AST::Base * root)
+{
+    std::vector<AST::Base *> nodes;
+
+    AST::flatten(root, nodes);
+
+    return nodes.size();
+}
+
+AST::Statement * Optimizer::optimize(AST::Statement * root)
+{
+    AST::Statement * out = statement(root);
+
+    removed += count(root) - count(out);
+
+    return out;
+}
+
+AST::Statement * Optimizer::statement(AST::Statement * s)
+{
+    if (s->kind() != AST::Base::Kind::CONDITIONAL) return s;
+
+    const AST::Conditional * c = static_cast<const AST::Conditional *>(s);
+    AST::Expression * condition = expression(c->getCondition());
+
+    if (condition->kind() == AST::Base::Kind::CONSTANT) {
+        bool value = static_cast<const AST::Constant *>(condition)->getValue();
+
+        return statement(value ? c->getIfTrue() : c->getIfFalse());
+    }
+
+    size_t depth = facts.size();
+
+    assume(condition, true);
+    AST::Statement * ifTrue = statement(c->getIfTrue());
+    facts.resize(depth);
+
+    assume(condition, false);
+    AST::Statement * ifFalse = statement(c->getIfFalse());
+    facts.resize(depth);
+
+    // the condition has no side effects, so it can go when both sides agree
+    if (AST::equal(ifTrue, ifFalse)) return ifTrue;
+
+    if (condition == c->getCondition() && ifTrue == c->getIfTrue() && ifFalse == c->getIfFalse()) return s;
+
+    return arena.make<AST::Conditional>(condition, ifTrue, ifFalse);
+}
+
+AST::Expression * Optimizer::expression(AST::Expression * e)
+{
+    AST::Expression * out;
+
+    switch (e->kind()) {
+        case AST::Base::Kind::BINARY:
+            out = binary(e);
+            break;
+        case AST::Base::Kind::LOGICAL:
+            out = logical(e);
+            break;
+        default:
+            out = e;
+            break;
+    }
+
+    if (out->kind() == AST::Base::Kind::CONSTANT) return out;
+
+    for (std::vector<Fact>::const_iterator it = facts.begin(); it != facts.end(); it++) {
+        if (AST::equal(it->first, out)) return makeConstant(it->second);
+    }
+
+    return out;
+}
+
+AST::Expression * Optimizer::binary(AST::Expression * e)
+{
+    typedef AST::Binary::Type Type;
+
+    const AST::Binary * b = static_cast<const AST::Binary *>(e);
+    const AST::Arg * l = b->getLeft();
+    const AST::Arg * r = b->getRight();
+
+    if (l->kind() == AST::Base::Kind::VALUE && r->kind() == AST::Base::Kind::VALUE) {
+        const Scalar & lv = static_cast<const AST::Value *>(l)->value;
+        const Scalar & rv = static_cast<const AST::Value *>(r)->value;
+
+        return makeConstant(AST::Binary::compare(b->getType(), lv, rv));
+    }
+
+    // a field always equals itself; field values never parse to NaN
+    if (l->kind() == AST::Base::Kind::LOOKUP && AST::equal(l, r)) {
+        switch (b->getType()) {
+            case Type::EQ:
+            case Type::LE:
+            case Type::GE:
+            case Type::SEQ:
+            case Type::SLE:
+            case Type::SGE:
+                return makeConstant(true);
+            default:
+                return makeConstant(false);
+        }
+    }
+
+    return e;
+}
+
+AST::Expression * Optimizer::logical(AST::Expression * e)
+{
+    typedef std::vector<AST::Expression *> ExpressionVector;
+
+    const AST::Logical * l = static_cast<const AST::Logical *>(e);
+    const ExpressionVector & clauses = l->getClauses();
+
+    // the clause value that decides the whole expression
+    bool decisive = l->getType() == AST::Logical::Type::OR;
+    bool changed = false;
+    ExpressionVector pending;
+    ExpressionVector kept;
+
+    for (ExpressionVector::const_reverse_iterator it = clauses.rbegin(); it != clauses.rend(); it++) {
+        pending.push_back(*it);
+    }
+
+    while (pending.size()) {
+        AST::Expression * clause = pending.back();
+        pending.pop_back();
+
+        AST::Expression * optimized = expression(clause);
+
+        if (optimized != clause) changed = true;
+
+        if (optimized->kind() == AST::Base::Kind::CONSTANT) {
+            if (static_cast<const AST::Constant *>(optimized)->getValue() == decisive) {
+                return optimized;
+            }
+
+            changed = true;
+            continue;
+        }
+
+        if (optimized->kind() == AST::Base::Kind::LOGICAL && static_cast<const AST::Logical *>(optimized)->getType() == l->getType()) {
+            const ExpressionVector & inner = static_cast<const AST::Logical *>(optimized)->getClauses();
+
+            for (ExpressionVector::const_reverse_iterator it = inner.rbegin(); it != inner.rend(); it++) {
+                pending.push_back(*it);
+            }
+
+            changed = true;
+            continue;
+        }
+
+        bool duplicate = false;
+
+        for (ExpressionVector::const_iterator it = kept.begin(); it != kept.end(); it++) {
+            if (AST::equal(*it, optimized)) duplicate = true;
+        }
+
+        if (duplicate) {
+            changed = true;
+            continue;
+        }
+
+        kept.push_back(optimized);
+    }
+
+    if (kept.empty()) return makeConstant(! decisive);
+    if (kept.size() == 1) return kept[0];
+    if (! changed) return e;
+
+    return makeLogical(l->getType(), kept);
+}
+
+/* Records the value of expression for the branch about to be optimized.  An
+ * AND known to be true, or an OR known to be false, fixes every clause too. */
+void Optimizer::assume(AST::Expression * e, bool value)
+{
+    facts.push_back(Fact(e, value));
+
+    if (e->kind() != AST::Base::Kind::LOGICAL) return;
+
+    const AST::Logical * l = static_cast<const AST::Logical *>(e);
+
+    if ((l->getType() == AST::Logical::Type::AND) != value) return;
+
+    const std::vector<AST::Expression *> & clauses = l->getClauses();
+
+    for (std::vector<AST::Expression *>::const_iterator it = clauses.begin(); it != clauses.end(); it++) {
+        assume(*it, value);
+    }
+}
+
+AST::Constant * Optimizer::makeConstant(bool value)
+{
+    return pool ? pool->constant(value) : arena.make<AST::Constant>(value);
+}
+
+AST::Logical * Optimizer::makeLogical(AST::Logical::Type type, const std::vector<AST::Expression *> & clauses)
+{
+    return pool ? pool->logical(type, clauses) : arena.make<AST::Logical>(type, clauses);
+}
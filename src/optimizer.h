@@ -0,0 +1,57 @@
+#ifndef MONTY_OPTIMIZER_H
+#define MONTY_OPTIMIZER_H
+
+#include <utility>
+#include <vector>
+
+#include "arena.h"
+#include "ast.h"
+#include "pool.h"
+
+namespace Monty {
+
+/* Rewrites a statement tree produced by Parser::parse into a smaller one that
+ * gives the same production for every message:
+ *
+ *   - Binary nodes comparing two Values, or a Lookup with itself, fold to
+ *     Constants
+ *   - nested Logicals of the same type are flattened, Constant clauses are
+ *     dropped or decide the whole Logical, and repeated clauses are removed
+ *   - Conditionals whose condition is known, either because it folded or
+ *     because an enclosing Conditional already tested it, are replaced by
+ *     the branch taken, as are Conditionals with identical branches
+ *
+ * Unchanged subtrees are reused rather than copied, and new Constants and
+ * Logicals come from the Pool, if one is given. */
+class Optimizer {
+    typedef std::pair<AST::Expression *, bool> Fact;
+
+    Arena & arena;
+    Pool * pool;
+    size_t removed;
+    std::vector<Fact> facts;
+
+public:
+    // new nodes are made in arena, which should be the one holding the input
+    Optimizer(Arena & arena, Pool * pool = NULL) : arena(arena), pool(pool), removed(0) { }
+
+    AST::Statement * optimize(AST::Statement * statement);
+
+    // nodes removed by every call to optimize so far
+    size_t getRemoved() const { return removed; }
+
+private:
+    AST::Statement * statement(AST::Statement * statement);
+    AST::Expression * expression(AST::Expression * expression);
+    AST::Expression * binary(AST::Expression * expression);
+    AST::Expression * logical(AST::Expression * expression);
+
+    void assume(AST::Expression * expression, bool value);
+
+    AST::Constant * makeConstant(bool value);
+    AST::Logical * makeLogical(AST::Logical::Type type, const std::vector<AST::Expression *> & clauses);
+};
+
+}
+
+#endif
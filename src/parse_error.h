@@ -2,7 +2,6 @@
 #define MONTY_PARSEERROR_H
 
 #include "object.h"
-#include <json/json.h>
 #include <string>
 
 namespace Monty {
@@ -9,7 +9,7 @@
 
 using namespace Monty;
 
-Parser::Parser()
+Parser::Parser(Arena & arena, Pool * pool, Interner * interner) : arena(arena), pool(pool), interner(interner ? interner : pool ? &pool->getInterner() : NULL), scanner(NULL)
 {
 }
 
@@ -17,7 +17,7 @@ Parser::~Parser()
 {
 }
 
-typedef AST::Base * (Parser::*lookupFunPtr)(json_object *);
+typedef AST::Base * (Parser::*lookupFunPtr)(bool);
 
 const std::map<std::string, lookupFunPtr> table = {
     {"binary"      , &Parser::parseBinary}      ,
@@ -46,192 +46,437 @@ void Parser::throwError(const char * str)
     throw ParseError(out.str());
 }
 
-AST::Base * Parser::parseObject(json_object * obj)
+// the error for a node attribute that was never given
+void Parser::throwMissing(const char * attribute)
 {
-    if (! obj) throwError("object is null");
+    path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, attribute));
+    throwError("object is null");
+}
+
+JsonScanner::Token Parser::next()
+{
+    JsonScanner::Token token = scanner->next();
+
+    if (token == JsonScanner::Token::ERROR) throwError("invalid json");
+
+    return token;
+}
+
+void Parser::skip(JsonScanner::Token token)
+{
+    if (! scanner->skip(token)) throwError("invalid json");
+}
+
+/* Reads the next member name of the current object into key, returning false
+ * at the end of the object. */
+bool Parser::nextKey()
+{
+    JsonScanner::Token token = next();
+
+    if (token == JsonScanner::Token::OBJECT_END) return false;
+    if (token != JsonScanner::Token::STRING) throwError("invalid json");
+
+    key.assign(text());
+
+    return true;
+}
+
+// the decoded text of the current string, or the text of a number
+const std::string & Parser::text()
+{
+    scratch.clear();
+
+    if (! scanner->escaped()) {
+        scratch.assign(scanner->start(), scanner->length());
+    } else if (! JsonScanner::unescape(scanner->start(), scanner->length(), scratch)) {
+        throwError("invalid json");
+    }
+
+    return scratch;
+}
+
+// the index of the current token in names, or -1 if it isn't one of them
+int Parser::typeIndex(const std::string * names, int count)
+{
+    const std::string & t = text();
 
-    if (! json_object_is_type(obj, json_type_array)) throwError("object isn't an array");
+    for (int i = 0; i < count; i++) {
+        if (names[i] == t) return i;
+    }
 
-    if (json_object_array_length(obj) != 2) throwError("object doesn't have len 2");
+    return -1;
+}
 
-    json_object * jtype = json_object_array_get_idx(obj, 0);
+AST::Base * Parser::parseObject(JsonScanner::Token token)
+{
+    if (token == JsonScanner::Token::NUL || token == JsonScanner::Token::END) throwError("object is null");
 
-    if (! jtype) throwError("No object at index 0 for type");
+    if (token != JsonScanner::Token::ARRAY_BEGIN) {
+        skip(token);
+        throwError("object isn't an array");
+    }
 
-    if (! json_object_is_type(jtype, json_type_string)) throwError("type isn't a string");
+    if (scanner->getDepth() > maxDepth) throwError("object is nested too deeply");
 
-    const char * type = json_object_get_string(jtype);
+    token = next();
 
-    json_object * data = json_object_array_get_idx(obj, 1);
+    if (token == JsonScanner::Token::ARRAY_END) throwError("object doesn't have len 2");
+    if (token != JsonScanner::Token::STRING) throwError("type isn't a string");
 
-    std::map<std::string, lookupFunPtr>::const_iterator it = table.find(type);
+    std::map<std::string, lookupFunPtr>::const_iterator it = table.find(text());
 
     if (it == table.end()) throwError("unknown type");
 
-    path.push_back(ParserNode(ParserNode::Type::CLASS, type));
+    token = next();
+
+    if (token == JsonScanner::Token::ARRAY_END) throwError("object doesn't have len 2");
 
-    AST::Base * out = (this->*(it->second))(data);
+    bool object = token == JsonScanner::Token::OBJECT_BEGIN;
+
+    if (! object) skip(token);
+
+    // the table's own copy of the name outlives the parse
+    path.push_back(ParserNode(ParserNode::Type::CLASS, it->first.c_str()));
+
+    AST::Base * out = (this->*(it->second))(object);
 
     path.pop_back();
 
+    if (next() != JsonScanner::Token::ARRAY_END) throwError("object doesn't have len 2");
+
     return out;
 }
 
-AST::Expression * Parser::parseExpression(json_object * obj)
+AST::Expression * Parser::parseExpression(JsonScanner::Token token)
 {
-    return static_cast<AST::Expression *>(parseObject(obj));
+    AST::Base * b = parseObject(token);
+
+    switch (b->kind()) {
+        case AST::Base::Kind::BINARY:
+        case AST::Base::Kind::LOGICAL:
+        case AST::Base::Kind::CONSTANT:
+            return static_cast<AST::Expression *>(b);
+        default:
+            throwError("object isn't an expression");
+    }
+
+    return NULL;
 }
 
-AST::Arg * Parser::parseArg(json_object * obj)
+AST::Arg * Parser::parseArg(JsonScanner::Token token)
 {
-    return static_cast<AST::Arg *>(parseObject(obj));
+    AST::Base * b = parseObject(token);
+
+    switch (b->kind()) {
+        case AST::Base::Kind::VALUE:
+        case AST::Base::Kind::LOOKUP:
+            return static_cast<AST::Arg *>(b);
+        default:
+            throwError("object isn't an arg");
+    }
+
+    return NULL;
 }
 
-AST::Statement * Parser::parseStatement(json_object * obj)
+AST::Statement * Parser::parseStatement(JsonScanner::Token token)
 {
-    return static_cast<AST::Statement *>(parseObject(obj));
+    AST::Base * b = parseObject(token);
+
+    switch (b->kind()) {
+        case AST::Base::Kind::CONDITIONAL:
+        case AST::Base::Kind::PRODUCTION:
+            return static_cast<AST::Statement *>(b);
+        default:
+            throwError("object isn't a statement");
+    }
+
+    return NULL;
 }
 
-AST::Base * Parser::parseValue(json_object * ctx)
+AST::Base * Parser::parseValue(bool object)
 {
-    json_object * jval = json_object_object_get(ctx, "value");
+    // numbers are parsed here, once, rather than on every evaluation
+    Scalar value;
+    bool found = false;
 
-    if (! jval) throwError("value");
+    while (object && nextKey()) {
+        JsonScanner::Token token = next();
 
-    return new AST::Value(json_object_get_string(jval));
-}
+        if (key != "value") {
+            skip(token);
+            continue;
+        }
 
-AST::Base * Parser::parseLookup(json_object * ctx)
-{
-    json_object * jkey = json_object_object_get(ctx, "key");
+        found = true;
+
+        switch (token) {
+            case JsonScanner::Token::STRING: {
+                const std::string & t = text();
+
+                value.setString(t.data(), t.size());
+                break;
+            }
+            case JsonScanner::Token::NUMBER:
+                value.setNumber(scanner->start(), scanner->length());
+                break;
+            case JsonScanner::Token::TRUE:
+            case JsonScanner::Token::FALSE:
+                value.setBoolean(token == JsonScanner::Token::TRUE);
+                break;
+            default:
+                throwError("value");
+        }
+    }
+
+    if (! found) throwError("value");
 
-    if (! jkey) throwError("key");
+    if (interner) value.intern(*interner);
 
-    return new AST::Lookup(json_object_get_string(jkey));
+    return pool ? pool->value(value) : arena.make<AST::Value>(value);
 }
 
-AST::Base * Parser::parseBinary(json_object * ctx)
+AST::Base * Parser::parseLookup(bool object)
 {
-    json_object * jtype = json_object_object_get(ctx, "type");
+    bool found = false;
+    std::string lookup;
 
-    if (! jtype ) throwError("type");
+    while (object && nextKey()) {
+        JsonScanner::Token token = next();
 
-    const char * type = json_object_get_string(jtype);
+        if (key != "key") {
+            skip(token);
+            continue;
+        }
 
-    if (! type) throwError("type");
+        switch (token) {
+            case JsonScanner::Token::STRING:
+            case JsonScanner::Token::NUMBER:
+            case JsonScanner::Token::TRUE:
+            case JsonScanner::Token::FALSE:
+                lookup = text();
+                found = true;
+                break;
+            default:
+                throwError("key");
+        }
+    }
 
-    int ctype = -1;
+    if (! found) throwError("key");
+
+    return pool ? pool->lookup(lookup) : arena.make<AST::Lookup>(lookup);
+}
 
-    for (int i = 0; i < AST::Binary::Type::NUM_ITEMS; i++) {
-        if (AST::BinaryType::names[i].compare(type) == 0) {
-            ctype = i;
-            break;
+AST::Base * Parser::parseBinary(bool object)
+{
+    int ctype = -1;
+    bool typed = false;
+    AST::Arg * left = NULL;
+    AST::Arg * right = NULL;
+
+    while (object && nextKey()) {
+        JsonScanner::Token token = next();
+
+        if (key == "type") {
+            typed = true;
+            ctype = token == JsonScanner::Token::STRING ? typeIndex(AST::BinaryType::names, AST::Binary::Type::NUM_ITEMS) : -1;
+            skip(token);
+        } else if (key == "left") {
+            path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "left"));
+            left = parseArg(token);
+            path.pop_back();
+        } else if (key == "right") {
+            path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "right"));
+            right = parseArg(token);
+            path.pop_back();
+        } else {
+            skip(token);
         }
     }
 
-    if (ctype == -1) throwError("type");
-
-    path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "left"));
-    std::shared_ptr<AST::Arg> left(parseArg(json_object_object_get(ctx, "left")));
-    if (! left) throwError("left");
-    path.pop_back();
+    if (! typed || ctype == -1) throwError("type");
+    if (! left) throwMissing("left");
+    if (! right) throwMissing("right");
 
-    path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "right"));
-    std::shared_ptr<AST::Arg> right(parseArg(json_object_object_get(ctx, "right")));
-    if (! right) throwError("right");
-    path.pop_back();
+    AST::Binary::Type type = (enum Monty::AST::Binary::Type)ctype;
 
-    return new AST::Binary((enum Monty::AST::Binary::Type)ctype, left, right);
+    return pool ? pool->binary(type, left, right) : arena.make<AST::Binary>(type, left, right);
 }
 
-AST::Base * Parser::parseLogical(json_object * ctx)
+AST::Base * Parser::parseLogical(bool object)
 {
-    throwError();
+    int ctype = -1;
+    bool typed = false;
+    bool found = false;
+    std::vector<AST::Expression *> clauses;
 
-    return NULL;
-}
+    while (object && nextKey()) {
+        JsonScanner::Token token = next();
 
-AST::Base * Parser::parseConditional(json_object * ctx)
-{
-    path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "condition"));
-    std::shared_ptr<AST::Expression> condition(parseExpression(json_object_object_get(ctx, "condition")));
-    if (! condition) throwError("condition");
-    path.pop_back();
+        if (key == "type") {
+            typed = true;
+            ctype = token == JsonScanner::Token::STRING ? typeIndex(AST::LogicalType::names, AST::Logical::Type::NUM_ITEMS) : -1;
+            skip(token);
+        } else if (key == "clauses") {
+            if (token == JsonScanner::Token::NUL) continue;
 
-    path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "ifTrue"));
-    std::shared_ptr<AST::Statement> ifTrue(parseStatement(json_object_object_get(ctx, "ifTrue")));
-    if (! ifTrue) throwError("ifTrue");
-    path.pop_back();
+            found = true;
 
-    path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "ifFalse"));
-    std::shared_ptr<AST::Statement> ifFalse(parseStatement(json_object_object_get(ctx, "ifFalse")));
-    if (! ifFalse) throwError("ifFalse");
-    path.pop_back();
+            if (token != JsonScanner::Token::ARRAY_BEGIN) throwError("clauses isn't an array");
 
-    return new AST::Conditional(condition, ifTrue, ifFalse);
+            clauses.clear();
 
-}
+            path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "clauses"));
+            for (int i = 0; (token = next()) != JsonScanner::Token::ARRAY_END; i++) {
+                path.push_back(ParserNode(ParserNode::Type::ARRAY, i));
+                clauses.push_back(parseExpression(token));
+                path.pop_back();
+            }
+            path.pop_back();
 
-AST::Base * Parser::parseProduction(json_object * ctx)
-{
-    json_object * jservice = json_object_object_get(ctx, "service");
-    json_object * jparams = json_object_object_get(ctx, "params");
-    json_object * jpath = json_object_object_get(ctx, "path");
+            if (clauses.empty()) throwError("clauses is empty");
+        } else {
+            skip(token);
+        }
+    }
+
+    if (! typed) throwError("type");
+    if (! found) throwError("no clauses");
+    if (ctype == -1) throwError("type");
 
-    if (! jservice) throwError("no service");
-    if (! jparams) throwError("no params");
-    if (! jpath) throwError("no path");
+    AST::Logical::Type type = (enum Monty::AST::Logical::Type)ctype;
 
-    if (! json_object_is_type(jservice, json_type_string)) throwError("service isn't a string");
-    if (! json_object_is_type(jparams, json_type_array)) throwError("params isn't an array");
-    if (! json_object_is_type(jpath, json_type_array)) throwError("path isn't an array");
+    return pool ? pool->logical(type, clauses) : arena.make<AST::Logical>(type, clauses);
+}
+
+AST::Base * Parser::parseConditional(bool object)
+{
+    AST::Expression * condition = NULL;
+    AST::Statement * ifTrue = NULL;
+    AST::Statement * ifFalse = NULL;
+
+    while (object && nextKey()) {
+        JsonScanner::Token token = next();
+
+        if (key == "condition") {
+            path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "condition"));
+            condition = parseExpression(token);
+            path.pop_back();
+        } else if (key == "ifTrue") {
+            path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "ifTrue"));
+            ifTrue = parseStatement(token);
+            path.pop_back();
+        } else if (key == "ifFalse") {
+            path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "ifFalse"));
+            ifFalse = parseStatement(token);
+            path.pop_back();
+        } else {
+            skip(token);
+        }
+    }
 
-    std::string service(json_object_get_string(jservice));
+    if (! condition) throwMissing("condition");
+    if (! ifTrue) throwMissing("ifTrue");
+    if (! ifFalse) throwMissing("ifFalse");
 
-    std::vector<std::shared_ptr<AST::Arg>> apath;
+    return arena.make<AST::Conditional>(condition, ifTrue, ifFalse);
+}
 
-    path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "path"));
-    for (int i = 0; i < json_object_array_length(jpath); i++) {
-        path.push_back(ParserNode(ParserNode::Type::ARRAY, i));
-        std::shared_ptr<AST::Arg> arg(parseArg(json_object_array_get_idx(jpath, i)));
-        path.pop_back();
-        apath.push_back(arg);
+AST::Base * Parser::parseProduction(bool object)
+{
+    JsonScanner::Token serviceToken = JsonScanner::Token::NUL;
+    JsonScanner::Token paramsToken = JsonScanner::Token::NUL;
+    JsonScanner::Token pathToken = JsonScanner::Token::NUL;
+    std::string service;
+    std::vector<AST::Arg *> apath;
+    std::vector<std::pair<std::string, AST::Arg *> > params;
+
+    // type errors wait until every member has been seen, so that a missing
+    // member is reported first
+    while (object && nextKey()) {
+        JsonScanner::Token token = next();
+
+        if (key == "service") {
+            serviceToken = token;
+
+            if (token == JsonScanner::Token::STRING) service = text();
+            skip(token);
+        } else if (key == "path" && token == JsonScanner::Token::ARRAY_BEGIN) {
+            pathToken = token;
+            apath.clear();
+
+            path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "path"));
+            for (int i = 0; (token = next()) != JsonScanner::Token::ARRAY_END; i++) {
+                path.push_back(ParserNode(ParserNode::Type::ARRAY, i));
+                apath.push_back(parseArg(token));
+                path.pop_back();
+            }
+            path.pop_back();
+        } else if (key == "params" && token == JsonScanner::Token::ARRAY_BEGIN) {
+            paramsToken = token;
+            params.clear();
+
+            path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "params"));
+            for (int i = 0; (token = next()) != JsonScanner::Token::ARRAY_END; i++) {
+                path.push_back(ParserNode(ParserNode::Type::ARRAY, i));
+
+                if (token == JsonScanner::Token::NUL) throwError("no item at index");
+                if (token != JsonScanner::Token::ARRAY_BEGIN) throwError("isn't array");
+
+                token = next();
+
+                if (token == JsonScanner::Token::ARRAY_END) throwError("isn't array len 2");
+                if (token != JsonScanner::Token::STRING) throwError("param keys must be strings");
+
+                std::string name(text());
+
+                token = next();
+
+                if (token == JsonScanner::Token::ARRAY_END) throwError("isn't array len 2");
+
+                AST::Arg * arg = parseArg(token);
+
+                if (next() != JsonScanner::Token::ARRAY_END) throwError("isn't array len 2");
+
+                params.push_back(std::make_pair(name, arg));
+                path.pop_back();
+            }
+            path.pop_back();
+        } else {
+            if (key == "path") pathToken = token;
+            if (key == "params") paramsToken = token;
+            skip(token);
+        }
     }
-    path.pop_back();
 
-    std::vector<std::pair<std::string, std::shared_ptr<AST::Arg>> > params;
+    if (serviceToken == JsonScanner::Token::NUL) throwError("no service");
+    if (paramsToken == JsonScanner::Token::NUL) throwError("no params");
+    if (pathToken == JsonScanner::Token::NUL) throwError("no path");
 
-    path.push_back(ParserNode(ParserNode::Type::ATTRIBUTE, "params"));
-    for (int i = 0; i < json_object_array_length(jparams); i++) {
-        path.push_back(ParserNode(ParserNode::Type::ARRAY, i));
-        json_object * jitem = json_object_array_get_idx(jparams, i);
+    if (serviceToken != JsonScanner::Token::STRING) throwError("service isn't a string");
+    if (paramsToken != JsonScanner::Token::ARRAY_BEGIN) throwError("params isn't an array");
+    if (pathToken != JsonScanner::Token::ARRAY_BEGIN) throwError("path isn't an array");
 
-        if (! jitem) throwError("no item at index");
-        if (! json_object_is_type(jitem, json_type_array)) throwError("isn't array");
-        if (json_object_array_length(jitem) != 2) throwError("isn't array len 2");
+    return arena.make<AST::Production>(service, apath, params);
+}
 
-        json_object * jkey = json_object_array_get_idx(jitem, 0);
-        json_object * jval = json_object_array_get_idx(jitem, 1);
+AST::Base * Parser::parse(const char * json, size_t len)
+{
+    JsonScanner s(json, len);
 
-        if (! json_object_is_type(jkey, json_type_string)) throwError("param keys must be strings");
+    scanner = &s;
+    path.clear();
 
-        std::string key(json_object_get_string(jkey));
+    AST::Base * out = parseObject(next());
 
-        std::shared_ptr<AST::Arg> arg(parseArg(jval));
+    // the scanner calls anything after the value an error
+    if (scanner->next() != JsonScanner::Token::END) throwError("trailing data");
 
-        params.push_back(std::make_pair(key, arg));
-        path.pop_back();
-    }
-    path.pop_back();
+    scanner = NULL;
 
-    return new AST::Production(service, apath, params);
+    return out;
 }
 
 AST::Base * Parser::parse(const std::string & json)
 {
-    json_object * root = json_tokener_parse(json.c_str());
-    std::shared_ptr<json_object> root_holder(root, std::ptr_fun(&json_object_put));
-
-    return parseObject(root);
+    return parse(json.data(), json.size());
 }
-
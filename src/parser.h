@@ -1,9 +1,12 @@
 #ifndef MONTY_PARSER_H
 #define MONTY_PARSER_H
 
+#include <string>
 #include <vector>
-#include <json/json.h>
+#include "arena.h"
 #include "ast.h"
+#include "json_scanner.h"
+#include "pool.h"
 #include <iostream>
 
 namespace Monty {
@@ -22,8 +25,8 @@ private:
     int index;
 
 public:
-    ParserNode(ParserNode::Type t, const char * s) : type(t), str(s) {}
-    ParserNode(ParserNode::Type t, int i) : type(t), index(i) {}
+    ParserNode(ParserNode::Type t, const char * s) : type(t), str(s), index(0) {}
+    ParserNode(ParserNode::Type t, int i) : type(t), str(NULL), index(i) {}
 
     virtual void print(std::ostream & out) const
     {
@@ -41,28 +44,62 @@ public:
     }
 };
 
+/* Builds statement trees from their json form.  Every node is made in the
+ * arena passed in, which owns them from then on.
+ *
+ * The json is read in a single pass with a JsonScanner, making each node as
+ * soon as its last member has been read, so no document tree is built.
+ * Members may come in any order and unknown ones are skipped.  Errors are
+ * thrown as ParseError with the path to where they were found.
+ *
+ * Given a Pool, Args and Expressions are made by it instead, so they are
+ * shared with every other tree parsed through the pool.  Constants are
+ * interned in the interner given, or else the pool's, if either. */
 class Parser {
+    Arena & arena;
+    Pool * pool;
+    Interner * interner;
     std::vector<ParserNode> path;
+    JsonScanner * scanner;
+    std::string key;
+    std::string scratch;
 
 public:
-    Parser();
+    // the deepest json nesting accepted; the parser recurses once per level
+    static const int maxDepth = 1024;
+
+    Parser(Arena & arena, Pool * pool = NULL, Interner * interner = NULL);
     ~Parser();
 
     AST::Base * parse(const std::string & json);
-    AST::Base * parseValue(json_object * ctx);
-    AST::Base * parseLookup(json_object * ctx);
-    AST::Base * parseBinary(json_object * ctx);
-    AST::Base * parseLogical(json_object * ctx);
-    AST::Base * parseConditional(json_object * ctx);
-    AST::Base * parseProduction(json_object * ctx);
-    AST::Base * parseObject(json_object * obj);
-    AST::Expression * parseExpression(json_object * obj);
-    AST::Arg * parseArg(json_object * obj);
-    AST::Statement * parseStatement(json_object * obj);
+    AST::Base * parse(const char * json, size_t len);
+
+    /* Each of these reads the members of the object that follows a node's
+     * type; object is false if something other than an object followed,
+     * which has been skipped. */
+    AST::Base * parseValue(bool object);
+    AST::Base * parseLookup(bool object);
+    AST::Base * parseBinary(bool object);
+    AST::Base * parseLogical(bool object);
+    AST::Base * parseConditional(bool object);
+    AST::Base * parseProduction(bool object);
 
 private:
+    // each takes the first token of the node
+    AST::Base * parseObject(JsonScanner::Token token);
+    AST::Expression * parseExpression(JsonScanner::Token token);
+    AST::Arg * parseArg(JsonScanner::Token token);
+    AST::Statement * parseStatement(JsonScanner::Token token);
+
+    JsonScanner::Token next();
+    bool nextKey();
+    void skip(JsonScanner::Token token);
+    const std::string & text();
+    int typeIndex(const std::string * names, int count);
+
     void throwError();
     void throwError(const char * str);
+    void throwMissing(const char * attribute);
 };
 
 }
@@ -0,0 +1,131 @@
+#include "pool.h"
+
+#include <cstring>
+
+using namespace Monty;
+
+Pool::Pool()
+{
+    memset(&metrics, 0, sizeof(metrics));
+}
+
+AST::Value * Pool::value(const Scalar & value)
+{
+    begin(AST::Base::Kind::VALUE, value.getType());
+    key.append(value.getText());
+
+    if (AST::Base * found = find(sizeof(AST::Value) + value.getText().size())) return static_cast<AST::Value *>(found);
+
+    return static_cast<AST::Value *>(add(arena.make<AST::Value>(value)));
+}
+
+AST::Lookup * Pool::lookup(const std::string & name)
+{
+    begin(AST::Base::Kind::LOOKUP, 0);
+    key.append(name);
+
+    if (AST::Base * found = find(sizeof(AST::Lookup) + name.size())) return static_cast<AST::Lookup *>(found);
+
+    AST::Lookup * made = arena.make<AST::Lookup>(name);
+    lookups.push_back(made);
+
+    return static_cast<AST::Lookup *>(add(made));
+}
+
+AST::Binary * Pool::binary(AST::Binary::Type type, AST::Arg * left, AST::Arg * right)
+{
+    begin(AST::Base::Kind::BINARY, type);
+    child(left);
+    child(right);
+
+    if (AST::Base * found = find(sizeof(AST::Binary))) return static_cast<AST::Binary *>(found);
+
+    return static_cast<AST::Binary *>(add(arena.make<AST::Binary>(type, left, right)));
+}
+
+AST::Logical * Pool::logical(AST::Logical::Type type, const std::vector<AST::Expression *> & clauses)
+{
+    begin(AST::Base::Kind::LOGICAL, type);
+
+    for (std::vector<AST::Expression *>::const_iterator it = clauses.begin(); it != clauses.end(); it++) {
+        child(*it);
+    }
+
+    // the clause list and the per clause statistics come with each copy
+    size_t size = sizeof(AST::Logical) + clauses.size() * (sizeof(AST::Expression *) + 3 * sizeof(uint64_t));
+
+    if (AST::Base * found = find(size)) return static_cast<AST::Logical *>(found);
+
+    return static_cast<AST::Logical *>(add(arena.make<AST::Logical>(type, clauses)));
+}
+
+AST::Constant * Pool::constant(bool value)
+{
+    begin(AST::Base::Kind::CONSTANT, value);
+
+    if (AST::Base * found = find(sizeof(AST::Constant))) return static_cast<AST::Constant *>(found);
+
+    return static_cast<AST::Constant *>(add(arena.make<AST::Constant>(value)));
+}
+
+void Pool::begin(AST::Base::Kind kind, int type)
+{
+    key.clear();
+    key.push_back((char)kind);
+    key.push_back((char)type);
+}
+
+void Pool::child(const AST::Base * node)
+{
+    key.append((const char *)&node, sizeof(node));
+}
+
+// the node for key, if there is one, counted as saving size bytes
+AST::Base * Pool::find(size_t size)
+{
+    std::unordered_map<std::string, AST::Base *>::const_iterator it = nodes.find(key);
+
+    metrics.requested++;
+
+    if (it == nodes.end()) return NULL;
+
+    metrics.saved += size;
+    share(it->second);
+
+    return it->second;
+}
+
+void Pool::share(AST::Base * node)
+{
+    AST::Base::Kind k = node->kind();
+
+    // constants cost nothing to evaluate
+    if (k != AST::Base::Kind::BINARY && k != AST::Base::Kind::LOGICAL) return;
+
+    AST::Expression * e = static_cast<AST::Expression *>(node);
+
+    if (e->shared == AST::Expression::unshared) e->shared = metrics.shared++;
+}
+
+AST::Base * Pool::add(AST::Base * node)
+{
+    nodes.insert(std::make_pair(key, node));
+    metrics.distinct++;
+
+    return node;
+}
+
+void Pool::bind(const Schema & schema)
+{
+    for (std::vector<AST::Lookup *>::const_iterator it = lookups.begin(); it != lookups.end(); it++) {
+        (*it)->bind(schema);
+    }
+}
+
+void Pool::print(std::ostream & out) const
+{
+    out << "Pool(requested=" << metrics.requested
+        << ", distinct=" << metrics.distinct
+        << ", shared=" << metrics.shared
+        << ", saved=" << metrics.saved << ")";
+}
@@ -0,0 +1,88 @@
+#ifndef MONTY_POOL_H
+#define MONTY_POOL_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "arena.h"
+#include "ast.h"
+#include "interner.h"
+#include "object.h"
+#include "schema.h"
+
+namespace Monty {
+
+/* Hash-conses Args and Expressions: asked for a node structurally identical
+ * to one it already made, it hands back that node, so rules parsed through
+ * the same pool share their common subtrees.  Nodes are made bottom up, so
+ * children are already canonical and a node is keyed by its type, its text
+ * and the addresses of its children.  Every node lives in the pool's arena
+ * and is destroyed with it.
+ *
+ * An Expression handed out more than once is given a Memo slot, so that
+ * evaluating with a Memo computes it once per message however many rules
+ * use it.
+ *
+ * Shared Lookups are bound to whatever schema bound them last; see bind().
+ * The constants of every rule parsed through the pool are interned in its
+ * interner, which lives as long as the pool.  A pool is filled while rules
+ * are added, from one thread. */
+class Pool: public Object {
+public:
+    struct Metrics {
+        // nodes asked for, and how many of those were new
+        uint64_t requested;
+        uint64_t distinct;
+        // bytes the nodes handed out again would have taken
+        uint64_t saved;
+        uint64_t shared;
+
+        double dedupRatio() const { return distinct ? (double)requested / distinct : 0; }
+    };
+
+private:
+    Interner interner;
+    Arena arena;
+    std::unordered_map<std::string, AST::Base *> nodes;
+    std::vector<AST::Lookup *> lookups;
+    std::string key;
+    Metrics metrics;
+
+public:
+    Pool();
+
+    AST::Value * value(const Scalar & value);
+    AST::Lookup * lookup(const std::string & name);
+    AST::Binary * binary(AST::Binary::Type type, AST::Arg * left, AST::Arg * right);
+    AST::Logical * logical(AST::Logical::Type type, const std::vector<AST::Expression *> & clauses);
+    AST::Constant * constant(bool value);
+
+    Interner & getInterner() { return interner; }
+    const Interner & getInterner() const { return interner; }
+
+    // Memo slots handed out; a Memo needs this many
+    size_t numShared() const { return metrics.shared; }
+
+    const Metrics & getMetrics() const { return metrics; }
+
+    // binds every Lookup in the pool to schema
+    void bind(const Schema & schema);
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    void begin(AST::Base::Kind kind, int type);
+    void child(const AST::Base * node);
+    AST::Base * find(size_t size);
+    void share(AST::Base * node);
+    AST::Base * add(AST::Base * node);
+
+    Pool(const Pool &);
+    Pool & operator=(const Pool &);
+};
+
+}
+
+#endif
@@ -0,0 +1,235 @@
+#include "processor.h"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+using namespace Monty;
+
+// bytes read per call, and so the most a chunk holds beyond one long line
+static const size_t readSize = 64 * 1024;
+
+// chunks a stream may have in flight per worker
+static const size_t slotsPerThread = 4;
+
+Processor::Processor(const LiveRuleSet & rules, size_t threads) : rules(rules), stopping(false)
+{
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+
+    for (size_t i = 0; i < threads; i++) {
+        workers.push_back(std::thread(&Processor::work, this));
+    }
+}
+
+Processor::~Processor()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+
+    available.notify_all();
+
+    for (std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); it++) {
+        it->join();
+    }
+}
+
+void Processor::work()
+{
+    for (;;) {
+        Job job;
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+
+            while (jobs.empty() && ! stopping) available.wait(guard);
+
+            if (jobs.empty()) return;
+
+            job = jobs.front();
+            jobs.pop_front();
+        }
+
+        Stream * stream = job.first;
+        Chunk & chunk = stream->slots[job.second % stream->slots.size()];
+
+        // the slot is this worker's alone until ready is set
+        evaluate(chunk);
+
+        // notified under the lock: once the writer sees the last chunk ready
+        // the stream may be destroyed
+        std::lock_guard<std::mutex> guard(stream->lock);
+        chunk.ready = true;
+        stream->changed.notify_all();
+    }
+}
+
+void Processor::evaluate(Chunk & chunk)
+{
+    static thread_local Frame frame;
+    static thread_local std::vector<std::string> productions;
+    static thread_local Message msg;
+
+    LiveRuleSet::Reader set(rules);
+    const char * p = chunk.input.data();
+    const char * end = p + chunk.input.size();
+
+    chunk.output.clear();
+
+    while (p < end) {
+        const char * eol = (const char *)memchr(p, '\n', end - p);
+        const char * next = eol ? eol + 1 : end;
+
+        if (! eol) eol = end;
+        if (eol > p && eol[-1] == '\r') eol--;
+
+        const char * q = p;
+        while (q < eol && (*q == ' ' || *q == '\t')) q++;
+
+        if (q < eol) {
+            msg.reset(q, eol - q, set->getSchema());
+
+            set->exec(msg, productions, frame);
+
+            for (std::vector<std::string>::const_iterator it = productions.begin(); it != productions.end(); it++) {
+                chunk.output.append(*it);
+                chunk.output.push_back('\n');
+            }
+        }
+
+        p = next;
+    }
+}
+
+void Processor::submit(Stream * stream, std::string & input)
+{
+    uint64_t seq;
+
+    {
+        std::unique_lock<std::mutex> guard(stream->lock);
+
+        while (stream->submitted - stream->written == stream->slots.size()) stream->changed.wait(guard);
+
+        seq = stream->submitted++;
+    }
+
+    // the writer doesn't touch a slot until it is ready, so no lock is needed
+    stream->slots[seq % stream->slots.size()].input.swap(input);
+    input.clear();
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.push_back(Job(stream, seq));
+    }
+
+    available.notify_one();
+}
+
+/* Writes chunks out in sequence order as they become ready.  After a write
+ * error chunks are still drained, so the reader and workers never block on
+ * a slot that won't be freed. */
+void Processor::write(Stream * stream, int out)
+{
+    std::string buffer;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(stream->lock);
+            Chunk * chunk = &stream->slots[stream->written % stream->slots.size()];
+
+            while (! chunk->ready && ! (stream->done && stream->written == stream->submitted)) {
+                stream->changed.wait(guard);
+                chunk = &stream->slots[stream->written % stream->slots.size()];
+            }
+
+            if (! chunk->ready) return;
+
+            buffer.swap(chunk->output);
+            chunk->ready = false;
+            stream->written++;
+        }
+
+        stream->changed.notify_all();
+
+        const char * p = buffer.data();
+        size_t left = buffer.size();
+
+        while (left && ! stream->failed) {
+            ssize_t n = ::write(out, p, left);
+
+            if (n < 0 && errno == EINTR) continue;
+
+            if (n <= 0) {
+                std::lock_guard<std::mutex> guard(stream->lock);
+                stream->failed = true;
+                break;
+            }
+
+            p += n;
+            left -= n;
+        }
+    }
+}
+
+bool Processor::run(int in, int out)
+{
+    Stream stream(workers.size() * slotsPerThread);
+    std::thread writer(&Processor::write, this, &stream, out);
+    std::string pending;
+    std::string input;
+    bool ok = true;
+
+    for (;;) {
+        size_t have = pending.size();
+
+        pending.resize(have + readSize);
+
+        ssize_t n = ::read(in, &pending[have], readSize);
+
+        if (n < 0 && errno == EINTR) {
+            pending.resize(have);
+            continue;
+        }
+
+        if (n <= 0) {
+            pending.resize(have);
+            ok = n == 0;
+            break;
+        }
+
+        pending.resize(have + n);
+
+        // hand off everything up to the last newline; the rest waits for
+        // the line to be finished
+        size_t last = pending.rfind('\n', pending.size() - 1);
+
+        if (last == std::string::npos) continue;
+
+        input.assign(pending, 0, last + 1);
+        pending.erase(0, last + 1);
+
+        submit(&stream, input);
+
+        std::lock_guard<std::mutex> guard(stream.lock);
+        if (stream.failed) break;
+    }
+
+    if (pending.size()) submit(&stream, pending);
+
+    {
+        std::lock_guard<std::mutex> guard(stream.lock);
+        stream.done = true;
+    }
+
+    stream.changed.notify_all();
+    writer.join();
+
+    return ok && ! stream.failed;
+}
+
+void Processor::print(std::ostream & out) const
+{
+    out << "Processor(threads=" << workers.size() << ", " << rules << ")";
+}
@@ -0,0 +1,87 @@
+#ifndef MONTY_PROCESSOR_H
+#define MONTY_PROCESSOR_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "live_ruleset.h"
+#include "object.h"
+
+namespace Monty {
+
+/* Runs the rules of a LiveRuleSet over streams of newline delimited json
+ * messages on a pool of worker threads.  For every message, each rule's
+ * production is written on a line of its own, in rule order; blank input
+ * lines produce nothing.
+ *
+ * Input is cut into chunks of whole lines as it is read, and each chunk gets
+ * a sequence number.  Workers evaluate chunks in any order; a ring of slots
+ * indexed by sequence number holds finished chunks until every earlier one
+ * has been written, so output is always in input order.  The ring also
+ * bounds how far the reader may get ahead of the writer.
+ *
+ * Several streams may be run at once, from different threads, and share
+ * the workers.  Each chunk is evaluated entirely against whichever rule set
+ * was published when it was picked up, so a reload takes effect between
+ * chunks. */
+class Processor: public Object {
+    struct Chunk {
+        std::string input;
+        std::string output;
+        bool ready;
+
+        Chunk() : ready(false) { }
+    };
+
+    struct Stream {
+        std::mutex lock;
+        std::condition_variable changed;
+        std::vector<Chunk> slots;
+        uint64_t submitted;
+        uint64_t written;
+        bool done;
+        bool failed;
+
+        Stream(size_t n) : slots(n), submitted(0), written(0), done(false), failed(false) { }
+    };
+
+    typedef std::pair<Stream *, uint64_t> Job;
+
+    const LiveRuleSet & rules;
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable available;
+    std::deque<Job> jobs;
+    bool stopping;
+
+public:
+    // threads of 0 means one per cpu
+    Processor(const LiveRuleSet & rules, size_t threads = 0);
+    ~Processor();
+
+    /* Reads messages from in until end of file and writes productions to out.
+     * Returns false if either side failed. */
+    bool run(int in, int out);
+
+    size_t getThreads() const { return workers.size(); }
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    void work();
+    void evaluate(Chunk & chunk);
+    void write(Stream * stream, int out);
+    void submit(Stream * stream, std::string & input);
+
+    Processor(const Processor &);
+    Processor & operator=(const Processor &);
+};
+
+}
+
+#endif
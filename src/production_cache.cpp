@@ -0,0 +1,143 @@
+#include "production_cache.h"
+
+#include <functional>
+
+using namespace Monty;
+
+ProductionCache::ProductionCache(size_t bytes) : shards(new Shard[numShards]), capacity(bytes / numShards)
+{
+}
+
+uint64_t ProductionCache::project(const Schema & schema, const Message & msg, std::string & key)
+{
+    bool bySlot = msg.getSchema() == &schema;
+
+    key.clear();
+
+    for (size_t i = 0; i < schema.size(); i++) {
+        const Scalar * v = bySlot ? msg.find(i) : msg.find(schema.key(i));
+
+        if (! v) {
+            key.push_back(0);
+            continue;
+        }
+
+        uint32_t len = v->getText().size();
+
+        key.push_back(1 + v->getType());
+        key.append((const char *)&len, sizeof(len));
+        key.append(v->getText());
+    }
+
+    return std::hash<std::string>()(key);
+}
+
+bool ProductionCache::find(uint64_t hash, const std::string & key, std::string & out)
+{
+    Shard & s = shard(hash);
+    std::lock_guard<std::mutex> guard(s.lock);
+    std::unordered_map<uint64_t, size_t>::const_iterator it = s.index.find(hash);
+
+    // a hash collision is just a miss
+    if (it == s.index.end() || s.entries[it->second].key != key) {
+        s.misses++;
+        return false;
+    }
+
+    Entry & e = s.entries[it->second];
+
+    e.referenced = true;
+    out.append(e.value);
+    s.hits++;
+
+    return true;
+}
+
+void ProductionCache::evict(Shard & s, size_t slot)
+{
+    Entry & e = s.entries[slot];
+
+    s.bytes -= e.key.size() + e.value.size() + entryOverhead;
+    s.index.erase(e.hash);
+    s.free.push_back(slot);
+
+    e.used = false;
+    e.referenced = false;
+    std::string().swap(e.key);
+    std::string().swap(e.value);
+}
+
+void ProductionCache::insert(uint64_t hash, const std::string & key, const std::string & value)
+{
+    size_t cost = key.size() + value.size() + entryOverhead;
+
+    if (cost > capacity) return;
+
+    Shard & s = shard(hash);
+    std::lock_guard<std::mutex> guard(s.lock);
+    std::unordered_map<uint64_t, size_t>::const_iterator it = s.index.find(hash);
+
+    // replaces a colliding entry, or one another thread just inserted
+    if (it != s.index.end()) evict(s, it->second);
+
+    // every sweep clears marks as it goes, so two turns always make room
+    while (s.bytes + cost > capacity) {
+        Entry & e = s.entries[s.hand];
+
+        if (e.used && e.referenced) {
+            e.referenced = false;
+        } else if (e.used) {
+            evict(s, s.hand);
+            s.evictions++;
+        }
+
+        s.hand = (s.hand + 1) % s.entries.size();
+    }
+
+    size_t slot;
+
+    if (s.free.empty()) {
+        slot = s.entries.size();
+        s.entries.push_back(Entry());
+    } else {
+        slot = s.free.back();
+        s.free.pop_back();
+    }
+
+    Entry & e = s.entries[slot];
+
+    e.hash = hash;
+    e.key = key;
+    e.value = value;
+    e.used = true;
+    e.referenced = false;
+
+    s.index[hash] = slot;
+    s.bytes += cost;
+}
+
+ProductionCache::Metrics ProductionCache::getMetrics() const
+{
+    Metrics m = { 0, 0, 0, 0, 0 };
+
+    for (size_t i = 0; i < numShards; i++) {
+        Shard & s = shards[i];
+        std::lock_guard<std::mutex> guard(s.lock);
+
+        m.hits += s.hits;
+        m.misses += s.misses;
+        m.evictions += s.evictions;
+        m.entries += s.index.size();
+        m.bytes += s.bytes;
+    }
+
+    return m;
+}
+
+void ProductionCache::print(std::ostream & out) const
+{
+    Metrics m = getMetrics();
+
+    out << "ProductionCache(entries=" << m.entries << ", bytes=" << m.bytes << "/" << capacity * numShards
+        << ", hits=" << m.hits << ", misses=" << m.misses << ", evictions=" << m.evictions << ")";
+}
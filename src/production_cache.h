@@ -0,0 +1,102 @@
+#ifndef MONTY_PRODUCTION_CACHE_H
+#define MONTY_PRODUCTION_CACHE_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "message.h"
+#include "object.h"
+#include "schema.h"
+
+namespace Monty {
+
+/* Remembers the productions a rule rendered, keyed by the values of just the
+ * fields it looks up, so messages that differ only in fields the rule
+ * ignores are answered without evaluating it.  A lookup costs a pass over
+ * the referenced values plus a locked probe, so it only pays off for rules
+ * that cost more than that to evaluate.
+ *
+ * Entries are spread over shards by hash, each with its own lock and a share
+ * of the byte budget, and evicted by CLOCK: a hit marks its entry, and the
+ * hand sweeping for room spares a marked entry once, clearing the mark.  An
+ * entry is charged its key, its production and a fixed overhead. */
+class ProductionCache: public Object {
+public:
+    struct Metrics {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t entries;
+        uint64_t bytes;
+
+        double hitRate() const { return hits + misses ? (double)hits / (hits + misses) : 0; }
+    };
+
+    // what each entry is charged beyond its key and production
+    static const size_t entryOverhead = 64;
+
+private:
+    struct Entry {
+        uint64_t hash;
+        std::string key;
+        std::string value;
+        bool used;
+        bool referenced;
+
+        Entry() : hash(0), used(false), referenced(false) { }
+    };
+
+    struct Shard {
+        std::mutex lock;
+        std::vector<Entry> entries;
+        std::vector<size_t> free;
+        std::unordered_map<uint64_t, size_t> index;
+        size_t hand;
+        size_t bytes;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+
+        Shard() : hand(0), bytes(0), hits(0), misses(0), evictions(0) { }
+    };
+
+    static const size_t numShards = 16;
+
+    std::unique_ptr<Shard[]> shards;
+    size_t capacity;
+
+public:
+    ProductionCache(size_t bytes);
+
+    /* Writes the projection of msg onto the keys of schema into key and
+     * returns its hash.  Missing fields, and each value's type and text,
+     * are all part of the projection. */
+    static uint64_t project(const Schema & schema, const Message & msg, std::string & key);
+
+    // appends the cached production to out and returns true on a hit
+    bool find(uint64_t hash, const std::string & key, std::string & out);
+
+    void insert(uint64_t hash, const std::string & key, const std::string & value);
+
+    Metrics getMetrics() const;
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    /* The top bits after a Fibonacci multiply, which depend on every bit of
+     * hash, so a size_t hash from a 32 bit target or a weak std::hash still
+     * spreads over every shard. */
+    Shard & shard(uint64_t hash) const { return shards[(hash * 0x9e3779b97f4a7c15ULL) >> 60]; }
+    void evict(Shard & s, size_t slot);
+
+    ProductionCache(const ProductionCache &);
+    ProductionCache & operator=(const ProductionCache &);
+};
+
+}
+
+#endif
@@ -0,0 +1,302 @@
+#include "program.h"
+#include "ast.h"
+#include "url.h"
+
+#include <algorithm>
+
+using namespace Monty;
+
+std::string Opcode::names[] = {
+    "LOAD_CONST",
+    "LOAD_FIELD",
+    "COMPARE",
+    "JUMP",
+    "JUMP_IF_TRUE",
+    "JUMP_IF_FALSE",
+    "EMIT_CONST",
+    "EMIT_FIELD",
+    "PREDICATE",
+    "SWITCH",
+    "HALT",
+};
+
+void Frame::reset(const Program & program)
+{
+    if (fields.size() < program.fields.size()) {
+        fields.resize(program.fields.size());
+        fieldStamps.resize(program.fields.size());
+    }
+
+    if (predicates.size() < program.numPredicates()) {
+        predicates.resize(program.numPredicates());
+        predicateStamps.resize(program.numPredicates());
+    }
+
+    if (++generation == 0) {
+        std::fill(fieldStamps.begin(), fieldStamps.end(), 0);
+        std::fill(predicateStamps.begin(), predicateStamps.end(), 0);
+        generation = 1;
+    }
+}
+
+/* Fields are resolved to slots of s now so that messages parsed against s are
+ * read by index. */
+void Program::bind(const Schema & s)
+{
+    schema = &s;
+    fieldSlots.resize(fields.size());
+
+    for (size_t i = 0; i < fields.size(); i++) {
+        fieldSlots[i] = s.slot(fields[i]);
+    }
+}
+
+void Program::map(const Instruction * code, size_t codeSize, const Predicate * predicates, size_t predicateCount, const uint32_t * entries, size_t entryCount)
+{
+    view.code = code;
+    view.codeSize = codeSize;
+    view.predicates = predicates;
+    view.predicateCount = predicateCount;
+    view.entries = entries;
+    view.entryCount = entryCount;
+}
+
+const Scalar * Program::resolve(const Message & msg, uint32_t i) const
+{
+    const Scalar * v;
+
+    if (schema && msg.getSchema() == schema) {
+        v = fieldSlots[i] >= 0 ? msg.find((size_t)fieldSlots[i]) : NULL;
+    } else {
+        v = msg.find(fields[i]);
+    }
+
+    return v ? v : &Message::empty;
+}
+
+void Program::indexSwitches()
+{
+    for (size_t i = switchIndexes.size(); i < switches.size(); i++) {
+        const Switch & s = switches[i];
+        SwitchIndex index;
+
+        for (uint32_t j = 0; j < s.count; j++) {
+            const SwitchCase & c = cases[s.first + j];
+            const Scalar & k = constants[c.constant];
+
+            // emplace keeps the earlier case on a duplicate key
+            if (c.type == AST::Binary::Type::SEQ) {
+                index.text.emplace(k.getText(), j);
+                continue;
+            }
+
+            // NaN equals nothing, so it gets no key
+            if (k.getDouble() == k.getDouble()) index.reals.emplace(k.getDouble(), j);
+
+            if (k.isIntegral()) {
+                index.integers.emplace(k.getInteger(), j);
+            } else if (k.getDouble() == k.getDouble()) {
+                index.fractions.emplace(k.getDouble(), j);
+            }
+        }
+
+        switchIndexes.push_back(std::move(index));
+    }
+}
+
+namespace {
+
+// lowers best to the case m holds for k, if that is earlier
+template <typename T>
+inline void earliest(const std::unordered_map<T, uint32_t> & m, const T & k, uint32_t & best)
+{
+    typename std::unordered_map<T, uint32_t>::const_iterator it = m.find(k);
+
+    if (it != m.end() && it->second < best) best = it->second;
+}
+
+}
+
+uint32_t Program::dispatch(uint32_t i, const Scalar & value) const
+{
+    const Switch & s = switches[i];
+    const SwitchIndex & index = switchIndexes[i];
+    uint32_t best = s.count;
+
+    if (! index.text.empty()) earliest(index.text, value.getText(), best);
+
+    if (value.isIntegral()) {
+        if (! index.integers.empty()) earliest(index.integers, value.getInteger(), best);
+        if (! index.fractions.empty()) earliest(index.fractions, value.getDouble(), best);
+    } else if (! index.reals.empty()) {
+        earliest(index.reals, value.getDouble(), best);
+    }
+
+    return best < s.count ? cases[s.first + best].target : s.fallthrough;
+}
+
+inline const Scalar * Program::field(const Message & msg, uint32_t i, Frame & frame) const
+{
+    if (frame.fieldStamps[i] != frame.generation) {
+        frame.fields[i] = resolve(msg, i);
+        frame.fieldStamps[i] = frame.generation;
+    }
+
+    return frame.fields[i];
+}
+
+inline const Scalar * Program::operand(const Message & msg, uint32_t o, Frame & frame) const
+{
+    if (o & Predicate::FIELD) return field(msg, o & ~Predicate::FIELD, frame);
+
+    return &constants[o];
+}
+
+inline bool Program::predicate(const Message & msg, uint32_t i, Frame & frame) const
+{
+    if (frame.predicateStamps[i] != frame.generation) {
+        const Predicate & p = getPredicates()[i];
+
+        frame.predicates[i] = AST::Binary::compare((AST::Binary::Type)p.type, *operand(msg, p.left, frame), *operand(msg, p.right, frame));
+        frame.predicateStamps[i] = frame.generation;
+    }
+
+    return frame.predicates[i];
+}
+
+std::string Program::exec(const Message & msg, size_t entry) const
+{
+    std::string out;
+
+    exec(msg, out, entry);
+
+    return out;
+}
+
+void Program::exec(const Message & msg, std::string & out, size_t entry) const
+{
+    static thread_local Frame frame;
+
+    frame.reset(*this);
+
+    exec(msg, out, entry, frame);
+}
+
+void Program::exec(const Message & msg, std::string & out, size_t entry, Frame & frame) const
+{
+    const Scalar * reg[256];
+    const Instruction * base = getCode();
+    const Instruction * pc = base + getEntries()[entry];
+    bool flag = false;
+
+    for (;;) {
+        const Instruction & i = *pc++;
+
+        switch (i.op) {
+            case Instruction::LOAD_CONST:
+                reg[i.a] = &constants[i.arg];
+                break;
+            case Instruction::LOAD_FIELD:
+                reg[i.a] = field(msg, i.arg, frame);
+                break;
+            case Instruction::COMPARE:
+                flag = AST::Binary::compare((AST::Binary::Type)i.a, *reg[i.b], *reg[i.c]);
+                break;
+            case Instruction::JUMP:
+                pc = base + i.arg;
+                break;
+            case Instruction::JUMP_IF_TRUE:
+                if (flag) pc = base + i.arg;
+                break;
+            case Instruction::JUMP_IF_FALSE:
+                if (! flag) pc = base + i.arg;
+                break;
+            case Instruction::EMIT_CONST:
+                out.append(constants[i.arg].getText());
+                break;
+            case Instruction::EMIT_FIELD:
+                Url::encode(field(msg, i.arg, frame)->getText(), out);
+                break;
+            case Instruction::PREDICATE:
+                flag = predicate(msg, i.arg, frame);
+                break;
+            case Instruction::SWITCH:
+                pc = base + dispatch(i.arg, *field(msg, switches[i.arg].field, frame));
+                break;
+            case Instruction::HALT:
+                return;
+            default:
+                assert(0);
+                return;
+        }
+    }
+}
+
+void Program::printOperand(std::ostream & out, uint32_t o) const
+{
+    if (o & Predicate::FIELD) {
+        out << fields[o & ~Predicate::FIELD];
+    } else {
+        out << "\"" << constants[o] << "\"";
+    }
+}
+
+void Program::print(std::ostream & out) const
+{
+    out << "Program(";
+
+    const Instruction * base = getCode();
+
+    for (const Instruction * it = base; it != base + numInstructions(); it++) {
+        out << std::endl << "  " << (it - base) << ": " << Opcode::names[it->op];
+
+        switch (it->op) {
+            case Instruction::LOAD_CONST:
+                out << " r" << (int)it->a << ", \"" << constants[it->arg] << "\"";
+                break;
+            case Instruction::LOAD_FIELD:
+                out << " r" << (int)it->a << ", " << fields[it->arg];
+                break;
+            case Instruction::COMPARE:
+                out << "<" << AST::BinaryType::names[it->a] << "> r" << (int)it->b << ", r" << (int)it->c;
+                break;
+            case Instruction::JUMP:
+            case Instruction::JUMP_IF_TRUE:
+            case Instruction::JUMP_IF_FALSE:
+                out << " " << it->arg;
+                break;
+            case Instruction::EMIT_CONST:
+                out << " \"" << constants[it->arg] << "\"";
+                break;
+            case Instruction::EMIT_FIELD:
+                out << " " << fields[it->arg];
+                break;
+            case Instruction::PREDICATE: {
+                const Predicate & p = getPredicates()[it->arg];
+
+                out << " " << it->arg << " <" << AST::BinaryType::names[p.type] << ">(";
+                printOperand(out, p.left);
+                out << ", ";
+                printOperand(out, p.right);
+                out << ")";
+                break;
+            }
+            case Instruction::SWITCH: {
+                const Switch & s = switches[it->arg];
+
+                out << " " << fields[s.field] << " {";
+                for (uint32_t j = 0; j < s.count; j++) {
+                    const SwitchCase & c = cases[s.first + j];
+
+                    out << (j ? ", " : "") << AST::BinaryType::names[c.type] << " \"" << constants[c.constant] << "\": " << c.target;
+                }
+                out << "} else " << s.fallthrough;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    out << ")";
+}
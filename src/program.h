@@ -0,0 +1,186 @@
+#ifndef MONTY_PROGRAM_H
+#define MONTY_PROGRAM_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "message.h"
+#include "object.h"
+#include "scalar.h"
+#include "schema.h"
+
+namespace Monty {
+
+namespace Opcode {
+    extern std::string names[];
+}
+
+struct Instruction {
+    enum Opcode {
+        LOAD_CONST,    // reg[a] = constants[arg]
+        LOAD_FIELD,    // reg[a] = msg[fields[arg]]
+        COMPARE,       // flag = Binary::Type(a) applied to reg[b], reg[c]
+        JUMP,          // pc = arg
+        JUMP_IF_TRUE,  // if (flag) pc = arg
+        JUMP_IF_FALSE, // if (! flag) pc = arg
+        EMIT_CONST,    // out += constants[arg]
+        EMIT_FIELD,    // out += urlencode(msg[fields[arg]])
+        PREDICATE,     // flag = predicates[arg], evaluated at most once per frame
+        SWITCH,        // pc = the target of the first case of switches[arg] that holds
+        HALT,
+        NUM_ITEMS,
+    };
+
+    uint8_t op;
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+    uint32_t arg;
+
+    Instruction(Instruction::Opcode op, uint8_t a, uint8_t b, uint8_t c, uint32_t arg) : op(op), a(a), b(b), c(c), arg(arg) { }
+};
+
+/* A comparison shared between every rule compiled into a program.  Operands
+ * index constants, or fields when FIELD is set. */
+struct Predicate {
+    static const uint32_t FIELD = 0x80000000;
+
+    uint32_t type;
+    uint32_t left;
+    uint32_t right;
+
+    Predicate(uint32_t type, uint32_t left, uint32_t right) : type(type), left(left), right(right) { }
+};
+
+/* A ladder of equality tests of one field, lowered to a single dispatch.
+ * Cases cases[first, first + count) are tried in order as if each were a
+ * Binary of type EQ or SEQ between the field and a constant, and the first
+ * that holds supplies the target; when none does, control continues at
+ * fallthrough. */
+struct Switch {
+    uint32_t field;
+    uint32_t first;
+    uint32_t count;
+    uint32_t fallthrough;
+
+    Switch(uint32_t field, uint32_t first, uint32_t count, uint32_t fallthrough) : field(field), first(first), count(count), fallthrough(fallthrough) { }
+};
+
+struct SwitchCase {
+    uint32_t type;
+    uint32_t constant;
+    uint32_t target;
+
+    SwitchCase(uint32_t type, uint32_t constant, uint32_t target) : type(type), constant(constant), target(target) { }
+};
+
+class Program;
+
+/* Per message evaluation state.  Fields are fetched from the message and
+ * predicates evaluated on first use, then reused by every later instruction,
+ * and every later rule, run against the same frame.  Slots are stamped with a
+ * generation so that starting a new message doesn't have to clear them. */
+class Frame {
+    friend class Program;
+
+    std::vector<const Scalar *> fields;
+    std::vector<uint32_t> fieldStamps;
+    std::vector<uint8_t> predicates;
+    std::vector<uint32_t> predicateStamps;
+    uint32_t generation;
+
+public:
+    Frame() : generation(0) { }
+
+    void reset(const Program & program);
+};
+
+/* A flat, register based lowering of one or more rule trees.  Code for every
+ * rule lives in one contiguous instruction array; entries[i] is the first
+ * instruction of the i'th rule compiled into the program.
+ *
+ * Instructions, predicates and entries are plain index based structs, so
+ * they can also be executed in place from a mapped RuleCache file; see
+ * map(). */
+class Program: public Object {
+public:
+    std::vector<Instruction> code;
+    std::vector<Scalar> constants;
+    std::vector<std::string> fields;
+    std::vector<Predicate> predicates;
+    std::vector<uint32_t> entries;
+    std::vector<Switch> switches;
+    std::vector<SwitchCase> cases;
+    unsigned registers;
+
+    Program() : registers(0), schema(NULL) { view.code = NULL; }
+
+    void bind(const Schema & s);
+
+    /* Runs code, predicates and entries from the arrays given, which must
+     * outlive the program, instead of from its own vectors. */
+    void map(const Instruction * code, size_t codeSize, const Predicate * predicates, size_t predicateCount, const uint32_t * entries, size_t entryCount);
+    bool isMapped() const { return view.code != NULL; }
+
+    size_t numInstructions() const { return view.code ? view.codeSize : code.size(); }
+    size_t numPredicates() const { return view.code ? view.predicateCount : predicates.size(); }
+    size_t numEntries() const { return view.code ? view.entryCount : entries.size(); }
+
+    const Instruction * getCode() const { return view.code ? view.code : code.data(); }
+    const Predicate * getPredicates() const { return view.code ? view.predicates : predicates.data(); }
+    const uint32_t * getEntries() const { return view.code ? view.entries : entries.data(); }
+
+    // the value of fields[i] in msg, or Message::empty; never memoized
+    const Scalar * resolve(const Message & msg, uint32_t i) const;
+
+    /* Builds the lookup tables of any switches added since the last call;
+     * a switch can't be dispatched before its cases are indexed. */
+    void indexSwitches();
+
+    // the target of switches[i] for a field holding value
+    uint32_t dispatch(uint32_t i, const Scalar & value) const;
+
+    std::string exec(const Message & msg, size_t entry = 0) const;
+    void exec(const Message & msg, std::string & out, size_t entry = 0) const;
+    void exec(const Message & msg, std::string & out, size_t entry, Frame & frame) const;
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    /* Case numbers, relative to Switch::first, keyed by what they match.  An
+     * EQ case holds for an integral value when their integers are equal,
+     * unless the constant isn't integral, and otherwise when their doubles
+     * are; so the doubles of every EQ case are kept as well as those that
+     * aren't integral.  Each key keeps its earliest case. */
+    struct SwitchIndex {
+        std::unordered_map<std::string, uint32_t> text;
+        std::unordered_map<int64_t, uint32_t> integers;
+        std::unordered_map<double, uint32_t> fractions;
+        std::unordered_map<double, uint32_t> reals;
+    };
+
+    struct View {
+        const Instruction * code;
+        size_t codeSize;
+        const Predicate * predicates;
+        size_t predicateCount;
+        const uint32_t * entries;
+        size_t entryCount;
+    };
+
+    const Schema * schema;
+    std::vector<int> fieldSlots;
+    std::vector<SwitchIndex> switchIndexes;
+    View view;
+
+    const Scalar * field(const Message & msg, uint32_t i, Frame & frame) const;
+    bool predicate(const Message & msg, uint32_t i, Frame & frame) const;
+    const Scalar * operand(const Message & msg, uint32_t o, Frame & frame) const;
+    void printOperand(std::ostream & out, uint32_t o) const;
+};
+
+}
+
+#endif
@@ -1,19 +1,145 @@
 #include "rule.h"
 #include "parser.h"
+#include "parse_error.h"
+#include "compiler.h"
+#include "batch.h"
+#include "optimizer.h"
+
+#include <algorithm>
 
 using namespace Monty;
 
-Rule::Rule(const std::string & json)
+Rule::Rule(const std::string & json, Rule::Engine engine, bool optimize, const std::shared_ptr<Pool> & pool) : pool(pool), engine(Rule::Engine::TREE), removed(0)
 {
-    Parser p;
+    if (! pool) interner.reset(new Interner());
+
+    Parser p(arena, pool.get(), interner.get());
     AST::Base * obj = p.parse(json);
 
+    if (obj->kind() != AST::Base::Kind::CONDITIONAL && obj->kind() != AST::Base::Kind::PRODUCTION) {
+        throw ParseError("rule isn't a statement @");
+    }
+
     statement = static_cast<AST::Statement *>(obj);
+
+    if (optimize) {
+        Optimizer o(arena, pool.get());
+
+        statement = o.optimize(statement);
+        removed = o.getRemoved();
+    }
+
+    std::vector<AST::Base *> nodes;
+    AST::flatten(statement, nodes);
+
+    for (std::vector<AST::Base *>::const_iterator it = nodes.begin(); it != nodes.end(); it++) {
+        if ((*it)->kind() == AST::Base::Kind::LOOKUP) {
+            schema.add(static_cast<AST::Lookup *>(*it)->getKey());
+        }
+    }
+
+    schema.build();
+    schema.setInterner(pool ? &pool->getInterner() : interner.get());
+
+    // only a lookup compared with a constant gains from finding its value
+    for (std::vector<AST::Base *>::const_iterator it = nodes.begin(); it != nodes.end(); it++) {
+        if ((*it)->kind() != AST::Base::Kind::BINARY) continue;
+
+        const AST::Binary * b = static_cast<const AST::Binary *>(*it);
+        const AST::Arg * l = b->getLeft();
+        const AST::Arg * r = b->getRight();
+
+        if (b->getType() != AST::Binary::Type::SEQ && b->getType() != AST::Binary::Type::SNE) continue;
+        if (r->kind() == AST::Base::Kind::LOOKUP) std::swap(l, r);
+
+        if (l->kind() == AST::Base::Kind::LOOKUP && r->kind() == AST::Base::Kind::VALUE) {
+            schema.compareText(schema.slot(static_cast<const AST::Lookup *>(l)->getKey()));
+        }
+    }
+
+    // pooled Lookups belong to no one rule; whoever owns the pool binds them
+    for (std::vector<AST::Base *>::const_iterator it = nodes.begin(); it != nodes.end() && ! pool; it++) {
+        if ((*it)->kind() == AST::Base::Kind::LOOKUP) {
+            static_cast<AST::Lookup *>(*it)->bind(schema);
+        }
+    }
+
+    setEngine(engine);
+}
+
+void Rule::setEngine(Rule::Engine e)
+{
+    if (e != Rule::Engine::TREE && ! program) {
+        program.reset(new Program());
+
+        Compiler c(*program);
+        c.compile(statement);
+        program->bind(schema);
+    }
+
+    if (e == Rule::Engine::NATIVE && ! native) {
+        native.reset(new Native(*program));
+    }
+
+    engine = e;
 }
 
 std::string Rule::exec(const Message & msg)
 {
-    return statement->exec(msg);
+    std::string out;
+
+    exec(msg, out);
+
+    return out;
+}
+
+void Rule::enableStats()
+{
+    if (! stats) stats.reset(new RuleStats(statement));
+}
+
+void Rule::setCache(size_t bytes)
+{
+    cache.reset(bytes ? new ProductionCache(bytes) : NULL);
+}
+
+void Rule::exec(const Message & msg, std::string & out)
+{
+    if (! cache) {
+        evaluate(msg, out);
+        return;
+    }
+
+    static thread_local std::string key;
+    static thread_local std::string value;
+    uint64_t hash = ProductionCache::project(schema, msg, key);
+
+    if (cache->find(hash, key, out)) return;
+
+    value.clear();
+    evaluate(msg, value);
+    cache->insert(hash, key, value);
+    out.append(value);
+}
+
+void Rule::evaluate(const Message & msg, std::string & out)
+{
+    if (stats) {
+        stats->exec(msg, out);
+    } else if (engine == Rule::Engine::NATIVE) {
+        native->exec(msg, &out);
+    } else if (engine == Rule::Engine::BYTECODE) {
+        program->exec(msg, out);
+    } else {
+        statement->exec(msg, out);
+    }
+}
+
+void Rule::exec(const std::vector<const Message *> & msgs, std::vector<std::string> & out)
+{
+    Batch batch(msgs);
+
+    batch.exec(statement, out);
 }
 
 void Rule::print(std::ostream & out) const
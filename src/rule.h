@@ -2,18 +2,85 @@
 #define MONTY_RULE_H
 
 #include <string>
+#include <memory>
+#include "arena.h"
 #include "ast.h"
+#include "native.h"
 #include "object.h"
+#include "pool.h"
+#include "production_cache.h"
+#include "program.h"
+#include "schema.h"
+#include "stats.h"
 
 namespace Monty {
 
+/* A parsed rule.  Its tree, and everything the optimizer makes from it, is
+ * held in the rule's own arena, so a Rule can't be copied.  Parsed through a
+ * Pool, its Args and Expressions live in the pool instead, which the rule
+ * keeps alive, and its constants are interned in the pool's interner rather
+ * than one of the rule's own. */
 class Rule: public Object {
+public:
+    enum Engine {
+        TREE,
+        BYTECODE,
+        NATIVE,
+    };
+
+private:
+    std::shared_ptr<Pool> pool;
+    std::unique_ptr<Interner> interner;
+    Arena arena;
     AST::Statement * statement;
+    Rule::Engine engine;
+    size_t removed;
+    std::unique_ptr<Program> program;
+    std::unique_ptr<Native> native;
+    std::unique_ptr<RuleStats> stats;
+    std::unique_ptr<ProductionCache> cache;
+    Schema schema;
 
 public:
-    Rule(const std::string & json);
+    /* With optimize the parsed tree is run through the Optimizer before
+     * anything else sees it. */
+    Rule(const std::string & json, Rule::Engine engine = Rule::Engine::TREE, bool optimize = false, const std::shared_ptr<Pool> & pool = std::shared_ptr<Pool>());
     virtual void print(std::ostream & stream) const;
     std::string exec(const Message & msg);
+
+    /* Appends the production for msg to out. */
+    void exec(const Message & msg, std::string & out);
+
+    /* Evaluates every message at once with the columnar Batch engine;
+     * out[i] receives the production for msgs[i]. */
+    void exec(const std::vector<const Message *> & msgs, std::vector<std::string> & out);
+
+    const AST::Statement * getStatement() const { return statement; }
+
+    // nodes the optimizer removed from the parsed tree
+    size_t getRemoved() const { return removed; }
+
+    /* The keys this rule looks up.  Messages parsed against it keep only
+     * those fields and are read by slot. */
+    const Schema & getSchema() const { return schema; }
+
+    /* From now on exec walks the tree with counters, whatever the engine,
+     * until stats are disabled again. */
+    void enableStats();
+    void disableStats() { stats.reset(); }
+    const RuleStats * getStats() const { return stats.get(); }
+
+    /* Caches up to bytes worth of productions, keyed by the values of the
+     * fields this rule looks up; 0 turns the cache off. */
+    void setCache(size_t bytes);
+    const ProductionCache * getCache() const { return cache.get(); }
+
+    Rule::Engine getEngine() const { return engine; }
+    // NATIVE builds the rule with the system compiler; throws CompileError
+    void setEngine(Rule::Engine e);
+
+private:
+    void evaluate(const Message & msg, std::string & out);
 };
 
 }
@@ -0,0 +1,263 @@
+#include "ruleset.h"
+#include "cache.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include <assert.h>
+
+using namespace Monty;
+
+RuleSet::RuleSet() : pool(std::make_shared<Pool>()), compiler(program, true), markedPredicates(0), prefilter(true)
+{
+    schema.setInterner(&pool->getInterner());
+}
+
+RuleSet::~RuleSet()
+{
+}
+
+size_t RuleSet::add(const std::string & json)
+{
+    assert(! mapping);
+
+    native.reset();
+
+    std::shared_ptr<Rule> rule(new Rule(json, Rule::Engine::TREE, true, pool));
+
+    compiler.compile(rule->getStatement());
+    rules.push_back(rule);
+
+    if (! stats.empty()) stats.push_back(std::make_shared<RuleStats>(rule->getStatement()));
+
+    if (schema.size() != program.fields.size()) {
+        for (size_t i = schema.size(); i < program.fields.size(); i++) {
+            schema.add(program.fields[i]);
+        }
+
+        schema.build();
+        program.bind(schema);
+        pool->bind(schema);
+    }
+
+    markText();
+    guard(rules.size() - 1);
+
+    return rules.size() - 1;
+}
+
+/* Marks the fields of predicates added since the last call that compare
+ * text against a constant, so that messages find their values in the pool's
+ * interner.  Switches look text up in tables of their own and gain nothing
+ * from it. */
+void RuleSet::markText()
+{
+    const Predicate * predicates = program.getPredicates();
+
+    for (; markedPredicates < program.numPredicates(); markedPredicates++) {
+        const Predicate & p = predicates[markedPredicates];
+        uint32_t field = p.left & Predicate::FIELD ? p.left : p.right;
+        uint32_t other = field == p.left ? p.right : p.left;
+
+        if (p.type != AST::Binary::Type::SEQ && p.type != AST::Binary::Type::SNE) continue;
+        if (! (field & Predicate::FIELD) || (other & Predicate::FIELD)) continue;
+
+        schema.compareText(schema.slot(program.fields[field & ~Predicate::FIELD]));
+    }
+}
+
+/* Follows ifFalse down from the top of rule i for as long as some key is
+ * needed by every condition passed; a message missing any such key ends up
+ * at the statement reached, whatever else it holds. */
+void RuleSet::guard(size_t i)
+{
+    const AST::Statement * s = rules[i]->getStatement();
+    std::vector<std::string> needs;
+
+    while (s->kind() == AST::Base::Kind::CONDITIONAL) {
+        const AST::Conditional * c = static_cast<const AST::Conditional *>(s);
+        std::vector<std::string> keys;
+
+        AST::required(c->getCondition(), keys);
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        if (s != rules[i]->getStatement()) {
+            std::vector<std::string> common;
+
+            std::set_intersection(needs.begin(), needs.end(), keys.begin(), keys.end(), std::back_inserter(common));
+            keys.swap(common);
+        }
+
+        if (keys.empty()) break;
+
+        needs.swap(keys);
+        s = c->getIfFalse();
+    }
+
+    required.push_back(needs);
+    fallbacks.push_back(needs.empty() ? NULL : s);
+
+    for (std::vector<std::string>::const_iterator it = needs.begin(); it != needs.end(); it++) {
+        int slot = schema.slot(*it);
+
+        if ((size_t)slot >= needers.size()) needers.resize(slot + 1);
+
+        std::vector<uint64_t> & rulesNeeding = needers[slot];
+
+        if (rulesNeeding.empty()) neededSlots.push_back(slot);
+
+        rulesNeeding.resize(i / 64 + 1);
+        rulesNeeding[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+const std::vector<std::string> & RuleSet::getRequired(size_t i) const
+{
+    static const std::vector<std::string> none;
+
+    return i < required.size() ? required[i] : none;
+}
+
+/* A bit per rule that msg lacks a needed key for, or NULL if there are
+ * none.  Slots past the end of msg's presence weren't in the schema when
+ * it was parsed, so they are missing too. */
+const uint64_t * RuleSet::skipped(const Message & msg) const
+{
+    static thread_local std::vector<uint64_t> skip;
+
+    if (! prefilter || neededSlots.empty() || msg.getSchema() != &schema) return NULL;
+
+    const std::vector<uint64_t> & presence = msg.getPresence();
+    bool any = false;
+
+    skip.assign((rules.size() + 63) / 64, 0);
+
+    for (std::vector<uint32_t>::const_iterator it = neededSlots.begin(); it != neededSlots.end(); it++) {
+        if (*it / 64 < presence.size() && (presence[*it / 64] >> (*it % 64) & 1)) continue;
+
+        const std::vector<uint64_t> & rulesNeeding = needers[*it];
+
+        for (size_t w = 0; w < rulesNeeding.size(); w++) skip[w] |= rulesNeeding[w];
+
+        any = true;
+    }
+
+    return any ? &skip[0] : NULL;
+}
+
+void RuleSet::compileNative()
+{
+    native.reset(new Native(program));
+}
+
+void RuleSet::enableStats()
+{
+    if (! stats.empty()) return;
+
+    for (size_t i = 0; i < size(); i++) {
+        stats.push_back(std::make_shared<RuleStats>(rules.empty() ? NULL : rules[i]->getStatement()));
+    }
+}
+
+void RuleSet::dumpStats(std::ostream & out) const
+{
+    out << "{\"rules\":[";
+
+    for (size_t i = 0; i < stats.size(); i++) {
+        if (i) out << ",";
+        stats[i]->dump(out);
+    }
+
+    out << "]}";
+}
+
+std::vector<std::string> RuleSet::exec(const Message & msg) const
+{
+    std::vector<std::string> out;
+
+    exec(msg, out);
+
+    return out;
+}
+
+void RuleSet::exec(const Message & msg, std::vector<std::string> & out) const
+{
+    static thread_local Frame frame;
+
+    exec(msg, out, frame);
+}
+
+/* out is resized to one production per rule, in the order the rules were
+ * added.  Existing strings in out are reused. */
+void RuleSet::exec(const Message & msg, std::vector<std::string> & out, Frame & frame) const
+{
+    if (! stats.empty()) {
+        execStats(msg, out, frame);
+        return;
+    }
+
+    if (native) {
+        native->exec(msg, out);
+        return;
+    }
+
+    const uint64_t * skip = skipped(msg);
+
+    frame.reset(program);
+    out.resize(size());
+
+    for (size_t i = 0; i < out.size(); i++) {
+        out[i].clear();
+
+        if (skip && (skip[i / 64] >> (i % 64) & 1)) {
+            fallbacks[i]->exec(msg, out[i]);
+        } else {
+            program.exec(msg, out[i], i, frame);
+        }
+    }
+}
+
+void RuleSet::execTrees(const Message & msg, std::vector<std::string> & out, AST::Memo & memo) const
+{
+    const uint64_t * skip = skipped(msg);
+
+    memo.reset(pool->numShared());
+    out.resize(rules.size());
+
+    for (size_t i = 0; i < out.size(); i++) {
+        const AST::Statement * s = skip && (skip[i / 64] >> (i % 64) & 1) ? fallbacks[i] : rules[i]->getStatement();
+
+        out[i].clear();
+        s->exec(msg, out[i], memo);
+    }
+}
+
+void RuleSet::execStats(const Message & msg, std::vector<std::string> & out, Frame & frame) const
+{
+    frame.reset(program);
+    out.resize(size());
+
+    for (size_t i = 0; i < out.size(); i++) {
+        out[i].clear();
+
+        if (rules.empty()) {
+            uint64_t start = RuleStats::now();
+
+            program.exec(msg, out[i], i, frame);
+            stats[i]->record(RuleStats::now() - start);
+        } else {
+            stats[i]->exec(msg, out[i]);
+        }
+    }
+}
+
+void RuleSet::print(std::ostream & out) const
+{
+    out << "RuleSet(rules=" << size()
+        << ", fields=" << program.fields.size()
+        << ", predicates=" << program.numPredicates()
+        << ", instructions=" << program.numInstructions()
+        << (mapping ? ", mapped" : "")
+        << (native ? ", native" : "") << ")";
+}
@@ -0,0 +1,119 @@
+#ifndef MONTY_RULESET_H
+#define MONTY_RULESET_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "compiler.h"
+#include "native.h"
+#include "object.h"
+#include "pool.h"
+#include "program.h"
+#include "rule.h"
+#include "schema.h"
+#include "stats.h"
+
+namespace Monty {
+
+class MappedFile;
+
+/* Many rules evaluated together against one message.  Every rule is compiled
+ * into a single program with shared predicates, so each distinct lookup key
+ * is fetched, and each distinct comparison evaluated, at most once per
+ * message no matter how many rules use it.  The rules' trees are parsed
+ * through one Pool, so they share identical subtrees too.
+ *
+ * Each rule also records the keys it needs: following ifFalse down from its
+ * top, the keys without which every condition passed is false.  A message
+ * parsed against the set's schema carries a bit per key present, and for
+ * every needed key it lacks, the rules needing it are marked 64 at a time.
+ * Those rules skip straight to the statement their conditions would have
+ * fallen through to.
+ *
+ * A set loaded by RuleCache runs its program straight from the mapped cache
+ * file and has no Rule trees; rules can't be added to it. */
+class RuleSet: public Object {
+    friend class RuleCache;
+
+    std::shared_ptr<Pool> pool;
+    std::vector<std::shared_ptr<Rule> > rules;
+    Program program;
+    Compiler compiler;
+    Schema schema;
+    std::unique_ptr<MappedFile> mapping;
+    std::unique_ptr<Native> native;
+    std::vector<std::shared_ptr<RuleStats> > stats;
+    std::vector<std::vector<std::string> > required;
+    std::vector<const AST::Statement *> fallbacks;
+    std::vector<std::vector<uint64_t> > needers;
+    std::vector<uint32_t> neededSlots;
+    size_t markedPredicates;
+    bool prefilter;
+
+public:
+    RuleSet();
+    ~RuleSet();
+
+    size_t add(const std::string & json);
+    size_t size() const { return program.numEntries(); }
+
+    // only for sets built with add()
+    const Rule & getRule(size_t i) const { return *rules[i]; }
+    const Program & getProgram() const { return program; }
+
+    // what the rules' trees share
+    const Pool & getPool() const { return *pool; }
+
+    // the keys rule i needs, none if it was loaded from a cache
+    const std::vector<std::string> & getRequired(size_t i) const;
+
+    /* Whether rules are skipped for messages missing keys they need; on by
+     * default.  Only the program and tree engines skip; native code runs
+     * every rule. */
+    void setPrefilter(bool on) { prefilter = on; }
+
+    /* Builds the program into native code, used by exec from then on until
+     * another rule is added.  Throws CompileError. */
+    void compileNative();
+    bool isNative() const { return native.get() != NULL; }
+
+    /* Starts collecting RuleStats for every rule, including rules added
+     * later.  While they are collected exec walks each rule's tree instead
+     * of running the program; a mapped set has no trees, so only latency is
+     * recorded for it. */
+    void enableStats();
+    bool hasStats() const { return ! stats.empty(); }
+    const RuleStats & getStats(size_t i) const { return *stats[i]; }
+
+    // the stats of every rule as a json object, {"rules" : [...]}
+    void dumpStats(std::ostream & out) const;
+
+    /* Every key looked up by any rule in the set.  Parse messages against it
+     * to drop unreferenced fields and have lookups resolved by slot. */
+    const Schema & getSchema() const { return schema; }
+
+    std::vector<std::string> exec(const Message & msg) const;
+    void exec(const Message & msg, std::vector<std::string> & out) const;
+    void exec(const Message & msg, std::vector<std::string> & out, Frame & frame) const;
+
+    /* Walks every rule's tree instead of running the program.  Expressions
+     * the rules share are evaluated once per message, their results kept in
+     * memo.  Only for sets built with add(). */
+    void execTrees(const Message & msg, std::vector<std::string> & out, AST::Memo & memo) const;
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    void markText();
+    void guard(size_t i);
+    const uint64_t * skipped(const Message & msg) const;
+    void execStats(const Message & msg, std::vector<std::string> & out, Frame & frame) const;
+
+    RuleSet(const RuleSet &);
+    RuleSet & operator=(const RuleSet &);
+};
+
+}
+
+#endif
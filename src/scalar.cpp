@@ -0,0 +1,179 @@
+#include "scalar.h"
+
+#include <cstdlib>
+
+using namespace Monty;
+
+std::string ScalarType::names[] = {
+    "STRING",
+    "INTEGER",
+    "DOUBLE",
+    "BOOLEAN",
+};
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline int64_t truncate(double d)
+{
+    if (! (d > (double)INT64_MIN)) return d != d ? 0 : INT64_MIN;
+    if (! (d < (double)INT64_MAX)) return INT64_MAX;
+
+    return (int64_t)d;
+}
+
+/* Parses the leading number of s the way strtoll/strtod would, returning
+ * false if it only fits in a double. */
+static bool parseNumber(const char * s, size_t len, int64_t & integer, double & real)
+{
+    size_t i = 0;
+
+    while (i < len && isSpace(s[i])) i++;
+
+    size_t start = i;
+    bool negative = false;
+
+    if (i < len && (s[i] == '-' || s[i] == '+')) {
+        negative = s[i] == '-';
+        i++;
+    }
+
+    uint64_t magnitude = 0;
+    bool overflow = false;
+    size_t digits = i;
+
+    for (; i < len && isDigit(s[i]); i++) {
+        unsigned d = s[i] - '0';
+
+        if (magnitude > (UINT64_MAX - d) / 10) overflow = true;
+        magnitude = magnitude * 10 + d;
+    }
+
+    bool fraction = i < len && s[i] == '.';
+    bool exponent = false;
+
+    if (fraction) {
+        for (i++; i < len && isDigit(s[i]); i++);
+    }
+
+    if (i > digits && i < len && (s[i] == 'e' || s[i] == 'E')) {
+        size_t j = i + 1;
+
+        if (j < len && (s[j] == '-' || s[j] == '+')) j++;
+
+        if (j < len && isDigit(s[j])) {
+            exponent = true;
+            for (i = j; i < len && isDigit(s[i]); i++);
+        }
+    }
+
+    if (! overflow && ! fraction && ! exponent) {
+        uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+
+        if (magnitude <= limit) {
+            integer = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+            real = (double)integer;
+            return true;
+        }
+    }
+
+    // strtod wants a terminated string
+    std::string number(s + start, i - start);
+
+    real = strtod(number.c_str(), NULL);
+    integer = truncate(real);
+
+    return false;
+}
+
+void Scalar::setText(const char * s, size_t len)
+{
+    text.assign(s, len);
+    atom = NULL;
+    hashed = false;
+}
+
+void Scalar::intern(Interner & interner)
+{
+    hash = Interner::hash(text.data(), text.size());
+    hashed = true;
+    atom = interner.intern(text.data(), text.size(), hash);
+}
+
+/* A miss still leaves the hash, which tells this value apart from any
+ * interned constant without reading bytes. */
+void Scalar::find(const Interner & interner)
+{
+    hash = Interner::hash(text.data(), text.size());
+    hashed = true;
+    atom = interner.find(text.data(), text.size(), hash);
+}
+
+void Scalar::setString(const char * s, size_t len)
+{
+    type = Scalar::Type::STRING;
+    setText(s, len);
+    integral = parseNumber(s, len, integer, real);
+}
+
+/* s is the text of a json number; it is kept as is for rendering. */
+void Scalar::setNumber(const char * s, size_t len)
+{
+    integral = parseNumber(s, len, integer, real);
+    type = integral ? Scalar::Type::INTEGER : Scalar::Type::DOUBLE;
+    setText(s, len);
+}
+
+void Scalar::setInteger(int64_t i)
+{
+    type = Scalar::Type::INTEGER;
+    integral = true;
+    integer = i;
+    real = (double)i;
+
+    std::string s(std::to_string((long long)i));
+    setText(s.data(), s.size());
+}
+
+void Scalar::setDouble(double d, const char * s, size_t len)
+{
+    type = Scalar::Type::DOUBLE;
+    integral = false;
+    integer = truncate(d);
+    real = d;
+    setText(s, len);
+}
+
+void Scalar::setDouble(double d)
+{
+    std::string s(std::to_string((long double)d));
+
+    setDouble(d, s.data(), s.size());
+}
+
+void Scalar::setBoolean(bool b)
+{
+    type = Scalar::Type::BOOLEAN;
+    integral = true;
+    integer = b;
+    real = b;
+    setText(b ? "1" : "0", 1);
+}
+
+void Scalar::clear()
+{
+    type = Scalar::Type::STRING;
+    integral = true;
+    integer = 0;
+    real = 0;
+    text.clear();
+    atom = NULL;
+    hashed = false;
+}
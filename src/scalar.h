@@ -0,0 +1,99 @@
+#ifndef MONTY_SCALAR_H
+#define MONTY_SCALAR_H
+
+#include <cstring>
+#include <string>
+#include <stdint.h>
+
+#include "interner.h"
+#include "object.h"
+
+namespace Monty {
+
+namespace ScalarType {
+    extern std::string names[];
+}
+
+/* A single field or constant value.  The native value is kept next to its
+ * text form: numbers are parsed once, when the scalar is set, so numeric
+ * comparisons never touch the text and string comparisons never format
+ * numbers.
+ *
+ * Strings get the numeric value of their leading number, as atoi would, but
+ * without truncating 64 bit integers or fractions.
+ *
+ * A scalar that is compared as text against interned constants can be
+ * hashed and pointed at the canonical copy of its text; see textEquals(). */
+class Scalar: public Object {
+public:
+    enum Type {
+        STRING,
+        INTEGER,
+        DOUBLE,
+        BOOLEAN,
+        NUM_ITEMS,
+    };
+
+private:
+    Scalar::Type type;
+    bool integral;
+    bool hashed;
+    int64_t integer;
+    double real;
+    std::string text;
+    const std::string * atom;
+    uint64_t hash;
+
+public:
+    Scalar() : type(Scalar::Type::STRING), integral(true), hashed(false), integer(0), real(0), atom(NULL), hash(0) { }
+    Scalar(const std::string & s) : hash(0) { setString(s.data(), s.size()); }
+
+    void setString(const char * s, size_t len);
+    void setNumber(const char * s, size_t len);
+    void setInteger(int64_t i);
+    void setDouble(double d, const char * s, size_t len);
+    void setDouble(double d);
+    void setBoolean(bool b);
+    void clear();
+
+    // adds the text to interner, as Parser does for constants
+    void intern(Interner & interner);
+
+    /* Hashes the text and points at its canonical copy in interner, if it
+     * has one; Message does this for values compared as text.  Setting the
+     * scalar again undoes both. */
+    void find(const Interner & interner);
+
+    Scalar::Type getType() const { return type; }
+    const std::string & getText() const { return text; }
+
+    // true when the numeric value is held exactly by getInteger()
+    bool isIntegral() const { return integral; }
+    int64_t getInteger() const { return integer; }
+    double getDouble() const { return real; }
+
+    bool isInterned() const { return atom != NULL; }
+
+    /* The same canonical copy means equal text, and different hashes mean
+     * different text; otherwise lengths and then bytes are compared.  Atoms
+     * from different interners never match, so they only fall through. */
+    bool textEquals(const Scalar & other) const
+    {
+        if (atom && atom == other.atom) return true;
+        if (hashed && other.hashed && hash != other.hash) return false;
+
+        return text.size() == other.text.size() && memcmp(text.data(), other.text.data(), text.size()) == 0;
+    }
+
+    virtual void print(std::ostream & out) const
+    {
+        out << text;
+    }
+
+private:
+    void setText(const char * s, size_t len);
+};
+
+}
+
+#endif
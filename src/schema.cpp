@@ -0,0 +1,238 @@
+#include "schema.h"
+#include "hash.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+using namespace Monty;
+
+static inline uint64_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static inline uint64_t displace(uint64_t h, uint32_t d)
+{
+    return mix(h + d * 0x9e3779b97f4a7c15ULL);
+}
+
+static size_t pow2(size_t n)
+{
+    size_t p = 1;
+
+    while (p < n) p <<= 1;
+
+    return p;
+}
+
+// seeds tried before falling back to find(), and how often each may double the table
+static const uint32_t maxSeeds = 4;
+static const int maxGrowth = 4;
+
+Schema::Schema() : interner(NULL), mask(0), seed(Hash::basis), built(true)
+{
+}
+
+size_t Schema::add(const std::string & key)
+{
+    std::map<std::string, size_t>::const_iterator it = index.find(key);
+
+    if (it != index.end()) return it->second;
+
+    keys.push_back(key);
+    textCompares.push_back(0);
+    keyRoots.push_back(-1);
+    keySegments.push_back(std::vector<std::string>());
+    built = false;
+
+    if (isPath(key)) {
+        std::vector<std::string> & segments = keySegments.back();
+
+        split(key, segments);
+
+        std::vector<std::string>::const_iterator r = std::find(roots.begin(), roots.end(), segments[0]);
+
+        keyRoots.back() = r - roots.begin();
+        if (r == roots.end()) roots.push_back(segments[0]);
+
+        segments.erase(segments.begin());
+    }
+
+    return index[key] = keys.size() - 1;
+}
+
+void Schema::build()
+{
+    std::vector<uint64_t> hashes(keys.size());
+    std::vector<uint64_t> sorted;
+
+    built = false;
+
+    for (uint32_t attempt = 0; attempt < maxSeeds && ! built; attempt++) {
+        seed = attempt ? mix(Hash::basis + attempt) : Hash::basis;
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            hashes[i] = Hash::fnv1a(keys[i].data(), keys[i].size(), seed);
+        }
+
+        sorted = hashes;
+        std::sort(sorted.begin(), sorted.end());
+
+        if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) continue;
+
+        built = place(hashes);
+    }
+}
+
+bool Schema::place(const std::vector<uint64_t> & hashes)
+{
+    size_t nbuckets = pow2(std::max<size_t>(1, keys.size() / 4));
+    size_t m = pow2(keys.size() + keys.size() / 4 + 1);
+
+    for (int growth = 0; growth <= maxGrowth; growth++, m <<= 1) {
+        std::vector<std::vector<uint32_t> > buckets(nbuckets);
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            buckets[hashes[i] & (nbuckets - 1)].push_back(i);
+        }
+
+        // remember which bucket is which before sorting largest first
+        std::vector<std::pair<size_t, size_t> > order;
+        for (size_t b = 0; b < nbuckets; b++) {
+            order.push_back(std::make_pair(buckets[b].size(), b));
+        }
+        std::sort(order.rbegin(), order.rend());
+
+        displacements.assign(nbuckets, 0);
+        table.assign(m, -1);
+        mask = m - 1;
+
+        bool ok = true;
+        std::vector<uint64_t> positions;
+
+        for (size_t o = 0; o < order.size() && ok; o++) {
+            const std::vector<uint32_t> & bucket = buckets[order[o].second];
+
+            if (bucket.empty()) break;
+
+            uint32_t d;
+            for (d = 0; d < (1u << 16); d++) {
+                positions.clear();
+
+                size_t j;
+                for (j = 0; j < bucket.size(); j++) {
+                    uint64_t p = displace(hashes[bucket[j]], d) & mask;
+
+                    if (table[p] != -1 || std::find(positions.begin(), positions.end(), p) != positions.end()) break;
+
+                    positions.push_back(p);
+                }
+
+                if (j == bucket.size()) break;
+            }
+
+            if (d == (1u << 16)) {
+                ok = false;
+                break;
+            }
+
+            displacements[order[o].second] = d;
+            for (size_t j = 0; j < bucket.size(); j++) {
+                table[positions[j]] = bucket[j];
+            }
+        }
+
+        if (ok) return true;
+    }
+
+    return false;
+}
+
+int Schema::slot(const char * key, size_t len) const
+{
+    if (! built) return find(key, len);
+
+    if (keys.empty()) return -1;
+
+    uint64_t h = Hash::fnv1a(key, len, seed);
+    int32_t s = table[displace(h, displacements[h & (displacements.size() - 1)]) & mask];
+
+    if (s < 0) return -1;
+
+    const std::string & k = keys[s];
+
+    if (k.size() != len || memcmp(k.data(), key, len) != 0) return -1;
+
+    return s;
+}
+
+bool Schema::isPath(const std::string & key)
+{
+    return (! key.empty() && key[0] == '/') || key.find('.') != std::string::npos;
+}
+
+void Schema::split(const std::string & key, std::vector<std::string> & segments)
+{
+    segments.clear();
+
+    if (key.empty() || key[0] != '/') {
+        for (size_t start = 0;;) {
+            size_t dot = key.find('.', start);
+
+            segments.push_back(key.substr(start, dot - start));
+
+            if (dot == std::string::npos) return;
+
+            start = dot + 1;
+        }
+    }
+
+    for (size_t i = 0; i < key.size(); i++) {
+        if (key[i] == '/') {
+            segments.push_back(std::string());
+        } else if (key[i] == '~' && i + 1 < key.size() && (key[i + 1] == '0' || key[i + 1] == '1')) {
+            segments.back().push_back(key[++i] == '0' ? '~' : '/');
+        } else {
+            segments.back().push_back(key[i]);
+        }
+    }
+}
+
+/* Rules rarely reach into more than a few roots, so they are just searched. */
+int Schema::root(const char * key, size_t len) const
+{
+    for (size_t i = 0; i < roots.size(); i++) {
+        if (roots[i].size() == len && memcmp(roots[i].data(), key, len) == 0) return i;
+    }
+
+    return -1;
+}
+
+int Schema::find(const char * key, size_t len) const
+{
+    std::map<std::string, size_t>::const_iterator it = index.find(std::string(key, len));
+
+    return it != index.end() ? (int)it->second : -1;
+}
+
+void Schema::print(std::ostream & out) const
+{
+    out << "Schema(";
+
+    for (std::vector<std::string>::const_iterator it = keys.begin(); it != keys.end(); it++) {
+        out << (it - keys.begin()) << " => " << *it;
+
+        if (it + 1 != keys.end()) {
+            out << ", ";
+        }
+    }
+
+    out << ")";
+}
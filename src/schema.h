@@ -0,0 +1,95 @@
+#ifndef MONTY_SCHEMA_H
+#define MONTY_SCHEMA_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "object.h"
+
+namespace Monty {
+
+class Interner;
+
+/* The universe of keys referenced by a set of rules, each assigned a dense
+ * slot.  build() generates a minimal-probe perfect hash (hash and displace)
+ * over the keys, so that resolving a key while parsing a message costs one
+ * hash, two table loads and a single key compare.  Keys whose hashes are
+ * equal can't be told apart by any displacement, so the keys are hashed
+ * again from another seed; if no table is found after a few seeds, slots
+ * are looked up in a map instead.
+ *
+ * A key may also be a path into nested values, dotted (user.geo.country) or
+ * a JSON Pointer (/items/0/sku).  The top level key a path starts from is
+ * its root; messages keep the raw json of every root any key needs.
+ *
+ * Each comparison of a key's value as text against a constant is counted.
+ * Messages look up the values of keys compared often enough in the
+ * interner the constants are in; see Scalar::find. */
+class Schema: public Object {
+    std::vector<std::string> keys;
+    std::vector<std::string> roots;
+    std::vector<int> keyRoots;
+    std::vector<std::vector<std::string> > keySegments;
+    std::map<std::string, size_t> index;
+    std::vector<uint32_t> displacements;
+    std::vector<int32_t> table;
+    std::vector<uint32_t> textCompares;
+    const Interner * interner;
+    uint64_t mask;
+    uint64_t seed;
+    bool built;
+
+public:
+    Schema();
+
+    size_t add(const std::string & key);
+    void build();
+
+    int slot(const char * key, size_t len) const;
+    int slot(const std::string & key) const { return slot(key.data(), key.size()); }
+
+    size_t size() const { return keys.size(); }
+    const std::string & key(size_t slot) const { return keys[slot]; }
+
+    void setInterner(const Interner * i) { interner = i; }
+    const Interner * getInterner() const { return interner; }
+
+    /* Below this many comparisons, hashing a value and looking it up costs
+     * more than comparing it byte by byte; see BM_TextCompare. */
+    static const uint32_t minTextCompares = 16;
+
+    void compareText(size_t slot) { textCompares[slot]++; }
+
+    // whether values in slot should be looked up in the interner
+    bool comparesText(size_t slot) const { return interner && textCompares[slot] >= minTextCompares; }
+
+    // true if key starts with / or contains a dot
+    static bool isPath(const std::string & key);
+
+    /* Splits a path into its segments, the first being the root.  JSON
+     * Pointer escapes (~0 and ~1) are decoded. */
+    static void split(const std::string & key, std::vector<std::string> & segments);
+
+    // the root a top level key is, or -1 if no path starts from it
+    int root(const char * key, size_t len) const;
+    size_t numRoots() const { return roots.size(); }
+
+    // the root of the path in slot and the segments below it; -1 if it isn't a path
+    int rootOf(size_t slot) const { return keyRoots[slot]; }
+    const std::vector<std::string> & segments(size_t slot) const { return keySegments[slot]; }
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    // fills table and displacements, false if no table was found
+    bool place(const std::vector<uint64_t> & hashes);
+
+    // used until build() has been called after the last add(), or if it failed
+    int find(const char * key, size_t len) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,324 @@
+#include "stats.h"
+#include "json_scanner.h"
+
+#include <chrono>
+#include <sstream>
+
+using namespace Monty;
+
+size_t Histogram::bucket(uint64_t nanos)
+{
+    if (nanos < (1u << subBits)) return nanos;
+
+    unsigned magnitude = 63 - __builtin_clzll(nanos);
+    unsigned sub = (nanos >> (magnitude - subBits)) & ((1u << subBits) - 1);
+
+    return ((magnitude - subBits + 1) << subBits) + sub;
+}
+
+uint64_t Histogram::lower(size_t bucket)
+{
+    if (bucket < (1u << subBits)) return bucket;
+
+    unsigned magnitude = (bucket >> subBits) + subBits - 1;
+    uint64_t sub = bucket & ((1u << subBits) - 1);
+
+    return (1ULL << magnitude) + (sub << (magnitude - subBits));
+}
+
+uint64_t Histogram::upper(size_t bucket)
+{
+    if (bucket + 1 >= buckets) return UINT64_MAX;
+
+    return lower(bucket + 1) - 1;
+}
+
+/* Writes the count weighted histogram as a json object: the mean and
+ * percentiles, then every non-empty bucket. */
+void Histogram::dump(std::ostream & out, const uint64_t * counts, uint64_t sum)
+{
+    uint64_t count = 0;
+
+    for (size_t i = 0; i < buckets; i++) count += counts[i];
+
+    out << "{";
+
+    if (count) {
+        const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        const char * names[] = { "p50", "p90", "p99", "p999" };
+        size_t q = 0;
+        uint64_t seen = 0;
+        size_t highest = 0;
+
+        out << "\"mean_ns\":" << sum / count;
+
+        // a quantile is reported as the top of the bucket it falls in
+        for (size_t i = 0; i < buckets; i++) {
+            if (! counts[i]) continue;
+
+            seen += counts[i];
+            highest = i;
+
+            while (q < 4 && seen >= quantiles[q] * count) {
+                out << ",\"" << names[q] << "_ns\":" << upper(i);
+                q++;
+            }
+        }
+
+        out << ",\"max_ns\":" << upper(highest) << ",\"buckets\":[";
+
+        bool first = true;
+        for (size_t i = 0; i < buckets; i++) {
+            if (! counts[i]) continue;
+
+            out << (first ? "" : ",") << "[" << lower(i) << "," << counts[i] << "]";
+            first = false;
+        }
+
+        out << "]";
+    }
+
+    out << "}";
+}
+
+namespace {
+
+// a small dense number per thread, so threads spread over the shards
+std::atomic<unsigned> nextThread(0);
+
+unsigned threadIndex()
+{
+    static thread_local unsigned self = nextThread++;
+
+    return self;
+}
+
+const char * kinds[] = {
+    "value",
+    "lookup",
+    "binary",
+    "logical",
+    "conditional",
+    "production",
+    "constant",
+};
+
+}
+
+RuleStats::Shard::Shard(size_t n) : counters(new std::atomic<uint64_t>[n])
+{
+    for (size_t i = 0; i < n; i++) counters[i].store(0, std::memory_order_relaxed);
+}
+
+RuleStats::RuleStats(const AST::Statement * statement)
+{
+    if (statement) {
+        std::vector<AST::Base *> all;
+
+        AST::flatten(const_cast<AST::Statement *>(statement), all);
+
+        for (std::vector<AST::Base *>::const_iterator it = all.begin(); it != all.end(); it++) {
+            AST::Base::Kind k = (*it)->kind();
+
+            // arguments are read, not evaluated
+            if (k == AST::Base::Kind::VALUE || k == AST::Base::Kind::LOOKUP) continue;
+
+            // a node shared within the tree is counted once
+            if (index.insert(std::make_pair(*it, (uint32_t)nodes.size())).second) nodes.push_back(*it);
+        }
+    }
+
+    width = nodes.size() * 2 + Histogram::buckets + 1;
+
+    for (size_t i = 0; i < maxShards; i++) shards[i].store(NULL);
+}
+
+RuleStats::~RuleStats()
+{
+    for (size_t i = 0; i < maxShards; i++) delete shards[i].load();
+}
+
+RuleStats::Shard & RuleStats::shard() const
+{
+    std::atomic<Shard *> & slot = shards[threadIndex() % maxShards];
+    Shard * s = slot.load(std::memory_order_acquire);
+
+    if (s) return *s;
+
+    // another thread on the same shard may get there first
+    Shard * fresh = new Shard(width);
+
+    if (slot.compare_exchange_strong(s, fresh)) return *fresh;
+
+    delete fresh;
+
+    return *s;
+}
+
+uint64_t RuleStats::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void RuleStats::count(Shard & s, const AST::Base * node, bool held) const
+{
+    uint32_t i = index.find(node)->second;
+
+    s.counters[i * 2].fetch_add(1, std::memory_order_relaxed);
+    if (held) s.counters[i * 2 + 1].fetch_add(1, std::memory_order_relaxed);
+}
+
+void RuleStats::exec(const Message & msg, std::string & out) const
+{
+    Shard & s = shard();
+    uint64_t start = now();
+
+    statement(s, static_cast<const AST::Statement *>(nodes[0]), msg, out);
+
+    uint64_t elapsed = now() - start;
+
+    s.counters[nodes.size() * 2 + Histogram::bucket(elapsed)].fetch_add(1, std::memory_order_relaxed);
+    s.counters[width - 1].fetch_add(elapsed, std::memory_order_relaxed);
+}
+
+void RuleStats::record(uint64_t nanos) const
+{
+    Shard & s = shard();
+
+    s.counters[nodes.size() * 2 + Histogram::bucket(nanos)].fetch_add(1, std::memory_order_relaxed);
+    s.counters[width - 1].fetch_add(nanos, std::memory_order_relaxed);
+}
+
+void RuleStats::statement(Shard & s, const AST::Statement * node, const Message & msg, std::string & out) const
+{
+    if (node->kind() == AST::Base::Kind::CONDITIONAL) {
+        const AST::Conditional * c = static_cast<const AST::Conditional *>(node);
+        bool held = expression(s, c->getCondition(), msg);
+
+        count(s, node, held);
+        statement(s, held ? c->getIfTrue() : c->getIfFalse(), msg, out);
+    } else {
+        count(s, node, true);
+        node->exec(msg, out);
+    }
+}
+
+bool RuleStats::expression(Shard & s, const AST::Expression * node, const Message & msg) const
+{
+    bool held;
+
+    if (node->kind() == AST::Base::Kind::LOGICAL) {
+        const AST::Logical * l = static_cast<const AST::Logical *>(node);
+        const std::vector<AST::Expression *> & clauses = l->getClauses();
+        std::vector<size_t> order = l->getOrder();
+        bool all = l->getType() == AST::Logical::Type::AND;
+
+        // short circuits in the order Logical::eval has learned; its
+        // occasional sampling of every clause isn't reproduced
+        held = all;
+        for (std::vector<size_t>::const_iterator it = order.begin(); it != order.end(); it++) {
+            if (expression(s, clauses[*it], msg) != all) {
+                held = ! all;
+                break;
+            }
+        }
+    } else {
+        held = node->eval(msg);
+    }
+
+    count(s, node, held);
+
+    return held;
+}
+
+void RuleStats::merge(std::vector<uint64_t> & totals) const
+{
+    totals.assign(width, 0);
+
+    for (size_t i = 0; i < maxShards; i++) {
+        Shard * s = shards[i].load(std::memory_order_acquire);
+
+        if (! s) continue;
+
+        for (size_t j = 0; j < width; j++) totals[j] += s->counters[j].load(std::memory_order_relaxed);
+    }
+}
+
+uint64_t RuleStats::getCount() const
+{
+    std::vector<uint64_t> totals;
+    uint64_t count = 0;
+
+    merge(totals);
+
+    for (size_t i = 0; i < Histogram::buckets; i++) count += totals[nodes.size() * 2 + i];
+
+    return count;
+}
+
+uint64_t RuleStats::getEvaluations(const AST::Base * node) const
+{
+    std::unordered_map<const AST::Base *, uint32_t>::const_iterator it = index.find(node);
+    std::vector<uint64_t> totals;
+
+    if (it == index.end()) return 0;
+
+    merge(totals);
+
+    return totals[it->second * 2];
+}
+
+uint64_t RuleStats::getHits(const AST::Base * node) const
+{
+    std::unordered_map<const AST::Base *, uint32_t>::const_iterator it = index.find(node);
+    std::vector<uint64_t> totals;
+
+    if (it == index.end()) return 0;
+
+    merge(totals);
+
+    return totals[it->second * 2 + 1];
+}
+
+void RuleStats::dump(std::ostream & out) const
+{
+    std::vector<uint64_t> totals;
+    merge(totals);
+
+    const uint64_t * histogram = &totals[nodes.size() * 2];
+    uint64_t count = 0;
+
+    for (size_t i = 0; i < Histogram::buckets; i++) count += histogram[i];
+
+    out << "{\"count\":" << count << ",\"latency\":";
+    Histogram::dump(out, histogram, totals[width - 1]);
+    out << ",\"nodes\":[";
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        AST::Base::Kind k = nodes[i]->kind();
+        uint64_t evaluations = totals[i * 2];
+        uint64_t held = totals[i * 2 + 1];
+        std::ostringstream text;
+
+        text << *nodes[i];
+
+        out << (i ? "," : "") << "{\"id\":" << i << ",\"kind\":\"" << kinds[k] << "\",\"evaluations\":" << evaluations;
+
+        if (k == AST::Base::Kind::CONDITIONAL) {
+            out << ",\"true\":" << held << ",\"false\":" << evaluations - held;
+        } else if (k != AST::Base::Kind::PRODUCTION) {
+            out << ",\"hits\":" << held << ",\"hit_rate\":" << (evaluations ? (double)held / evaluations : 0);
+        }
+
+        out << ",\"node\":";
+        JsonScanner::quote(out, text.str());
+        out << "}";
+    }
+
+    out << "]}";
+}
+
+void RuleStats::print(std::ostream & out) const
+{
+    out << "RuleStats(nodes=" << nodes.size() << ")";
+}
@@ -0,0 +1,96 @@
+#ifndef MONTY_STATS_H
+#define MONTY_STATS_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "ast.h"
+#include "message.h"
+#include "object.h"
+
+namespace Monty {
+
+/* Latency buckets in the style of HDR histograms: exact below 2^subBits
+ * nanoseconds, then 2^subBits linear sub-buckets per power of two, so every
+ * recorded value is within about 6% of its bucket's bounds. */
+namespace Histogram {
+    static const unsigned subBits = 4;
+    static const size_t buckets = (64 - subBits + 1) << subBits;
+
+    size_t bucket(uint64_t nanos);
+    uint64_t lower(size_t bucket);
+    uint64_t upper(size_t bucket);
+
+    // counts holds one entry per bucket; sum is the total of the values
+    void dump(std::ostream & out, const uint64_t * counts, uint64_t sum);
+}
+
+/* Runtime counters for one rule: how often each Conditional, Logical,
+ * Binary, Constant and Production in its tree is evaluated and how often
+ * each condition held, and a histogram of the time each evaluation took.
+ * Logicals are short circuited in the order they currently evaluate their
+ * clauses, so the counts describe the clauses production actually runs.
+ *
+ * Counters are kept in per-thread shards, each allocated on first use and
+ * only ever added to, so recording takes no lock and threads don't share
+ * cache lines.  Shards are summed whenever statistics are read. */
+class RuleStats: public Object {
+    struct Shard {
+        // evaluations and trues per node, then the histogram, then the sum
+        std::unique_ptr<std::atomic<uint64_t>[]> counters;
+
+        Shard(size_t n);
+    };
+
+    static const size_t maxShards = 64;
+
+    std::vector<const AST::Base *> nodes;
+    std::unordered_map<const AST::Base *, uint32_t> index;
+    size_t width;
+    mutable std::atomic<Shard *> shards[maxShards];
+
+public:
+    /* Counts the nodes of statement, which must outlive the stats.  Without
+     * a statement only latency is recorded. */
+    RuleStats(const AST::Statement * statement = NULL);
+    ~RuleStats();
+
+    /* Evaluates the statement as Statement::exec does, appending to out,
+     * while counting every node and timing the whole. */
+    void exec(const Message & msg, std::string & out) const;
+
+    // records one evaluation, made some other way, that took nanos
+    void record(uint64_t nanos) const;
+
+    static uint64_t now();
+
+    // merged totals; each call sums every shard
+    uint64_t getCount() const;
+    uint64_t getEvaluations(const AST::Base * node) const;
+    uint64_t getHits(const AST::Base * node) const;
+
+    /* Writes the merged counters as a json object: the evaluation count and
+     * latency percentiles, and a record per node. */
+    void dump(std::ostream & out) const;
+
+    virtual void print(std::ostream & out) const;
+
+private:
+    Shard & shard() const;
+    void merge(std::vector<uint64_t> & totals) const;
+
+    void statement(Shard & s, const AST::Statement * node, const Message & msg, std::string & out) const;
+    bool expression(Shard & s, const AST::Expression * node, const Message & msg) const;
+    void count(Shard & s, const AST::Base * node, bool held) const;
+
+    RuleStats(const RuleStats &);
+    RuleStats & operator=(const RuleStats &);
+};
+
+}
+
+#endif
@@ -1,16 +1,97 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <json/json.h>
+
+#include "arena.h"
 #include "ast.h"
+#include "batch.h"
+#include "cache.h"
+#include "compiler.h"
+#include "dispatcher.h"
+#include "generator.h"
+#include "hash.h"
+#include "http_transport.h"
+#include "interner.h"
+#include "json_scanner.h"
+#include "live_ruleset.h"
+#include "loopback.h"
+#include "native.h"
+#include "optimizer.h"
+#include "parse_error.h"
+#include "parser.h"
+#include "pool.h"
+#include "processor.h"
+#include "production_cache.h"
+#include "rule.h"
+#include "ruleset.h"
+#include "stats.h"
+#include "url.h"
+
+// every heap allocation the tests make, so they can check there are none
+static std::atomic<size_t> allocations(0);
+
+/* All the forms are replaced, so that nothing allocated by one family is
+ * freed by another.  The deletes are out of line, or gcc sees free() meet
+ * operator new and warns. */
+static void * allocate(size_t size)
+{
+    allocations++;
+
+    return malloc(size ? size : 1);
+}
+
+void * operator new(size_t size)
+{
+    void * p = allocate(size);
+    if (! p) throw std::bad_alloc();
+
+    return p;
+}
+
+void * operator new[](size_t size) { return operator new(size); }
+void * operator new(size_t size, const std::nothrow_t &) noexcept { return allocate(size); }
+void * operator new[](size_t size, const std::nothrow_t &) noexcept { return allocate(size); }
+
+__attribute__((noinline)) void operator delete(void * p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void * p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void * p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void * p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void * p, const std::nothrow_t &) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void * p, const std::nothrow_t &) noexcept { free(p); }
 
 namespace Monty {
 namespace AST {
 
-std::shared_ptr<Value> mv(const char * str)
+// holds the nodes the tests build by hand
+Arena arena;
+
+Value * mv(const char * str)
 {
-    return std::shared_ptr<Value>(new Value(str));
+    return arena.make<Value>(str);
 }
 
 
+Lookup * ml(const char * str)
+{
+    return arena.make<Lookup>(str);
+}
+
 TEST(Binary,TestingWorks) {
     EXPECT_EQ(1,1);
 }
@@ -45,7 +126,1752 @@ TEST(Binary,EQ) {
 
     Binary b2(Binary::Type::EQ, mv("4"), mv("4") );
     EXPECT_TRUE(b2.eval(m));
+
+    Binary b3(Binary::Type::EQ, mv("4"), mv("4bar") );
+    EXPECT_TRUE(b3.eval(m));
+}
+
+TEST(Binary,Typed) {
+    Message m("{\"big\" : 9007199254740993, \"half\" : 1.5, \"yes\" : true}");
+
+    Binary b1(Binary::Type::EQ, ml("big"), mv("9007199254740993"));
+    EXPECT_TRUE(b1.eval(m));
+
+    Binary b2(Binary::Type::EQ, ml("big"), mv("9007199254740992"));
+    EXPECT_FALSE(b2.eval(m));
+
+    Binary b3(Binary::Type::GT, ml("half"), mv("1"));
+    EXPECT_TRUE(b3.eval(m));
+
+    Binary b4(Binary::Type::LT, ml("half"), mv("1.75"));
+    EXPECT_TRUE(b4.eval(m));
+
+    Binary b5(Binary::Type::EQ, ml("yes"), mv("1"));
+    EXPECT_TRUE(b5.eval(m));
+
+    Binary b6(Binary::Type::GT, mv("1e3"), mv("999"));
+    EXPECT_TRUE(b6.eval(m));
+
+    EXPECT_EQ(Scalar::Type::INTEGER, m.lookup("big").getType());
+    EXPECT_EQ(Scalar::Type::DOUBLE, m.lookup("half").getType());
+    EXPECT_EQ(Scalar::Type::BOOLEAN, m.lookup("yes").getType());
+    EXPECT_EQ(Scalar::Type::STRING, m.lookup("missing").getType());
+}
+
+Production * mp(const char * service, Arg * arg)
+{
+    std::vector<Arg *> path;
+    std::vector<std::pair<std::string, Arg *> > params;
+
+    path.push_back(mv("x"));
+    params.push_back(std::make_pair(std::string("v"), arg));
+
+    return arena.make<Production>(service, path, params);
+}
+
+TEST(Program,Logical) {
+    std::vector<Expression *> clauses;
+    clauses.push_back(arena.make<Binary>(Binary::Type::SEQ, ml("a"), mv("1")));
+    clauses.push_back(arena.make<Binary>(Binary::Type::GT, ml("b"), mv("5")));
+
+    const char * msgs[] = {
+        "{}",
+        "{\"a\" : \"1\"}",
+        "{\"b\" : 6}",
+        "{\"a\" : \"1\", \"b\" : 6}",
+    };
+
+    for (int t = 0; t < Logical::Type::NUM_ITEMS; t++) {
+        Expression * l = arena.make<Logical>((Logical::Type)t, clauses);
+        Conditional c(l, mp("yes", ml("a")), mp("no", ml("b")));
+
+        Program p;
+        Compiler compiler(p);
+        compiler.compile(&c);
+
+        for (size_t i = 0; i < sizeof(msgs) / sizeof(msgs[0]); i++) {
+            Message m(msgs[i]);
+            EXPECT_EQ(c.exec(m), p.exec(m));
+        }
+    }
+}
+
+TEST(Program,Switch) {
+    const char * tests[][3] = {
+        { "SEQ", "k", "a" },
+        { "EQ", "7", "k" },
+        { "EQ", "k", "2.5" },
+        { "SEQ", "k", "7" },
+        { "SEQ", "k", "a" },
+        { "EQ", "k", "-3" },
+        { "SEQ", "other", "x" },
+    };
+    size_t n = sizeof(tests) / sizeof(tests[0]);
+
+    // a ladder of six tests of k, ending in a test of another field
+    Statement * s = mp("none", ml("k"));
+
+    for (size_t i = n; i-- > 0;) {
+        Binary::Type type = tests[i][0][0] == 'S' ? Binary::Type::SEQ : Binary::Type::EQ;
+        Arg * left = strcmp(tests[i][1], "k") && strcmp(tests[i][1], "other") ? (Arg *)mv(tests[i][1]) : (Arg *)ml(tests[i][1]);
+        Arg * right = strcmp(tests[i][2], "k") ? (Arg *)mv(tests[i][2]) : (Arg *)ml(tests[i][2]);
+
+        s = arena.make<Conditional>(arena.make<Binary>(type, left, right), mp(("case" + std::to_string((long long)i)).c_str(), ml("k")), s);
+    }
+
+    Program p;
+    Compiler compiler(p);
+    compiler.compile(s);
+
+    ASSERT_EQ(1u, p.switches.size());
+    EXPECT_EQ(6u, p.cases.size());
+
+    Native native(p);
+
+    const char * values[] = { "\"a\"", "7", "7.0", "\"7\"", "2.5", "\"2.5\"", "-3", "-3.0", "true", "\"b\"", "\"x\"", "0" };
+    std::vector<std::string> msgs;
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        msgs.push_back(std::string("{\"k\" : ") + values[i] + "}");
+        msgs.push_back(std::string("{\"k\" : ") + values[i] + ", \"other\" : \"x\"}");
+    }
+    msgs.push_back("{}");
+
+    std::vector<std::string> out;
+
+    for (size_t i = 0; i < msgs.size(); i++) {
+        Message m(msgs[i]);
+
+        EXPECT_EQ(s->exec(m), p.exec(m)) << msgs[i];
+
+        native.exec(m, out);
+        EXPECT_EQ(s->exec(m), out[0]) << msgs[i];
+    }
+
+    // a short ladder stays a chain of comparisons
+    Program q;
+    Compiler(q).compile(arena.make<Conditional>(arena.make<Binary>(Binary::Type::SEQ, ml("k"), mv("a")), mp("a", ml("k")), mp("b", ml("k"))));
+    EXPECT_TRUE(q.switches.empty());
+}
+
+std::string parseError(const std::string & json)
+{
+    Arena arena;
+    Parser p(arena);
+
+    try {
+        p.parse(json);
+    } catch (const ParseError & pe) {
+        std::ostringstream out;
+        out << pe;
+        return out.str();
+    }
+
+    return "";
+}
+
+TEST(Parser,Errors) {
+    std::string production = "[\"production\", { \"service\" : \"s\", \"path\" : [], \"params\" : [] }]";
+
+    EXPECT_EQ("parseError(object is null @<conditional>.ifTrue)",
+        parseError("[\"conditional\", { \"condition\" : [\"binary\", { \"type\" : \"EQ\", \"left\" : [\"value\", { \"value\" : 1 }], \"right\" : [\"value\", { \"value\" : 1 }] }], \"ifFalse\" : " + production + " }]"));
+    EXPECT_EQ("parseError(unknown type @<conditional>.condition)",
+        parseError("[\"conditional\", { \"ifTrue\" : " + production + ", \"condition\" : [\"ternary\", {}] }]"));
+    EXPECT_EQ("parseError(key @<binary>.left<lookup>.)",
+        parseError("[\"binary\", { \"type\" : \"SEQ\", \"left\" : [\"lookup\", { \"kee\" : \"a\" }] }]"));
+    EXPECT_EQ("parseError(type @<binary>.)", parseError("[\"binary\", { \"type\" : \"XOR\" }]"));
+    EXPECT_EQ("parseError(param keys must be strings @<production>.params[1])",
+        parseError("[\"production\", { \"service\" : \"s\", \"path\" : [], \"params\" : [[\"a\", [\"value\", { \"value\" : 1 }]], [2, [\"value\", { \"value\" : 1 }]]] }]"));
+    EXPECT_EQ("parseError(no params @<production>.)", parseError("[\"production\", { \"service\" : 7, \"path\" : [] }]"));
+    EXPECT_EQ("parseError(service isn't a string @<production>.)", parseError("[\"production\", { \"service\" : 7, \"path\" : [], \"params\" : [] }]"));
+    EXPECT_EQ("parseError(clauses is empty @<logical>.)", parseError("[\"logical\", { \"type\" : \"AND\", \"clauses\" : [] }]"));
+    EXPECT_EQ("parseError(object doesn't have len 2 @)", parseError("[\"value\"]"));
+    EXPECT_EQ("parseError(object is null @)", parseError(""));
+    EXPECT_EQ("parseError(invalid json @<production>.)", parseError("[\"production\", { \"service\" : \"s\""));
+    EXPECT_EQ("parseError(trailing data @)", parseError(production + " []"));
+
+    // separators are part of the grammar
+    EXPECT_EQ("parseError(invalid json @)",
+        parseError("[\"production\" { \"service\" \"s\" \"path\" [] \"params\" [] }]"));
+    EXPECT_EQ("parseError(invalid json @<production>.)",
+        parseError("[\"production\", { \"service\" \"s\", \"path\" : [], \"params\" : [] }]"));
+    EXPECT_EQ("parseError(invalid json @<value>.)",
+        parseError("[\"value\", { \"value\" : 1,,,, }]"));
+    EXPECT_EQ("parseError(invalid json @<value>.)",
+        parseError("[\"value\", { \"value\" : 1, }]"));
+    EXPECT_EQ("parseError(invalid json @<production>.path)",
+        parseError("[\"production\", { \"service\" : \"s\", \"path\" : [[\"value\", { \"value\" : 1 }],], \"params\" : [] }]"));
+    EXPECT_EQ("parseError(invalid json @<production>.)",
+        parseError("[\"production\", { \"service\" : \"s\", \"path\" : [], \"params\" : [], \"x\" : [1 2] }]"));
+    EXPECT_EQ("parseError(invalid json @<production>.path)",
+        parseError("[\"production\", { \"service\" : \"s\", \"path\" : [}, \"params\" : [] }]"));
+}
+
+TEST(Parser,WrongKind) {
+    std::string production = "[\"production\", { \"service\" : \"s\", \"path\" : [], \"params\" : [] }]";
+    std::string value = "[\"value\", { \"value\" : 1 }]";
+    std::string binary = "[\"binary\", { \"type\" : \"EQ\", \"left\" : " + value + ", \"right\" : " + value + " }]";
+
+    EXPECT_EQ("parseError(object isn't an expression @<conditional>.condition)",
+        parseError("[\"conditional\", { \"condition\" : " + value + ", \"ifTrue\" : " + production + " }]"));
+    EXPECT_EQ("parseError(object isn't a statement @<conditional>.ifTrue)",
+        parseError("[\"conditional\", { \"condition\" : " + binary + ", \"ifTrue\" : " + binary + " }]"));
+    EXPECT_EQ("parseError(object isn't an arg @<binary>.left)",
+        parseError("[\"binary\", { \"type\" : \"EQ\", \"left\" : " + production + ", \"right\" : " + value + " }]"));
+    EXPECT_EQ("parseError(object isn't an expression @<logical>.clauses[1])",
+        parseError("[\"logical\", { \"type\" : \"AND\", \"clauses\" : [" + binary + ", " + production + "] }]"));
+    EXPECT_EQ("parseError(object isn't an arg @<production>.path[0])",
+        parseError("[\"production\", { \"service\" : \"s\", \"path\" : [" + binary + "], \"params\" : [] }]"));
+
+    try {
+        Rule r(binary);
+        FAIL();
+    } catch (const ParseError & pe) {
+        std::ostringstream out;
+        out << pe;
+        EXPECT_EQ("parseError(rule isn't a statement @)", out.str());
+    }
+}
+
+TEST(Parser,Deep) {
+    // well past the 32 levels json-c allowed
+    Generator g(3);
+    std::string json = g.ladder(200, 4, 2);
+    Arena arena;
+    Parser p(arena);
+
+    Statement * s = static_cast<Statement *>(p.parse(json));
+    EXPECT_NE(std::string::npos, s->exec(Message("{\"k0\" : \"c199\"}")).find("match"));
+
+    std::string deep;
+    for (int i = 0; i < Parser::maxDepth; i++) deep += "[\"conditional\", { \"ifTrue\" : ";
+    EXPECT_EQ(0u, parseError(deep).find("parseError(object is nested too deeply @<conditional>.ifTrue<conditional>."));
+}
+
+TEST(Logical,Parses) {
+    std::string json =
+        "[\"conditional\", {"
+            "\"condition\" : [\"logical\", {"
+                "\"type\" : \"OR\","
+                "\"clauses\" : ["
+                    "[\"binary\", { \"type\" : \"SEQ\", \"left\" : [\"lookup\", { \"key\" : \"a\" }], \"right\" : [\"value\", { \"value\" : \"1\" }] }],"
+                    "[\"logical\", { \"type\" : \"AND\", \"clauses\" : ["
+                        "[\"binary\", { \"type\" : \"GT\", \"left\" : [\"lookup\", { \"key\" : \"b\" }], \"right\" : [\"value\", { \"value\" : 5 }] }],"
+                        "[\"binary\", { \"type\" : \"LT\", \"left\" : [\"lookup\", { \"key\" : \"b\" }], \"right\" : [\"value\", { \"value\" : 9 }] }]"
+                    "] }]"
+                "]"
+            "}],"
+            "\"ifTrue\" : [\"production\", { \"service\" : \"yes\", \"path\" : [], \"params\" : [] }],"
+            "\"ifFalse\" : [\"production\", { \"service\" : \"no\", \"path\" : [], \"params\" : [] }]"
+        "}]";
+
+    Rule tree(json);
+    Rule bytecode(json, Rule::Engine::BYTECODE);
+
+    const char * msgs[][2] = {
+        { "{}", "no" },
+        { "{\"a\" : \"1\"}", "yes" },
+        { "{\"b\" : 6}", "yes" },
+        { "{\"b\" : 9}", "no" },
+    };
+
+    for (size_t i = 0; i < sizeof(msgs) / sizeof(msgs[0]); i++) {
+        Message m(msgs[i][0]);
+        EXPECT_EQ(msgs[i][1], tree.exec(m));
+        EXPECT_EQ(msgs[i][1], bytecode.exec(m));
+    }
+
+    try {
+        Rule bad("[\"logical\", { \"type\" : \"XOR\", \"clauses\" : [] }]");
+        FAIL();
+    } catch (const ParseError & pe) {
+        std::ostringstream out;
+        out << pe;
+        EXPECT_NE(std::string::npos, out.str().find("<logical>"));
+    }
+}
+
+TEST(Logical,Adapts) {
+    // the first clause almost never settles the AND, the last nearly always
+    std::vector<Expression *> clauses;
+    clauses.push_back(arena.make<Binary>(Binary::Type::SNE, ml("a"), mv("x")));
+    clauses.push_back(arena.make<Binary>(Binary::Type::SNE, ml("b"), mv("x")));
+    clauses.push_back(arena.make<Binary>(Binary::Type::SEQ, ml("c"), mv("x")));
+
+    Logical * l = arena.make<Logical>(Logical::Type::AND, clauses);
+
+    std::vector<size_t> identity = l->getOrder();
+    EXPECT_EQ(0u, identity[0]);
+    EXPECT_EQ(2u, identity[2]);
+
+    std::vector<std::thread> threads;
+    std::atomic<int> wrong(0);
+
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(std::thread([l, &wrong]() {
+            Message miss("{\"a\" : \"y\", \"b\" : \"y\", \"c\" : \"y\"}");
+            Message hit("{\"a\" : \"y\", \"b\" : \"y\", \"c\" : \"x\"}");
+
+            for (uint32_t i = 0; i < Logical::sampleRate * Logical::adaptEvery; i++) {
+                if (l->eval(miss) || ! l->eval(hit)) wrong++;
+            }
+        }));
+    }
+
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+
+    EXPECT_EQ(0, wrong.load());
+    EXPECT_EQ(2u, l->getOrder()[0]);
+}
+
+TEST(Optimizer,Simplifies) {
+    Expression * a = arena.make<Binary>(Binary::Type::SEQ, ml("a"), mv("1"));
+    Expression * b = arena.make<Binary>(Binary::Type::GT, ml("b"), mv("5"));
+
+    std::vector<Expression *> inner;
+    inner.push_back(a);
+    inner.push_back(b);
+
+    std::vector<Expression *> outer;
+    outer.push_back(arena.make<Logical>(Logical::Type::AND, inner));
+    outer.push_back(arena.make<Binary>(Binary::Type::SEQ, ml("a"), mv("1")));
+
+    // a repeated test of a under a condition which already implies it
+    Statement * retest = arena.make<Conditional>(arena.make<Binary>(Binary::Type::SEQ, ml("a"), mv("1")), mp("p1", ml("a")), mp("p2", ml("a")));
+    Statement * logical = arena.make<Conditional>(arena.make<Logical>(Logical::Type::AND, outer), retest, mp("p3", ml("b")));
+    Statement * root = arena.make<Conditional>(arena.make<Binary>(Binary::Type::EQ, mv("1"), mv("01")), logical, mp("p4", ml("b")));
+
+    Optimizer o(arena);
+    Statement * optimized = o.optimize(root);
+
+    std::ostringstream expected;
+    expected << Conditional(arena.make<Logical>(Logical::Type::AND, inner), mp("p1", ml("a")), mp("p3", ml("b")));
+
+    std::ostringstream actual;
+    actual << *optimized;
+
+    EXPECT_EQ(expected.str(), actual.str());
+    EXPECT_EQ(18u, o.getRemoved());
+
+    const char * msgs[] = {
+        "{}",
+        "{\"a\" : \"1\"}",
+        "{\"b\" : 6}",
+        "{\"a\" : \"1\", \"b\" : 6}",
+    };
+
+    for (size_t i = 0; i < sizeof(msgs) / sizeof(msgs[0]); i++) {
+        Message m(msgs[i]);
+        EXPECT_EQ(root->exec(m), optimized->exec(m));
+    }
+
+    Statement * same = arena.make<Conditional>(a, mp("p", ml("a")), mp("p", ml("a")));
+    EXPECT_EQ(Base::Kind::PRODUCTION, o.optimize(same)->kind());
+
+    Statement * reflexive = arena.make<Conditional>(arena.make<Binary>(Binary::Type::LT, ml("a"), ml("a")), mp("p1", ml("a")), mp("p2", ml("a")));
+    EXPECT_EQ("p2/x?v=", o.optimize(reflexive)->exec(Message("{}")));
+}
+
+TEST(Production,Encodes) {
+    std::string encoded;
+    Url::encode("az-09._~ /?&=%\xc3\xbc", encoded);
+    EXPECT_EQ("az-09._~%20%2F%3F%26%3D%25%C3%BC", encoded);
+
+    std::vector<Arg *> path;
+    std::vector<std::pair<std::string, Arg *> > params;
+
+    path.push_back(mv("a b"));
+    path.push_back(ml("k"));
+    params.push_back(std::make_pair(std::string("c"), mv("1")));
+    params.push_back(std::make_pair(std::string("v"), ml("k")));
+
+    Production p("svc", path, params);
+
+    EXPECT_EQ(2u, p.getSegments().size());
+    EXPECT_EQ("svc/a%20b/", p.getSegments()[0].literal);
+
+    Program program;
+    Compiler compiler(program);
+    compiler.compile(&p);
+
+    Message m("{\"k\" : \"x&y=z\"}");
+    std::string out("prefix:");
+
+    p.exec(m, out);
+    EXPECT_EQ("prefix:svc/a%20b/x%26y%3Dz?c=1&v=x%26y%3Dz", out);
+    EXPECT_EQ(p.exec(m), program.exec(m));
+}
+
 }
 
+std::string conditionalRule(const char * type, const char * key, const char * value, const char * service)
+{
+    std::ostringstream out;
+
+    out << "[\"conditional\", {"
+            "\"condition\" : [\"binary\", {"
+                "\"type\" : \"" << type << "\","
+                "\"left\" : [\"lookup\", { \"key\" : \"" << key << "\" }],"
+                "\"right\" : [\"value\", { \"value\" : \"" << value << "\" }]"
+            "}],"
+            "\"ifTrue\" : [\"production\", {"
+                "\"service\" : \"" << service << "\","
+                "\"path\" : [[\"lookup\", { \"key\" : \"" << key << "\" }]],"
+                "\"params\" : []"
+            "}],"
+            "\"ifFalse\" : [\"production\", {"
+                "\"service\" : \"" << service << "\","
+                "\"path\" : [],"
+                "\"params\" : [[\"miss\", [\"value\", { \"value\" : \"1\" }]]]"
+            "}]"
+        "}]";
+
+    return out.str();
+}
+
+TEST(Rule,Engines) {
+    std::string json(
+        "[\"conditional\", {"
+            "\"condition\" : [\"binary\", {"
+                "\"type\" : \"EQ\","
+                "\"left\" : [\"value\", { \"value\" : 10 }],"
+                "\"right\" : [\"lookup\", { \"key\" : \"foo\" }]"
+            "}],"
+            "\"ifTrue\" : [\"production\", {"
+                "\"service\" : \"bar\","
+                "\"path\" : [[\"value\", { \"value\" : \"baz\" }]],"
+                "\"params\" : [[\"val\", [\"lookup\", { \"key\" : \"bar\" }]]]"
+            "}],"
+            "\"ifFalse\" : [\"production\", {"
+                "\"service\" : \"bar\","
+                "\"path\" : [[\"value\", { \"value\" : \"bop\" }]],"
+                "\"params\" : []"
+            "}]"
+        "}]"
+    );
+
+    Rule tree(json);
+    Rule bytecode(json, Rule::Engine::BYTECODE);
+
+    Message m1("{\"foo\" : 10, \"bar\" : \"baz\" }");
+    Message m2("{\"foo\" : 11, \"bar\" : \"baz\" }");
+
+    EXPECT_EQ("bar/baz?val=baz", tree.exec(m1));
+    EXPECT_EQ("bar/bop", tree.exec(m2));
+    EXPECT_EQ(tree.exec(m1), bytecode.exec(m1));
+    EXPECT_EQ(tree.exec(m2), bytecode.exec(m2));
+}
+
+TEST(RuleSet,SharesPredicates) {
+    RuleSet set;
+    std::vector<std::shared_ptr<Rule> > rules;
+
+    const char * specs[][4] = {
+        { "SEQ", "country", "US", "a" },
+        { "SEQ", "country", "US", "b" },
+        { "SEQ", "country", "CA", "c" },
+        { "GT", "age", "20", "d" },
+        { "GT", "age", "20", "e" },
+    };
+
+    for (size_t i = 0; i < sizeof(specs) / sizeof(specs[0]); i++) {
+        std::string json(conditionalRule(specs[i][0], specs[i][1], specs[i][2], specs[i][3]));
+
+        set.add(json);
+        rules.push_back(std::shared_ptr<Rule>(new Rule(json)));
+    }
+
+    EXPECT_EQ(5u, set.size());
+    EXPECT_EQ(2u, set.getProgram().fields.size());
+    EXPECT_EQ(3u, set.getProgram().predicates.size());
+
+    Message m1("{\"country\" : \"US\", \"age\" : 30}");
+    Message m2("{\"country\" : \"CA\"}");
+    std::vector<std::string> out;
+
+    set.exec(m1, out);
+    ASSERT_EQ(5u, out.size());
+    for (size_t i = 0; i < out.size(); i++) EXPECT_EQ(rules[i]->exec(m1), out[i]);
+    EXPECT_EQ("a/US", out[0]);
+
+    set.exec(m2, out);
+    ASSERT_EQ(5u, out.size());
+    for (size_t i = 0; i < out.size(); i++) EXPECT_EQ(rules[i]->exec(m2), out[i]);
+    EXPECT_EQ("c/CA", out[2]);
+    EXPECT_EQ("d?miss=1", out[3]);
+}
+
+TEST(Pool,Shares) {
+    RuleSet set;
+
+    set.add(conditionalRule("SEQ", "country", "US", "a"));
+    set.add(conditionalRule("SEQ", "country", "US", "b"));
+    set.add(conditionalRule("GT", "age", "20", "c"));
+    set.add("[\"conditional\", {"
+            "\"condition\" : [\"logical\", {\"type\" : \"AND\", \"clauses\" : ["
+                "[\"binary\", {\"type\" : \"SEQ\", \"left\" : [\"lookup\", {\"key\" : \"country\"}], \"right\" : [\"value\", {\"value\" : \"US\"}]}],"
+                "[\"binary\", {\"type\" : \"GT\", \"left\" : [\"lookup\", {\"key\" : \"age\"}], \"right\" : [\"value\", {\"value\" : \"20\"}]}]"
+            "]}],"
+            "\"ifTrue\" : [\"production\", {\"service\" : \"d\", \"path\" : [[\"lookup\", {\"key\" : \"country\"}]], \"params\" : []}],"
+            "\"ifFalse\" : [\"production\", {\"service\" : \"e\", \"path\" : [], \"params\" : []}]"
+        "}]");
+
+    const AST::Conditional * a = static_cast<const AST::Conditional *>(set.getRule(0).getStatement());
+    const AST::Conditional * b = static_cast<const AST::Conditional *>(set.getRule(1).getStatement());
+    const AST::Conditional * c = static_cast<const AST::Conditional *>(set.getRule(2).getStatement());
+    const AST::Conditional * d = static_cast<const AST::Conditional *>(set.getRule(3).getStatement());
+    const AST::Logical * both = static_cast<const AST::Logical *>(d->getCondition());
+
+    EXPECT_EQ(a->getCondition(), b->getCondition());
+    EXPECT_EQ(a->getCondition(), both->getClauses()[0]);
+    EXPECT_EQ(c->getCondition(), both->getClauses()[1]);
+
+    // both comparisons are used twice; the logical only once
+    const Pool & pool = set.getPool();
+    EXPECT_EQ(2u, pool.numShared());
+    EXPECT_NE(AST::Expression::unshared, a->getCondition()->getShared());
+    EXPECT_EQ(AST::Expression::unshared, both->getShared());
+    EXPECT_LT(1.0, pool.getMetrics().dedupRatio());
+    EXPECT_LT(0u, pool.getMetrics().saved);
+
+    const char * jsons[] = {
+        "{\"country\" : \"US\", \"age\" : 30}",
+        "{\"country\" : \"US\", \"age\" : 3}",
+        "{\"country\" : \"NZ\", \"age\" : 30}",
+    };
+
+    AST::Memo memo;
+    std::vector<std::string> trees;
+    std::vector<std::string> program;
+
+    for (size_t i = 0; i < sizeof(jsons) / sizeof(jsons[0]); i++) {
+        Message m(jsons[i], strlen(jsons[i]), set.getSchema());
+
+        set.execTrees(m, trees, memo);
+        set.exec(m, program);
+        EXPECT_EQ(program, trees);
+    }
+
+    // a result stands until the memo moves on to another message
+    Message us(jsons[0]);
+    Message nz(jsons[2]);
+
+    memo.reset(pool.numShared());
+    EXPECT_TRUE(a->getCondition()->eval(us, memo));
+    EXPECT_TRUE(a->getCondition()->eval(nz, memo));
+    memo.reset(pool.numShared());
+    EXPECT_FALSE(a->getCondition()->eval(nz, memo));
+
+    // a parser with a pool makes nothing in its own arena for a repeat
+    Arena arena;
+    Pool own;
+    Parser parser(arena, &own);
+    AST::Base * first = parser.parse(conditionalRule("SEQ", "country", "US", "a"));
+    size_t used = arena.size();
+    AST::Base * second = parser.parse(conditionalRule("SEQ", "country", "US", "b"));
+
+    EXPECT_EQ(static_cast<AST::Conditional *>(first)->getCondition(), static_cast<AST::Conditional *>(second)->getCondition());
+    EXPECT_EQ(2 * used, arena.size());
+    EXPECT_EQ(1u, own.numShared());
+}
+
+TEST(RuleSet,Prefilter) {
+    std::vector<std::string> rules;
+    RuleSet set;
+
+    rules.push_back(conditionalRule("SEQ", "country", "US", "a"));
+    rules.push_back(conditionalRule("SEQ", "country", "", "b"));
+    rules.push_back(conditionalRule("NE", "age", "-1", "c"));
+    rules.push_back(conditionalRule("GT", "age", "20", "d"));
+    rules.push_back("[\"conditional\", {"
+            "\"condition\" : [\"logical\", {\"type\" : \"OR\", \"clauses\" : ["
+                "[\"binary\", {\"type\" : \"SEQ\", \"left\" : [\"lookup\", {\"key\" : \"country\"}], \"right\" : [\"value\", {\"value\" : \"US\"}]}],"
+                "[\"binary\", {\"type\" : \"GT\", \"left\" : [\"lookup\", {\"key\" : \"age\"}], \"right\" : [\"value\", {\"value\" : \"20\"}]}]"
+            "]}],"
+            "\"ifTrue\" : [\"production\", {\"service\" : \"e\", \"path\" : [], \"params\" : []}],"
+            "\"ifFalse\" : [\"production\", {\"service\" : \"f\", \"path\" : [], \"params\" : []}]"
+        "}]");
+    rules.push_back(Generator().ladder(8, 2, 1));
+
+    for (size_t i = 0; i < rules.size(); i++) set.add(rules[i]);
+
+    // an absent key compares as empty, which some conditions accept
+    EXPECT_EQ(std::vector<std::string>(1, "country"), set.getRequired(0));
+    EXPECT_TRUE(set.getRequired(1).empty());
+    EXPECT_TRUE(set.getRequired(2).empty());
+    EXPECT_EQ(std::vector<std::string>(1, "age"), set.getRequired(3));
+    EXPECT_TRUE(set.getRequired(4).empty());
+    EXPECT_EQ(std::vector<std::string>(1, Generator::key(0)), set.getRequired(5));
+
+    const char * jsons[] = {
+        "{\"country\" : \"US\", \"age\" : 30}",
+        "{\"country\" : \"NZ\"}",
+        "{\"age\" : 30, \"k1\" : \"x\"}",
+        "{\"k0\" : \"c3\", \"k1\" : \"y\"}",
+        "{}",
+    };
+
+    AST::Memo memo;
+    std::vector<std::string> filtered;
+    std::vector<std::string> trees;
+    std::vector<std::string> unfiltered;
+
+    for (size_t i = 0; i < sizeof(jsons) / sizeof(jsons[0]); i++) {
+        Message m(jsons[i], strlen(jsons[i]), set.getSchema());
+
+        set.setPrefilter(true);
+        set.exec(m, filtered);
+        set.execTrees(m, trees, memo);
+        set.setPrefilter(false);
+        set.exec(m, unfiltered);
+
+        EXPECT_EQ(unfiltered, filtered);
+        EXPECT_EQ(unfiltered, trees);
+
+        for (size_t j = 0; j < rules.size(); j++) {
+            Rule rule(rules[j]);
+            std::string alone;
+
+            rule.exec(Message(jsons[i]), alone);
+            EXPECT_EQ(alone, filtered[j]);
+        }
+    }
+
+    // a bit per key present, only for messages parsed against a schema
+    Message m(jsons[1], strlen(jsons[1]), set.getSchema());
+    int country = set.getSchema().slot("country");
+    int age = set.getSchema().slot("age");
+
+    EXPECT_TRUE(m.getPresence()[country / 64] >> (country % 64) & 1);
+    EXPECT_FALSE(m.getPresence()[age / 64] >> (age % 64) & 1);
+    EXPECT_TRUE(Message(jsons[1]).getPresence().empty());
+}
+
+TEST(RuleCache,RoundTrip) {
+    std::vector<std::string> json;
+
+    json.push_back(conditionalRule("SEQ", "country", "US", "a"));
+    json.push_back(conditionalRule("GT", "age", "20", "b"));
+    json.push_back(conditionalRule("SEQ", "country", "CA", "c d"));
+    json.push_back(Generator().ladder(Compiler::minSwitchCases, 1, 0));
+
+    std::string path = "/tmp/monty_cache_" + std::to_string((long long)getpid());
+    uint64_t source = RuleCache::hash(json);
+    std::unique_ptr<RuleSet> built(RuleCache::open(path, json));
+    std::unique_ptr<RuleSet> mapped(RuleCache::load(path, source));
+
+    ASSERT_TRUE(mapped.get() != NULL);
+    EXPECT_TRUE(mapped->getProgram().isMapped());
+    EXPECT_FALSE(built->getProgram().isMapped());
+    EXPECT_EQ(4u, mapped->size());
+    EXPECT_EQ(1u, mapped->getProgram().switches.size());
+    EXPECT_EQ(built->getProgram().constants.size(), mapped->getProgram().constants.size());
+    EXPECT_EQ(built->getProgram().fields, mapped->getProgram().fields);
+    EXPECT_EQ(std::vector<std::string>(1, "country"), built->getRequired(0));
+    EXPECT_TRUE(mapped->getRequired(0).empty());
+
+    const char * messages[] = {
+        "{\"country\" : \"US\", \"age\" : 30}",
+        "{\"country\" : \"CA\", \"age\" : 20.5}",
+        "{\"k0\" : \"c2\"}",
+        "{}",
+    };
+
+    for (size_t i = 0; i < sizeof(messages) / sizeof(messages[0]); i++) {
+        Message m1(messages[i], strlen(messages[i]), built->getSchema());
+        Message m2(messages[i], strlen(messages[i]), mapped->getSchema());
+
+        EXPECT_EQ(built->exec(m1), mapped->exec(m2));
+    }
+
+    // a cache built from other rules is stale
+    json.pop_back();
+    EXPECT_TRUE(RuleCache::load(path, RuleCache::hash(json)) == NULL);
+
+    std::string bytes;
+    {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        std::ostringstream all;
+        all << in.rdbuf();
+        bytes = all.str();
+    }
+
+    bytes[bytes.size() - 1] ^= 1;
+    std::ofstream(path.c_str(), std::ios::binary | std::ios::trunc).write(bytes.data(), bytes.size());
+    EXPECT_TRUE(RuleCache::load(path, source) == NULL);
+
+    bytes.resize(bytes.size() / 2);
+    std::ofstream(path.c_str(), std::ios::binary | std::ios::trunc).write(bytes.data(), bytes.size());
+    EXPECT_TRUE(RuleCache::load(path, source) == NULL);
+
+    unlink(path.c_str());
+    EXPECT_TRUE(RuleCache::load(path, source) == NULL);
+}
+
+TEST(RuleCache,UnloadedRegister) {
+    std::string path = "/tmp/monty_cache_" + std::to_string((long long)getpid());
+    RuleSet set;
+
+    set.add(conditionalRule("SEQ", "country", "US", "a"));
+
+    // checksummed like any other file, but comparing registers never loaded
+    Program & program = const_cast<Program &>(set.getProgram());
+
+    ASSERT_EQ(Instruction::PREDICATE, program.code[program.entries[0]].op);
+    program.code[program.entries[0]] = Instruction(Instruction::COMPARE, AST::Binary::Type::SEQ, 0, 1, 0);
+    program.registers = 2;
+
+    ASSERT_TRUE(RuleCache::write(path, set, 1));
+    EXPECT_TRUE(RuleCache::load(path, 1) == NULL);
+
+    unlink(path.c_str());
+}
+
+struct Counted {
+    int & destroyed;
+    double padding;
+
+    Counted(int & destroyed) : destroyed(destroyed), padding(0) { }
+    ~Counted() { destroyed++; }
+};
+
+TEST(Arena,Lifetime) {
+    int destroyed = 0;
+
+    {
+        Arena a(64);
+
+        for (int i = 0; i < 100; i++) {
+            Counted * c = a.make<Counted>(destroyed);
+            EXPECT_EQ(0u, (uintptr_t)c % alignof(Counted));
+        }
+
+        char * big = static_cast<char *>(a.allocate(1000, 1));
+        big[999] = 0;
+
+        EXPECT_LE(100 * sizeof(Counted) + 1000, a.size());
+        EXPECT_EQ(0, destroyed);
+    }
+
+    EXPECT_EQ(100, destroyed);
+}
+
+TEST(Interner,Canonical) {
+    Interner interner;
+    std::string unique = "interner test " + std::to_string((long long)getpid());
+    uint64_t h = Interner::hash(unique.data(), unique.size());
+
+    EXPECT_TRUE(interner.find(unique.data(), unique.size(), h) == NULL);
+
+    Schema schema;
+    schema.add("k");
+    schema.add("other");
+    schema.add("plain");
+    schema.build();
+    schema.setInterner(&interner);
+
+    for (uint32_t i = 0; i < Schema::minTextCompares; i++) {
+        schema.compareText(schema.slot("k"));
+        schema.compareText(schema.slot("other"));
+    }
+
+    // a key compared only now and then isn't worth hashing
+    schema.compareText(schema.slot("plain"));
+
+    std::string json = "{\"k\" : \"" + unique + "\", \"other\" : \"" + unique + "!\", \"plain\" : \"" + unique + "\"}";
+
+    // a message value read before its string is interned takes the slow path
+    Message before(json, schema);
+    EXPECT_FALSE(before.lookup("k").isInterned());
+
+    Scalar constant(unique);
+    constant.intern(interner);
+
+    const std::string * atom = interner.find(unique.data(), unique.size(), h);
+    ASSERT_TRUE(atom != NULL);
+    EXPECT_EQ(unique, *atom);
+    EXPECT_EQ(atom, interner.intern(unique.data(), unique.size(), h));
+
+    Message after(json, schema);
+    EXPECT_TRUE(after.lookup("k").isInterned());
+    EXPECT_FALSE(after.lookup("other").isInterned());
+
+    // only values compared as text, and often, are looked up
+    EXPECT_FALSE(after.lookup("plain").isInterned());
+    EXPECT_FALSE(Message(json).lookup("k").isInterned());
+
+    EXPECT_TRUE(constant.textEquals(after.lookup("k")));
+    EXPECT_TRUE(constant.textEquals(before.lookup("k")));
+    EXPECT_TRUE(constant.textEquals(after.lookup("plain")));
+    EXPECT_FALSE(constant.textEquals(after.lookup("other")));
+    EXPECT_TRUE(Message::empty.textEquals(Scalar("")));
+    EXPECT_TRUE(AST::Binary::compare(AST::Binary::Type::SEQ, before.lookup("k"), after.lookup("k")));
+    EXPECT_TRUE(AST::Binary::compare(AST::Binary::Type::SNE, constant, after.lookup("other")));
+
+    // atoms of another interner are never the same pointer, but equal text is still equal
+    Interner other;
+    Scalar foreign(unique);
+    foreign.intern(other);
+    EXPECT_TRUE(foreign.textEquals(after.lookup("k")));
+    EXPECT_FALSE(foreign.textEquals(after.lookup("other")));
+
+    // a rule set interns its constants in its own pool and counts what it compares
+    RuleSet set;
+
+    for (uint32_t i = 0; i < Schema::minTextCompares; i++) {
+        set.add(conditionalRule("SEQ", "country", ("c" + std::to_string((long long)i)).c_str(), "a"));
+        set.add(conditionalRule("SEQ", "city", "c0", "b"));
+    }
+
+    Message m("{\"country\" : \"c3\", \"city\" : \"c0\"}", set.getSchema());
+    EXPECT_TRUE(m.lookup("country").isInterned());
+    EXPECT_FALSE(m.lookup("city").isInterned());
+    EXPECT_EQ("a/c3", set.exec(m)[6]);
+    EXPECT_EQ("b/c0", set.exec(m)[1]);
+    EXPECT_TRUE(interner.find("c3", 2, Interner::hash("c3", 2)) == NULL);
+
+    // lookups race with growth of the table
+    std::atomic<bool> done(false);
+    std::thread reader([&]() {
+        while (! done) {
+            EXPECT_EQ(atom, interner.find(unique.data(), unique.size(), h));
+        }
+    });
+
+    for (size_t i = 0; i < 5000; i++) {
+        std::string s = unique + " " + std::to_string((long long)i);
+        const std::string * a = interner.intern(s.data(), s.size(), Interner::hash(s.data(), s.size()));
+
+        EXPECT_EQ(s, *a);
+    }
+
+    done = true;
+    reader.join();
+
+    EXPECT_EQ(atom, interner.find(unique.data(), unique.size(), h));
+}
+
+TEST(Schema,PerfectHash) {
+    Schema schema;
+
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_EQ((size_t)i, schema.add("key" + std::to_string(i)));
+    }
+    EXPECT_EQ(5u, schema.add("key5"));
+
+    schema.build();
+
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_EQ(i, schema.slot("key" + std::to_string(i)));
+    }
+    EXPECT_EQ(-1, schema.slot("key1000"));
+    EXPECT_EQ(-1, schema.slot(""));
+}
+
+TEST(Schema,EqualHashes) {
+    // no displacement separates these, so build() has to change seed
+    std::string a("bfab3YwNsnN");
+    std::string b("O3aC8WLl0aI");
+    ASSERT_EQ(Hash::fnv1a(a.data(), a.size()), Hash::fnv1a(b.data(), b.size()));
+
+    Schema schema;
+    schema.add("x");
+    schema.add(a);
+    schema.add(b);
+    schema.add("y");
+    schema.build();
+
+    EXPECT_EQ(0, schema.slot("x"));
+    EXPECT_EQ(1, schema.slot(a));
+    EXPECT_EQ(2, schema.slot(b));
+    EXPECT_EQ(3, schema.slot("y"));
+    EXPECT_EQ(-1, schema.slot("z"));
+
+    Message m("{\"O3aC8WLl0aI\" : 2, \"bfab3YwNsnN\" : 1}", schema);
+    EXPECT_EQ("1", m.get(a));
+    EXPECT_EQ("2", m.get(b));
 }
+
+TEST(Schema,Message) {
+    RuleSet set;
+
+    set.add(conditionalRule("SEQ", "country", "US", "a"));
+    set.add(conditionalRule("GT", "age", "20", "b"));
+
+    std::string json("{\"country\" : \"US\", \"age\" : 30, \"unused\" : \"x\"}");
+    Message plain(json);
+    Message slotted(json, set.getSchema());
+
+    EXPECT_EQ("x", plain.get("unused"));
+    EXPECT_EQ("", slotted.get("unused"));
+    EXPECT_EQ("US", slotted.get("country"));
+    EXPECT_EQ("30", slotted.get("age"));
+
+    EXPECT_EQ(set.exec(plain), set.exec(slotted));
+    EXPECT_EQ("a/US", set.exec(slotted)[0]);
+
+    Rule rule(conditionalRule("SEQ", "country", "US", "a"));
+    Message ruleSlotted(json, rule.getSchema());
+
+    EXPECT_EQ(1u, rule.getSchema().size());
+    EXPECT_EQ("a/US", rule.exec(ruleSlotted));
+    rule.setEngine(Rule::Engine::BYTECODE);
+    EXPECT_EQ("a/US", rule.exec(ruleSlotted));
+}
+
+TEST(JsonScanner,Tokens) {
+    std::string json("{\"a\" : [1, {\"b\" : \"]\\\"}\"}], \"c\\u00e9\" : -1.5e3, \"d\" : true}");
+    JsonScanner scanner(json.data(), json.size());
+
+    EXPECT_EQ(JsonScanner::Token::OBJECT_BEGIN, scanner.next());
+    EXPECT_EQ(JsonScanner::Token::STRING, scanner.next());
+    EXPECT_EQ("a", std::string(scanner.start(), scanner.length()));
+
+    JsonScanner::Token t = scanner.next();
+    EXPECT_EQ(JsonScanner::Token::ARRAY_BEGIN, t);
+    EXPECT_TRUE(scanner.skip(t));
+
+    EXPECT_EQ(JsonScanner::Token::STRING, scanner.next());
+    EXPECT_TRUE(scanner.escaped());
+
+    std::string key;
+    EXPECT_TRUE(JsonScanner::unescape(scanner.start(), scanner.length(), key));
+    EXPECT_EQ("c\xc3\xa9", key);
+
+    EXPECT_EQ(JsonScanner::Token::NUMBER, scanner.next());
+    EXPECT_EQ("-1.5e3", std::string(scanner.start(), scanner.length()));
+    EXPECT_EQ(JsonScanner::Token::STRING, scanner.next());
+    EXPECT_EQ(JsonScanner::Token::TRUE, scanner.next());
+    EXPECT_EQ(JsonScanner::Token::OBJECT_END, scanner.next());
+    EXPECT_EQ(JsonScanner::Token::END, scanner.next());
+}
+
+TEST(Message,Projection) {
+    Schema schema;
+    schema.add("b");
+    schema.add("d");
+    schema.build();
+
+    // everything after the last wanted key is never looked at
+    std::string json("{\"a\" : {\"x\" : [1, 2, \"}\"]}, \"b\" : \"q\\\"t\", \"c\" : 1, \"d\" : 12345678901234, \"e\" : !!!");
+    Message m(json, schema);
+
+    EXPECT_EQ("q\"t", m.get("b"));
+    EXPECT_EQ(12345678901234LL, m.lookup("d").getInteger());
+    EXPECT_EQ("", m.get("a"));
+    EXPECT_EQ("", m.get("c"));
+
+    Message full(json);
+    EXPECT_EQ("", full.get("b"));
+
+    Message plain("{\"a\" : {\"x\" : 1}, \"b\" : 2.50}");
+    EXPECT_EQ("", plain.get("a"));
+    EXPECT_EQ("2.50", plain.get("b"));
+    EXPECT_EQ(Scalar::Type::DOUBLE, plain.lookup("b").getType());
+}
+
+TEST(Message,Malformed) {
+    Schema both;
+    both.add("a");
+    both.add("b");
+    both.build();
+
+    Schema skipped;
+    skipped.add("b");
+    skipped.add("c");
+    skipped.build();
+
+    const char * jsons[] = {
+        "{\"a\" : [1, 2}, \"b\" : 3}",
+        "{\"a\" : {\"x\" : 1]], \"b\" : 3}",
+        "{\"a\" 1, \"b\" : 3}",
+        "{\"a\" : [1 2], \"b\" : 3}",
+        "{\"a\" : 1 \"b\" : 3}",
+        "{\"a\" : 1,, \"b\" : 3}",
+        "{\"a\" : [1, ], \"b\" : 3}",
+        "{\"a\" : {\"x\" : 1, }, \"b\" : 3}",
+        "{\"a\" : {1 : 2}, \"b\" : 3}",
+        "{\"a\" : truex, \"b\" : 3}",
+    };
+
+    for (size_t i = 0; i < sizeof(jsons) / sizeof(jsons[0]); i++) {
+        EXPECT_EQ("", Message(jsons[i]).get("b")) << jsons[i];
+        EXPECT_EQ("", Message(jsons[i], both).get("b")) << jsons[i];
+        EXPECT_EQ("", Message(jsons[i], skipped).get("b")) << jsons[i];
+    }
+
+    EXPECT_EQ("3", Message("{\"a\" : [1, {\"x\" : []}], \"b\" : 3}", skipped).get("b"));
+
+    // an error past the last wanted key isn't reached
+    EXPECT_EQ("", Message("{\"a\" : 1, \"b\" : 3,}").get("b"));
+    EXPECT_EQ("3", Message("{\"a\" : 1, \"b\" : 3,}", both).get("b"));
+}
+
+TEST(Message,Paths) {
+    std::string json(
+        "{\"user\" : {\"name\" : \"ann\", \"geo\" : {\"country\" : \"NZ\", \"zip\" : 6011}, \"a/b\" : true},"
+        " \"items\" : [{\"sku\" : \"x1\"}, {\"sku\" : \"y\\u0032\", \"n\" : 3}],"
+        " \"tags.flat\" : \"exact\", \"tags\" : {\"flat\" : \"nested\"}, \"junk\" : [1, {\"country\" : 0}]}");
+
+    const char * paths[][2] = {
+        { "user.geo.country", "NZ" },
+        { "/user/geo/country", "NZ" },
+        { "user.geo.zip", "6011" },
+        { "/user/a~1b", "1" },
+        { "items.1.sku", "y2" },
+        { "/items/0/sku", "x1" },
+        { "items.1.n", "3" },
+        { "tags.flat", "exact" },
+        { "user.geo", "" },
+        { "user.missing", "" },
+        { "items.2.sku", "" },
+        { "items.x", "" },
+        { "/user/name", "ann" },
+        { "nobody.name", "" },
+    };
+
+    Schema schema;
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) schema.add(paths[i][0]);
+    schema.build();
+
+    Message m(json, schema);
+    Message plain(json);
+
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        EXPECT_EQ(paths[i][1], m.get(paths[i][0])) << paths[i][0];
+        EXPECT_EQ(paths[i][1], plain.get(paths[i][0])) << paths[i][0];
+    }
+
+    EXPECT_EQ(6011, m.lookup("user.geo.zip").getInteger());
+    EXPECT_TRUE(m.find("user.missing") == NULL);
+    EXPECT_TRUE(m.find("user.geo") != NULL);
+
+    // an unmatched value is skipped, not kept
+    EXPECT_EQ(Scalar::Type::BOOLEAN, plain.lookup("/user/a~1b").getType());
+
+    Rule rule(conditionalRule("SEQ", "user.geo.country", "NZ", "geo"), Rule::Engine::BYTECODE);
+    EXPECT_EQ("geo/NZ", rule.exec(Message(json, rule.getSchema())));
+    EXPECT_EQ("geo?miss=1", rule.exec(Message("{\"user\" : {\"geo\" : {}}}", rule.getSchema())));
+    EXPECT_EQ("geo/NZ", rule.exec(Message("{\"user.geo.country\" : \"NZ\"}", rule.getSchema())));
+}
+
+TEST(Message,ResetAllocates) {
+    RuleSet set;
+
+    set.add(conditionalRule("SEQ", "country", "US", "a"));
+    set.add(conditionalRule("GT", "age", "20", "b"));
+    set.add(conditionalRule("SEQ", "user.geo.country", "NZ", "c"));
+
+    const char * jsons[] = {
+        "{\"country\" : \"US\", \"age\" : 30, \"unused\" : \"x\"}",
+        "{\"age\" : 12.5, \"country\" : \"a rather longer country name\"}",
+        "{\"co\\u0075ntry\" : \"escaped \\\"value\\\" longer than a short string\", \"age\" : true}",
+        "{\"user\" : {\"name\" : \"somebody with a long name\", \"geo\" : {\"country\" : \"NZ\"}}, \"age\" : 99}",
+        "not json at all",
+    };
+    const size_t n = sizeof(jsons) / sizeof(jsons[0]);
+
+    Message m(set.getSchema());
+    std::vector<std::string> out;
+    Frame frame;
+
+    // the first pass grows every buffer to fit
+    for (size_t i = 0; i < n; i++) {
+        m.reset(jsons[i], strlen(jsons[i]));
+        set.exec(m, out, frame);
+    }
+
+    size_t before = allocations;
+
+    for (size_t round = 0; round < 100; round++) {
+        for (size_t i = 0; i < n; i++) {
+            m.reset(jsons[i], strlen(jsons[i]));
+            set.exec(m, out, frame);
+        }
+    }
+
+    EXPECT_EQ(0u, allocations - before);
+
+    m.reset(jsons[3], strlen(jsons[3]));
+    set.exec(m, out, frame);
+    EXPECT_EQ("b/99", out[1]);
+    EXPECT_EQ("c/NZ", out[2]);
+
+    m.reset(jsons[2], strlen(jsons[2]));
+    EXPECT_EQ("escaped \"value\" longer than a short string", m.get("country"));
+    EXPECT_EQ("", m.get("user.geo.country"));
+
+    // a fresh message allocates, so the count above means something
+    before = allocations;
+    {
+        Message fresh(jsons[0], strlen(jsons[0]), set.getSchema());
+    }
+    EXPECT_LT(before, (size_t)allocations);
+
+    // rebinding to another schema reuses what it can
+    Schema other;
+    other.add("age");
+    other.build();
+
+    m.reset(jsons[0], strlen(jsons[0]), other);
+    EXPECT_EQ("30", m.get("age"));
+    EXPECT_EQ("", m.get("country"));
+}
+
+TEST(Batch,MatchesTree) {
+    std::vector<std::shared_ptr<Rule> > rules;
+    const char * ops[] = { "EQ", "NE", "LT", "LE", "GT", "GE", "SEQ", "SNE", "SLT", "SGE" };
+
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        rules.push_back(std::shared_ptr<Rule>(new Rule(conditionalRule(ops[i], "x", "7", "s"))));
+        rules.push_back(std::shared_ptr<Rule>(new Rule(conditionalRule(ops[i], "x", "2.5", "s"))));
+    }
+
+    std::vector<Message> messages;
+    const char * values[] = { "7", "6", "8", "2.5", "2.4", "\"7\"", "\"70\"", "\"abc\"", "true", "-9007199254740993", "null" };
+
+    for (size_t i = 0; i < 150; i++) {
+        messages.push_back(Message(std::string("{\"x\" : ") + values[(i * 7) % 11] + "}"));
+    }
+    messages.push_back(Message("{}"));
+
+    std::vector<const Message *> ptrs;
+    for (size_t i = 0; i < messages.size(); i++) ptrs.push_back(&messages[i]);
+
+    for (size_t r = 0; r < rules.size(); r++) {
+        std::vector<std::string> out;
+
+        rules[r]->exec(ptrs, out);
+
+        ASSERT_EQ(messages.size(), out.size());
+        for (size_t i = 0; i < messages.size(); i++) {
+            EXPECT_EQ(rules[r]->exec(messages[i]), out[i]) << "rule " << r << " message " << i;
+        }
+    }
+}
+
+/* Differential test of the native backend: it must produce exactly what the
+ * tree interpreter does, over random rules and messages and the edge values
+ * from Batch.MatchesTree. */
+TEST(Native,MatchesTree) {
+    Generator g(7);
+    std::vector<std::string> json;
+    const char * ops[] = { "EQ", "NE", "LT", "LE", "GT", "GE", "SEQ", "SNE", "SLT", "SGE" };
+
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        json.push_back(conditionalRule(ops[i], "k0", "7", "s"));
+        json.push_back(conditionalRule(ops[i], "k0", "2.5", "s t"));
+    }
+
+    for (size_t i = 0; i < 40; i++) json.push_back(g.rule(1 + g.below(6), 8, g.below(3)));
+
+    RuleSet set;
+    std::vector<std::shared_ptr<Rule> > rules;
+
+    for (size_t i = 0; i < json.size(); i++) {
+        set.add(json[i]);
+        rules.push_back(std::shared_ptr<Rule>(new Rule(json[i])));
+    }
+
+    set.compileNative();
+    ASSERT_TRUE(set.isNative());
+
+    // the unshared, register based program of a single rule
+    Rule single(json.back(), Rule::Engine::NATIVE);
+
+    std::vector<std::string> messages;
+    const char * values[] = { "7", "6", "8", "2.5", "2.4", "\"7\"", "\"70\"", "\"abc\"", "true", "-9007199254740993", "null" };
+
+    for (size_t i = 0; i < 11; i++) messages.push_back(std::string("{\"k0\" : ") + values[i] + "}");
+    for (size_t i = 0; i < 200; i++) messages.push_back(g.message(8));
+    messages.push_back("{}");
+
+    std::vector<std::string> out;
+
+    for (size_t i = 0; i < messages.size(); i++) {
+        Message m(messages[i], set.getSchema());
+        Message plain(messages[i]);
+
+        set.exec(m, out);
+        ASSERT_EQ(rules.size(), out.size());
+
+        for (size_t r = 0; r < rules.size(); r++) {
+            EXPECT_EQ(rules[r]->exec(plain), out[r]) << "rule " << r << " message " << messages[i];
+        }
+
+        EXPECT_EQ(rules.back()->exec(plain), single.exec(plain));
+    }
+}
+
+TEST(Native,PathsAreNotShellWords) {
+    std::string dir = "/tmp/monty native;exit 1;$(false)" + std::to_string((long long)getpid());
+    const char * saved = getenv("TMPDIR");
+    std::string old = saved ? saved : "";
+    RuleSet set;
+
+    set.add(conditionalRule("SEQ", "country", "US", "a"));
+
+    ASSERT_EQ(0, mkdir(dir.c_str(), 0700));
+    setenv("TMPDIR", dir.c_str(), 1);
+
+    set.compileNative();
+
+    if (saved) {
+        setenv("TMPDIR", old.c_str(), 1);
+    } else {
+        unsetenv("TMPDIR");
+    }
+
+    EXPECT_EQ(0, rmdir(dir.c_str()));
+    ASSERT_TRUE(set.isNative());
+    EXPECT_EQ("a/US", set.exec(Message("{\"country\" : \"US\"}", set.getSchema()))[0]);
+}
+
+TEST(Stats,Histogram) {
+    for (uint64_t v = 0; v < 100000; v = v * 5 / 4 + 1) {
+        size_t b = Histogram::bucket(v);
+
+        EXPECT_LE(Histogram::lower(b), v);
+        EXPECT_GE(Histogram::upper(b), v);
+    }
+
+    EXPECT_EQ(Histogram::buckets - 1, Histogram::bucket(UINT64_MAX));
+}
+
+TEST(Stats,Counts) {
+    Rule rule(conditionalRule("GT", "age", "20", "a"));
+    const AST::Conditional * c = static_cast<const AST::Conditional *>(rule.getStatement());
+
+    rule.enableStats();
+
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(std::thread([&rule, t]() {
+            Message young("{\"age\" : 10}");
+            Message old("{\"age\" : 30}");
+
+            for (int i = 0; i < 100; i++) {
+                EXPECT_EQ("a?miss=1", rule.exec(young));
+                if (i % 4 == 0) {
+                    EXPECT_EQ("a/30", rule.exec(old));
+                }
+            }
+        }));
+    }
+
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+
+    const RuleStats & stats = *rule.getStats();
+
+    EXPECT_EQ(500u, stats.getCount());
+    EXPECT_EQ(500u, stats.getEvaluations(c));
+    EXPECT_EQ(100u, stats.getHits(c));
+    EXPECT_EQ(500u, stats.getEvaluations(c->getCondition()));
+    EXPECT_EQ(100u, stats.getHits(c->getCondition()));
+    EXPECT_EQ(100u, stats.getEvaluations(c->getIfTrue()));
+    EXPECT_EQ(400u, stats.getEvaluations(c->getIfFalse()));
+
+    RuleSet set;
+    set.add(conditionalRule("SEQ", "country", "US", "a"));
+    set.enableStats();
+    set.add(conditionalRule("GT", "age", "20", "b"));
+
+    std::vector<std::string> out;
+    set.exec(Message("{\"country\" : \"US\", \"age\" : 30}"), out);
+    EXPECT_EQ("a/US", out[0]);
+    EXPECT_EQ("b/30", out[1]);
+    EXPECT_EQ(1u, set.getStats(1).getCount());
+
+    std::ostringstream json;
+    set.dumpStats(json);
+
+    json_object * parsed = json_tokener_parse(json.str().c_str());
+    ASSERT_TRUE(parsed != NULL);
+    EXPECT_EQ(2u, (size_t)json_object_array_length(json_object_object_get(parsed, "rules")));
+    json_object_put(parsed);
+}
+
+TEST(Stats,LearnedOrder) {
+    Rule rule("[\"conditional\", {"
+            "\"condition\" : [\"logical\", {\"type\" : \"AND\", \"clauses\" : ["
+                "[\"binary\", {\"type\" : \"SNE\", \"left\" : [\"lookup\", {\"key\" : \"a\"}], \"right\" : [\"value\", {\"value\" : \"x\"}]}],"
+                "[\"binary\", {\"type\" : \"SEQ\", \"left\" : [\"lookup\", {\"key\" : \"c\"}], \"right\" : [\"value\", {\"value\" : \"x\"}]}]"
+            "]}],"
+            "\"ifTrue\" : [\"production\", {\"service\" : \"a\", \"path\" : [], \"params\" : []}],"
+            "\"ifFalse\" : [\"production\", {\"service\" : \"b\", \"path\" : [], \"params\" : []}]"
+        "}]");
+    const AST::Conditional * c = static_cast<const AST::Conditional *>(rule.getStatement());
+    const AST::Logical * l = static_cast<const AST::Logical *>(c->getCondition());
+    Message miss("{\"a\" : \"y\", \"c\" : \"y\"}");
+
+    // the second clause settles every miss, so it comes to be evaluated first
+    for (uint32_t i = 0; i < 4 * AST::Logical::sampleRate * AST::Logical::adaptEvery; i++) l->eval(miss);
+    ASSERT_EQ(1u, l->getOrder()[0]);
+
+    rule.enableStats();
+    for (int i = 0; i < 10; i++) EXPECT_EQ("b", rule.exec(miss));
+
+    const RuleStats & stats = *rule.getStats();
+
+    EXPECT_EQ(10u, stats.getEvaluations(l->getClauses()[1]));
+    EXPECT_EQ(0u, stats.getEvaluations(l->getClauses()[0]));
+}
+
+TEST(ProductionCache,Hits) {
+    Rule rule(conditionalRule("GT", "age", "20", "a"));
+    Rule uncached(conditionalRule("GT", "age", "20", "a"));
+
+    rule.setCache(64 * 1024);
+
+    // fields the rule never reads don't change the key
+    for (int i = 0; i < 100; i++) {
+        std::ostringstream json;
+        json << "{\"age\" : " << (i % 2 ? 30 : 10) << ", \"id\" : " << i << "}";
+
+        Message m(json.str());
+        EXPECT_EQ(uncached.exec(m), rule.exec(m));
+    }
+
+    ProductionCache::Metrics m = rule.getCache()->getMetrics();
+    EXPECT_EQ(98u, m.hits);
+    EXPECT_EQ(2u, m.misses);
+    EXPECT_EQ(2u, m.entries);
+    EXPECT_DOUBLE_EQ(0.98, m.hitRate());
+
+    // a missing field, or one of another type, is a different key
+    EXPECT_EQ("a?miss=1", rule.exec(Message("{}")));
+    EXPECT_EQ("a/30", rule.exec(Message("{\"age\" : \"30\"}")));
+    EXPECT_EQ(4u, rule.getCache()->getMetrics().misses);
+
+    // a budget of a few entries per shard has to evict
+    rule.setCache(16 * (ProductionCache::entryOverhead + 32) * 2);
+
+    for (int i = 0; i < 1000; i++) {
+        std::ostringstream json;
+        json << "{\"age\" : " << i << "}";
+
+        Message msg(json.str());
+        EXPECT_EQ(uncached.exec(msg), rule.exec(msg));
+    }
+
+    m = rule.getCache()->getMetrics();
+    EXPECT_EQ(1000u, m.misses);
+    EXPECT_LT(0u, m.evictions);
+    EXPECT_LE(m.bytes, 16u * (ProductionCache::entryOverhead + 32) * 2);
+}
+
+TEST(Processor,PreservesOrder) {
+    RuleSet * rules = new RuleSet();
+    rules->add(conditionalRule("GT", "n", "500", "big"));
+    rules->add(conditionalRule("SEQ", "s", "x", "x"));
+
+    LiveRuleSet live(rules);
+    const RuleSet & set = *rules;
+
+    std::string input;
+    std::string expected;
+
+    for (int i = 0; i < 20001; i++) {
+        std::ostringstream line;
+        line << "{\"n\" : " << i % 1000 << ", \"s\" : \"" << (i % 3 ? "x" : "y") << "\"}";
+
+        // blank lines, CRLF and a missing final newline are all accepted
+        input += line.str() + (i % 7 ? "\n" : "\r\n\n");
+
+        std::vector<std::string> out = set.exec(Message(line.str(), set.getSchema()));
+        for (size_t r = 0; r < out.size(); r++) expected += out[r] + "\n";
+    }
+    input.erase(input.size() - 1);
+
+    FILE * in = tmpfile();
+    FILE * out = tmpfile();
+    ASSERT_TRUE(in && out);
+
+    fwrite(input.data(), 1, input.size(), in);
+    fflush(in);
+    rewind(in);
+
+    Processor processor(live, 4);
+    EXPECT_TRUE(processor.run(fileno(in), fileno(out)));
+
+    std::string actual(expected.size() + 1, 0);
+    rewind(out);
+    actual.resize(fread(&actual[0], 1, actual.size(), out));
+
+    EXPECT_TRUE(expected == actual);
+
+    fclose(in);
+    fclose(out);
+}
+
+TEST(LiveRuleSet,ReloadUnderLoad) {
+    LiveRuleSet live(new RuleSet());
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> evaluations(0);
+    std::vector<std::thread> readers;
+
+    live.reload(std::vector<std::string>(1, conditionalRule("GE", "n", "0", "v0")));
+
+    for (int t = 0; t < 4; t++) {
+        readers.push_back(std::thread([&]() {
+            Message m("{\"n\" : 1}");
+            std::vector<std::string> out;
+            int last = 0;
+
+            while (! stop) {
+                LiveRuleSet::Reader set(live);
+
+                // a nested reader pins nothing new and sees a set at least as new
+                LiveRuleSet::Reader inner(live);
+
+                set->exec(m, out);
+                ASSERT_EQ(1u, out.size());
+                ASSERT_EQ('v', out[0][0]);
+
+                // versions are published in order, so never go backwards
+                int version = atoi(out[0].c_str() + 1);
+                EXPECT_GE(version, last);
+                last = version;
+
+                evaluations++;
+            }
+        }));
+    }
+
+    for (int v = 1; v <= 300; v++) {
+        std::ostringstream service;
+        service << "v" << v;
+
+        live.reload(std::vector<std::string>(1, conditionalRule("GE", "n", "0", service.str().c_str())));
+    }
+
+    stop = true;
+    for (size_t t = 0; t < readers.size(); t++) readers[t].join();
+
+    EXPECT_LT(0u, evaluations.load());
+    EXPECT_EQ(0u, live.reclaim());
+
+    LiveRuleSet::Reader set(live);
+    EXPECT_EQ("v300/1", set->exec(Message("{\"n\" : 1}"))[0]);
+}
+
+
+// counts how many have been destroyed
+class CountedRuleSet: public RuleSet {
+    std::atomic<int> & freed;
+
+public:
+    CountedRuleSet(std::atomic<int> & freed) : freed(freed) { }
+    ~CountedRuleSet() { freed++; }
+};
+
+TEST(LiveRuleSet,LastReaderFrees) {
+    std::atomic<int> freed(0);
+    LiveRuleSet live(new CountedRuleSet(freed));
+    std::mutex lock;
+    std::condition_variable changed;
+    bool reading = false;
+    bool published = false;
+
+    std::thread reader([&]() {
+        LiveRuleSet::Reader set(live);
+        std::unique_lock<std::mutex> guard(lock);
+
+        reading = true;
+        changed.notify_all();
+        changed.wait(guard, [&]() { return published; });
+    });
+
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&]() { return reading; });
+    }
+
+    live.publish(new CountedRuleSet(freed));
+    EXPECT_EQ(0, freed.load());
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        published = true;
+        changed.notify_all();
+    }
+
+    // the reader leaving frees the old set, with no second publish
+    reader.join();
+    EXPECT_EQ(1, freed.load());
+
+    // threads that have exited give up their slots to later ones
+    for (int t = 0; t < 8; t++) {
+        std::thread([&]() { LiveRuleSet::Reader set(live); }).join();
+    }
+
+    std::ostringstream out;
+    out << live;
+    EXPECT_NE(std::string::npos, out.str().find("readers=0, slots=1,"));
+}
+
+// holds every batch sent until the test finishes it
+class HeldTransport: public Transport {
+    std::mutex lock;
+    std::deque<std::pair<const Delivery *, Done> > held;
+
+public:
+    size_t most;
+
+    HeldTransport() : most(0) { }
+
+    virtual void send(const Delivery & batch, const Done & done)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        held.push_back(std::make_pair(&batch, done));
+        most = std::max(most, held.size());
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        return held.size();
+    }
+
+    // finishes the oldest batch once one arrives, returning its urls
+    std::vector<std::string> finish(bool ok)
+    {
+        while (size() == 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        std::unique_lock<std::mutex> guard(lock);
+        std::pair<const Delivery *, Done> b = held.front();
+        std::vector<std::string> urls = b.first->urls;
+
+        held.pop_front();
+        guard.unlock();
+
+        b.second(ok);
+
+        return urls;
+    }
+};
+
+TEST(Dispatcher,Batches) {
+    HeldTransport transport;
+    Dispatcher::Limits limits;
+
+    limits.batchSize = 3;
+    limits.window = 60000000000ULL;
+    limits.inFlight = 1;
+    limits.pending = 4;
+
+    Dispatcher d(transport, limits);
+
+    d.submit("a/1");
+    d.submit("a/1");
+    d.submit("");
+    d.submit("b/x?y=1");
+    d.submit("a/2");
+    EXPECT_EQ(0u, transport.size());
+
+    // the third distinct url closes a's batch
+    d.submit("a/3");
+    EXPECT_EQ(1u, transport.size());
+
+    // four urls are held, so this waits for a delivery
+    std::atomic<bool> submitted(false);
+    std::thread blocked([&]() {
+        d.submit("c/1");
+        submitted = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_FALSE(submitted);
+
+    std::vector<std::string> expected;
+    expected.push_back("a/1");
+    expected.push_back("a/2");
+    expected.push_back("a/3");
+    EXPECT_EQ(expected, transport.finish(true));
+
+    // waiting closed b's batch early; it goes out once a's is done
+    blocked.join();
+    EXPECT_TRUE(submitted);
+    EXPECT_EQ(std::vector<std::string>(1, "b/x?y=1"), transport.finish(false));
+
+    std::thread flusher([&]() { d.flush(); });
+    EXPECT_EQ(std::vector<std::string>(1, "c/1"), transport.finish(true));
+    flusher.join();
+
+    EXPECT_EQ(1u, transport.most);
+
+    Dispatcher::Counts a = d.getCounts("a");
+    EXPECT_EQ(4u, a.productions);
+    EXPECT_EQ(1u, a.coalesced);
+    EXPECT_EQ(1u, a.batches);
+    EXPECT_EQ(3u, a.urls);
+    EXPECT_EQ(4u, a.delivered);
+    EXPECT_EQ(0u, a.failed);
+
+    EXPECT_EQ(1u, d.getCounts("b").failed);
+    EXPECT_EQ(1u, d.getCounts("c").delivered);
+    EXPECT_EQ(0u, d.getCounts("d").productions);
+
+    std::ostringstream json;
+    d.dump(json);
+    EXPECT_NE(std::string::npos, json.str().find("\"a\":{\"productions\":4,\"coalesced\":1,\"batches\":1,\"urls\":3,\"delivered\":4,\"failed\":0,"));
+}
+
+TEST(Dispatcher,Loopback) {
+    LoopbackServer server;
+    HttpTransport http("127.0.0.1", server.getPort(), 2);
+    RuleSet set;
+
+    set.add(conditionalRule("SEQ", "country", "US", "a"));
+    set.add(conditionalRule("GT", "age", "20", "b"));
+
+    const char * jsons[] = {
+        "{\"country\" : \"US\", \"age\" : 30}",
+        "{\"country\" : \"NZ\", \"age\" : 30}",
+        "{\"country\" : \"US\", \"age\" : 45}",
+    };
+
+    Dispatcher::Limits limits;
+    limits.window = 60000000000ULL;
+
+    {
+        Dispatcher d(http, limits);
+
+        for (int i = 0; i < 10; i++) {
+            for (size_t j = 0; j < sizeof(jsons) / sizeof(jsons[0]); j++) d.submit(set.exec(Message(jsons[j])));
+        }
+
+        d.flush();
+
+        std::vector<std::string> requests = server.getRequests();
+        std::sort(requests.begin(), requests.end());
+
+        const char * expected[] = { "/a/US", "/a?miss=1", "/b/30", "/b/45" };
+        EXPECT_EQ(std::vector<std::string>(expected, expected + 4), requests);
+
+        EXPECT_EQ(30u, d.getCounts("a").delivered);
+        EXPECT_EQ(28u, d.getCounts("b").coalesced);
+
+        server.setStatus(503);
+        d.submit("a/down");
+        d.flush();
+        EXPECT_EQ(1u, d.getCounts("a").failed);
+        server.setStatus(200);
+    }
+
+    // a short window sends without being flushed
+    limits.window = 1000000;
+    Dispatcher d(http, limits);
+
+    d.submit("w/1");
+    EXPECT_TRUE(server.wait(6, 10000));
+    EXPECT_EQ("/w/1", server.getRequests().back());
+
+    // connections are kept alive between batches
+    EXPECT_GE(2u, server.getConnections());
+}
+
+
+// sends urls as one batch and waits for the outcome
+bool deliver(HttpTransport & http, const char * const * urls, size_t n)
+{
+    Delivery batch;
+    std::mutex lock;
+    std::condition_variable finished;
+    int outcome = -1;
+
+    batch.urls.assign(urls, urls + n);
+
+    http.send(batch, [&](bool ok) {
+        std::lock_guard<std::mutex> guard(lock);
+        outcome = ok;
+        finished.notify_all();
+    });
+
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [&] { return outcome >= 0; });
+
+    return outcome == 1;
+}
+
+TEST(HttpTransport,Chunked) {
+    LoopbackServer server;
+    HttpTransport http("127.0.0.1", server.getPort(), 1);
+
+    server.setResponse("/k/1", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5;x=y\r\nhello\r\nA\r\n0123456789\r\n0\r\n\r\n");
+    server.setResponse("/k/2", "HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip, Chunked\r\nContent-Length: 99\r\n\r\n3\r\nabc\r\n0\r\nX-Trailer: t\r\n\r\n");
+
+    const char * urls[] = { "k/1", "k/2", "k/3" };
+    EXPECT_TRUE(deliver(http, urls, 3));
+    EXPECT_TRUE(deliver(http, urls + 2, 1));
+    EXPECT_EQ(1u, server.getConnections());
+
+    // a response without a length runs to the close
+    server.setResponse("/k/4", "HTTP/1.1 200 OK\r\n\r\nall of it", true);
+
+    const char * ended[] = { "k/4" };
+    EXPECT_TRUE(deliver(http, ended, 1));
+
+    server.setResponse("/k/5", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n");
+    const char * bad[] = { "k/5" };
+    EXPECT_FALSE(deliver(http, bad, 1));
+}
+
+TEST(HttpTransport,Bodyless) {
+    LoopbackServer server;
+    HttpTransport http("127.0.0.1", server.getPort(), 1);
+
+    // whatever length they claim, none of these has a body
+    server.setResponse("/n/1", "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 204 No Content\r\nContent-Length: 3\r\n\r\n");
+    server.setResponse("/n/3", "HTTP/1.1 304 Not Modified\r\nContent-Length: 12\r\n\r\n");
+
+    const char * urls[] = { "n/1", "n/2" };
+    EXPECT_TRUE(deliver(http, urls, 2));
+
+    // not 2xx, but the responses behind it still line up
+    const char * modified[] = { "n/3", "n/4" };
+    EXPECT_FALSE(deliver(http, modified, 2));
+    EXPECT_TRUE(deliver(http, urls + 1, 1));
+    EXPECT_EQ(1u, server.getConnections());
+    EXPECT_EQ(5u, server.getRequests().size());
+}
+
+TEST(HttpTransport,Head) {
+    LoopbackServer server;
+    HttpTransport http("127.0.0.1", server.getPort(), 1, HttpTransport::HEAD);
+
+    server.setResponse("/h/1", "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n");
+    server.setResponse("/h/2", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+
+    const char * urls[] = { "h/1", "h/2", "h/3" };
+    EXPECT_TRUE(deliver(http, urls, 3));
+    EXPECT_TRUE(deliver(http, urls, 1));
+    EXPECT_EQ(1u, server.getConnections());
+}
+
+TEST(HttpTransport,CloseMidBatch) {
+    LoopbackServer server;
+    HttpTransport http("127.0.0.1", server.getPort(), 1);
+
+    server.setResponse("/c/2", "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", true);
+
+    // only the urls after the close are sent again
+    const char * urls[] = { "c/1", "c/2", "c/3", "c/4" };
+    EXPECT_TRUE(deliver(http, urls, 4));
+
+    const char * expected[] = { "/c/1", "/c/2", "/c/3", "/c/4" };
+    EXPECT_EQ(std::vector<std::string>(expected, expected + 4), server.getRequests());
+    EXPECT_EQ(2u, server.getConnections());
+
+    // a failure before the close still fails the batch
+    server.setResponse("/c/5", "HTTP/1.1 503 Error\r\nContent-Length: 0\r\n\r\n");
+    const char * failing[] = { "c/5", "c/2", "c/6" };
+    EXPECT_FALSE(deliver(http, failing, 3));
+    EXPECT_EQ(7u, server.getRequests().size());
+    EXPECT_EQ(3u, server.getConnections());
+}
+
 }
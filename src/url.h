@@ -0,0 +1,25 @@
+#ifndef MONTY_URL_H
+#define MONTY_URL_H
+
+#include <string>
+#include <stddef.h>
+
+namespace Monty {
+namespace Url {
+
+/* Appends s to out percent-encoded as RFC 3986 requires for a path segment
+ * or query value: everything but the unreserved characters ALPHA, DIGIT,
+ * "-", ".", "_" and "~" becomes %XX.  Runs of unreserved characters are
+ * copied in one append, so text that needs no escaping costs one table
+ * lookup per byte. */
+void encode(const char * s, size_t len, std::string & out);
+
+inline void encode(const std::string & s, std::string & out)
+{
+    encode(s.data(), s.size(), out);
+}
+
+}
+}
+
+#endif